@@ -7,148 +7,881 @@
  * Author: Tomaz Zaman <tomaz@mono.si>
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <sys/inotify.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <syslog.h>
 #include <signal.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <dirent.h>
 #include <limits.h>
+#include <math.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stddef.h>
+#include <net/if.h>
+#include <linux/if.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
-#define MAX_PORTS 2
 #define MAX_NETDEV_NAME 32
+#define MAX_NODE_NAME 64
+#define MAX_LED_NAME 64
+#define MAX_DT_DEPTH 8
 #define LED_OFF 0
 #define LED_MAX 255
-#define INOTIFY_BUF_LEN (10 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define NETLINK_BUF_SIZE 8192
+#define UEVENT_BUF_SIZE 4096
+#define MAX_EPOLL_EVENTS 16
 
 /* Buffer sizes */
 #define DEBUGFS_STATE_BUF_SIZE 512
 #define BRIGHTNESS_BUF_SIZE 4
 #define CARRIER_BUF_SIZE 4
+#define SFP_STATE_STR_LEN 32
 
 /* Timing values */
-#define POLL_INTERVAL_SEC 1
-#define POLL_INTERVAL_USEC 0
+#define POLL_INTERVAL_MSEC 1000
+#define DEBOUNCE_MSEC 10
+#define TIMER_COALESCE_MSEC 250     /* Grid for deadlines that don't need to be exact */
+
+/* Flap damping defaults, modeled on BGP route flap damping (RFC 2439) */
+#define DAMPING_PENALTY 1000
+#define DAMPING_SUPPRESS 3000
+#define DAMPING_REUSE 750
+#define DAMPING_MAX_PENALTY 12000
+#define DAMPING_HALF_LIFE_MSEC 15000
+#define DAMPING_HOLD_MSEC 2000
+
+/* Statistics */
+#define CONFIG_FILE "/etc/sfp-led-daemon.conf"
+#define CONFIG_LINE_MAX 256
+#define STATS_FILE "/run/sfp-led-daemon.stats"
+#define HIST_SUB_BUCKETS 8    /* Linear sub-buckets per power of two, ~12% resolution */
+#define HIST_MAX_EXPONENT 40  /* Values in microseconds, ~12 days */
+#define HIST_BUCKETS ((HIST_MAX_EXPONENT - 1) * HIST_SUB_BUCKETS)
+
+/* OpenMetrics exporter */
+#define METRICS_SOCKET "/run/sfp-led-daemon.sock"
+#define METRICS_MAX_CLIENTS 8
+#define METRICS_REQUEST_MAX 2048
+#define METRICS_CLIENT_TIMEOUT_MSEC 5000  /* Whole exchange, request through response */
+
+/* Module diagnostics (SFF-8472), the I2C bus behind the mux is slow */
+#define DOM_INTERVAL_MSEC 10000     /* Minimum time between reads of one module */
+#define DOM_RX_LOW_HYSTERESIS_DB 1.0
+#define DOM_RX_LOW_BLINK_MSEC 500
+#define DOM_POWER_FLOOR_DBM -40.0   /* Reported for zero power */
+#define SFF8472_A2_BASE 256         /* ethtool maps the A2h page after A0h */
+#define SFF8472_DIAG_TYPE 92        /* A0h */
+#define SFF8472_DIAG_IMPLEMENTED 0x40
+#define SFF8472_DIAG_EXTERNAL_CAL 0x10
+#define SFF8472_CAL_CONSTANTS 56    /* A2h, external calibration */
+#define SFF8472_CAL_CONSTANTS_LEN 36
+#define SFF8472_DIAG_VALUES 96      /* A2h, temperature through RX power */
+#define SFF8472_DIAG_VALUES_LEN 10
+
+/* Rate driven activity LED */
+#define RATE_SAMPLE_MSEC 250
+#define RATE_EWMA_TAU_MSEC 1000
+#define RATE_IDLE_PPS 1.0           /* Below this the activity LED stays off */
+#define RATE_MIN_UTILIZATION 1e-6   /* Slowest blink, ~10 kbit/s at 10G */
+#define RATE_LEVELS 8
+#define RATE_BLINK_SLOW_MSEC 1000   /* Blink period at the lowest and highest level */
+#define RATE_BLINK_FAST_MSEC 50
+#define RATE_DEFAULT_SPEED_MBPS 10000
+#define RATE_IDLE_AFTER_MSEC 5000   /* Without traffic for this long, sample less often */
+#define RATE_IDLE_SAMPLE_MSEC 2000
+#define SPEED_BUF_SIZE 16
+
+/* VPP stats segment, layout as of src/vlib/stats/shared.h */
+#define VPP_STATS_SOCKET "/run/vpp/stats.sock"
+#define VPP_STATS_VERSION 2
+#define VPP_STATS_NAME_LEN 128
+#define VPP_STAT_DIR_COUNTER_VECTOR_COMBINED 3
+#define VPP_VEC_HEADER_SIZE 8
+#define VPP_READ_ATTEMPTS 3
+#define VPP_RETRY_MSEC 5000         /* Reconnect and restart check interval */
+#define VPP_SW_IF_INDEX_INVALID UINT32_MAX
+#define MAX_VPP_NAME 64
+
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
 
 /* String prefixes and their lengths */
-#define MODDEF0_PREFIX "moddef0:"
-#define MODDEF0_PREFIX_LEN 8
-#define RX_LOS_PREFIX "rx_los:"
-#define RX_LOS_PREFIX_LEN 7
 #define FMAN_PREFIX "fman@"
 #define FMAN_PREFIX_LEN 5
 #define ETHERNET_PREFIX "ethernet@"
 #define ETHERNET_PREFIX_LEN 9
+#define DEVPATH_PREFIX "DEVPATH="
+#define DEVPATH_PREFIX_LEN 8
+
+/* Device tree */
+#define DT_BASE "/sys/firmware/devicetree/base"
+
+/* All of the above, plus the sysfs/debugfs paths, live below this root */
+#define DEFAULT_ROOT ""
+#define SFP_COMPATIBLE "sff,sfp"
+#define DT_LINK_LED_PROP "mono,link-led"
+#define DT_ACTIVITY_LED_PROP "mono,activity-led"
+
+/*
+ * Snapshot of /sys/kernel/debug/<sfp>/state, as printed by
+ * sfp_debug_state_show() in drivers/net/phy/sfp.c
+ */
+struct sfp_state {
+	bool valid;          /* Set once the file has been read and parsed */
+	char module_state[SFP_STATE_STR_LEN];
+	char device_state[SFP_STATE_STR_LEN];
+	char main_state[SFP_STATE_STR_LEN];
+	int probe_attempts_init;
+	int probe_attempts_hpower;
+	int fault_retries;
+	int phy_retries;
+	unsigned int rate_kbd;
+	unsigned int rs_threshold_kbd;
+	bool moddef0;
+	bool rx_los;
+	bool tx_fault;
+	bool tx_disable;
+	bool rs0;
+	bool rs1;
+};
+
+enum led_trigger {
+	LED_TRIGGER_UNKNOWN,  /* Not written by us yet, or the last write failed */
+	LED_TRIGGER_NONE,
+	LED_TRIGGER_NETDEV,
+	LED_TRIGGER_TIMER,
+};
+
+#define LED_TRIGGER_ATTRS 3   /* Most attributes any of the triggers above has */
+
+/* LED names with these prefixes address a channel of a batched device */
+#define LED_MULTICOLOR_PREFIX "multicolor:"   /* multicolor:<led>/<channel> */
+#define LED_LP5812_PREFIX "lp5812:"           /* lp5812:<i2c bus>/<output> */
+#define LED_DEVICE_CHANNELS 8
+
+/* TI LP5812 in direct drive mode */
+#define LP5812_I2C_ADDR 0x1b
+#define LP5812_CHANNELS 4             /* OUT0-OUT3 */
+#define LP5812_REG_ENABLE 0x000
+#define LP5812_REG_CMD_UPDATE 0x010
+#define LP5812_REG_LED_EN_1 0x020
+#define LP5812_REG_MANUAL_DC 0x030
+#define LP5812_REG_MANUAL_PWM 0x040
+#define LP5812_UPDATE_KEY 0x55
+#define LP5812_DC_CURRENT 0x40        /* A quarter of the full scale current */
+#define LP5812_MAX_MSGS 16
+
+struct led_state {
+	enum led_trigger trigger;
+	int brightness;       /* -1 when unknown or owned by the trigger */
+	unsigned int delay_on_ms;   /* Timer trigger only */
+	unsigned int delay_off_ms;
+};
+
+enum led_backend {
+	LED_BACKEND_MULTICOLOR,  /* Channels of a multicolor class LED */
+	LED_BACKEND_LP5812,      /* Outputs of an LP5812 driven from userspace over /dev/i2c */
+};
+
+struct sfp_led;
+
+/*
+ * A device whose channels are committed together: all colors of a
+ * multicolor LED in one multi_intensity write, all outputs of an LP5812 in
+ * one I2C transfer. LEDs on it only stage their brightness in led_apply(),
+ * led_flush() then sends everything that changed at once. Neither has
+ * hardware triggers, so their channels are steady brightness only.
+ */
+struct led_device {
+	enum led_backend backend;
+	char name[MAX_LED_NAME];         /* Multicolor LED or I2C bus number */
+	int fd;                          /* multi_intensity or /dev/i2c-N */
+	unsigned int channels;
+	unsigned int max_brightness;
+	int value[LED_DEVICE_CHANNELS];    /* Staged, 0 to LED_MAX */
+	int applied[LED_DEVICE_CHANNELS];  /* Last committed, -1 when unknown */
+	struct sfp_led *leds[LED_DEVICE_CHANNELS];
+	unsigned int users;
+	bool dirty;
+	uint64_t commits;
+	struct led_device *next;
+};
+
+/*
+ * One LED class device. Writes only go out for attributes where the desired
+ * state differs from what was last applied, through fds that stay open for
+ * the life of the port. Trigger attributes (netdev device_name/tx/rx,
+ * timer delay_on/delay_off) only exist while their trigger is active, so
+ * their fds are opened on activation and dropped when the trigger changes.
+ * An LED on a batched device has none of these fds, just its channel.
+ */
+struct sfp_led {
+	char name[MAX_LED_NAME];
+	struct led_device *dev;
+	unsigned int channel;
+	int dir_fd;
+	int brightness_fd;
+	int trigger_fd;
+	int attr_fd[LED_TRIGGER_ATTRS];
+	struct led_state desired;
+	struct led_state applied;
+	uint64_t writes;
+	uint64_t write_errors;
+};
+
+/*
+ * Log-linear histogram in the spirit of HdrHistogram: values below
+ * 2 * HIST_SUB_BUCKETS are exact, above that every power of two is split
+ * into HIST_SUB_BUCKETS linear buckets.
+ */
+struct latency_histogram {
+	uint64_t buckets[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t min_us;
+	uint64_t max_us;
+};
+
+struct port_stats {
+	uint64_t events;       /* rtnetlink, uevent and signal triggers */
+	uint64_t updates;      /* Port re-evaluations */
+	uint64_t state_reads;  /* debugfs state reads */
+	uint64_t state_read_errors;
+	uint64_t led_changes;  /* Updates that wrote at least one LED attribute */
+	uint64_t event_ns;     /* Detection time of the oldest event not yet shown on the LEDs */
+	struct latency_histogram latency;  /* Event detection to LED write completion */
+};
+
+struct damping_config {
+	bool enabled;
+	unsigned int penalty;       /* Added for every link transition */
+	unsigned int suppress;      /* Penalty at which LED updates get rate limited */
+	unsigned int reuse;         /* Penalty below which the port is considered stable again */
+	unsigned int max_penalty;
+	unsigned int half_life_ms;
+	unsigned int hold_ms;       /* Minimum time between LED updates while suppressed */
+};
+
+/*
+ * Per-port flap damping. Every link transition adds to a penalty that decays
+ * exponentially. Above the suppress threshold LED updates are coalesced to
+ * at most one per hold period and per-transition logging stops, until the
+ * penalty decays below the reuse threshold.
+ */
+struct flap_damping {
+	struct damping_config cfg;
+	double penalty;
+	uint64_t decayed_at_ms;
+	bool suppressed;
+	uint64_t suppressed_since_ms;
+	uint64_t next_led_update_ms;
+	unsigned int suppressed_transitions;  /* Coalesced during the current suppression */
+	uint64_t transitions;                 /* Lifetime counters */
+	uint64_t suppressions;
+	uint64_t coalesced_transitions;
+};
+
+struct sfp_port;
+
+enum event_type {
+	EVENT_SIGNAL,
+	EVENT_RTNETLINK,
+	EVENT_UEVENT,
+	EVENT_PORT_TIMER,
+	EVENT_METRICS_LISTEN,
+	EVENT_METRICS_CLIENT,
+	EVENT_METRICS_TIMER,
+	EVENT_DOM,
+	EVENT_STATS,
+	EVENT_STATS_TIMER,
+	EVENT_VPP_STATS,
+};
+
+struct metrics_client;
+
+/* Registered as epoll user data so each wakeup dispatches straight to its owner */
+struct event_source {
+	enum event_type type;
+	int fd;
+	struct sfp_port *port;  /* Only for per-port sources */
+	struct metrics_client *client;  /* Only for metrics connections */
+};
+
+/*
+ * A scrape in progress. Everything is non-blocking: the request is read
+ * as it trickles in, the response is rendered from memory in one go and
+ * written out as the socket accepts it.
+ */
+struct metrics_client {
+	struct event_source src;
+	bool http;            /* TCP speaks HTTP, the unix socket just gets the text */
+	char request[METRICS_REQUEST_MAX];
+	size_t request_len;
+	char *response;
+	size_t response_len;
+	size_t response_off;
+	uint64_t deadline_ms;  /* Closed when not done by then */
+	struct metrics_client *next;
+};
+
+/* What a module says about its diagnostics, read once per inserted module */
+struct dom_ident {
+	bool known;
+	bool ddm;             /* Diagnostics implemented */
+	bool external_cal;    /* Raw values need the A2h calibration constants */
+	float rx_pwr[5];      /* Rx_PWR(0) through Rx_PWR(4) */
+	double tx_i_slope, tx_i_offset;
+	double tx_pwr_slope, tx_pwr_offset;
+	double t_slope, t_offset;
+	double v_slope, v_offset;
+};
+
+struct dom_reading {
+	bool valid;
+	double temp_c;
+	double vcc_v;
+	double tx_bias_ma;
+	double tx_power_mw;
+	double rx_power_mw;
+};
+
+/* A read handed to the DOM worker thread and back, by value */
+struct dom_job {
+	size_t port;          /* Index into ports */
+	unsigned int seq;
+	char netdev[MAX_NETDEV_NAME];
+	struct dom_ident ident;
+	struct dom_reading reading;
+	int error;            /* Negative errno */
+	uint64_t duration_us;
+};
+
+struct dom_queue {
+	struct dom_job *jobs;
+	size_t size;
+	size_t head;
+	size_t count;
+};
+
+/*
+ * Cached diagnostics of the module in a port. Only the main thread touches
+ * this, the worker only ever sees copies in a dom_job.
+ */
+struct sfp_dom {
+	unsigned int seq;     /* Bumped when the module changes, stale results are dropped */
+	bool busy;            /* Read queued or in progress */
+	struct dom_ident ident;
+	struct dom_reading reading;
+	uint64_t read_at_ms;  /* Last successful read */
+	uint64_t next_read_ms;  /* Rate limit */
+	int last_error;
+	bool rx_low;          /* RX power below the LED policy threshold */
+	uint64_t reads;
+	uint64_t read_errors;
+	struct latency_histogram read_time;
+};
+
+enum activity_mode {
+	ACTIVITY_NETDEV,      /* Kernel netdev trigger, blinks per packet */
+	ACTIVITY_RATE,        /* Blink rate follows line utilization */
+};
+
+/* Counters from the last RTM_GETSTATS sample and the rates derived from them */
+struct traffic_rate {
+	bool valid;
+	uint64_t sampled_ns;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t packets;     /* rx + tx */
+	double rx_bytes_per_s;  /* EWMA */
+	double tx_bytes_per_s;
+	double packets_per_s;
+	unsigned int speed_mbps;
+	unsigned int level;   /* Activity blink level, 0 when idle */
+};
+
+struct vpp_stats_header {
+	uint64_t version;
+	uint64_t base;            /* Where VPP has the segment mapped */
+	uint64_t epoch;           /* Bumped whenever the directory changes */
+	uint64_t in_progress;     /* Non-zero while VPP is changing it */
+	uint64_t directory_vector;
+};
+
+struct vpp_stats_entry {
+	uint32_t type;
+	uint64_t data;            /* Index, value or pointer depending on type */
+	char name[VPP_STATS_NAME_LEN];
+};
+
+struct vpp_counter {
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+struct vpp_port_sample {
+	bool valid;
+	struct vpp_counter rx;
+	struct vpp_counter tx;
+};
+
+/* Settings of one port, as given in a config file section or resolved for a port */
+struct port_config {
+	char name[MAX_NODE_NAME];             /* Cage or netdev the section applies to */
+	char link_led[MAX_LED_NAME];
+	char activity_led[MAX_LED_NAME];
+	char netdev[MAX_NETDEV_NAME];
+	char vpp_interface[MAX_VPP_NAME];
+	bool damping_set;
+	struct damping_config damping;
+};
+
+struct daemon_config {
+	unsigned int poll_interval_ms;
+	struct damping_config damping;
+	enum activity_mode activity_mode;
+	unsigned int rate_sample_ms;
+	bool rx_low_enabled;
+	double rx_low_dbm;
+	unsigned int dom_interval_ms;
+	struct port_config *ports;
+	size_t num_ports;
+};
+
+/* Command line options that only take effect at startup */
+struct options {
+	bool foreground;
+	const char *metrics_socket;
+	const char *vpp_socket;
+	const char *config_file;
+	bool config_required;
+};
 
 struct sfp_port {
-	char netdev[MAX_NETDEV_NAME];  /* Dynamically discovered */
-	const char *link_led;
-	const char *activity_led;
-	const char *sfp_name;  /* e.g., "sfp-xfi0" */
+	char netdev[MAX_NETDEV_NAME];  /* In use, from the config or the device tree */
+	char dt_netdev[MAX_NETDEV_NAME];  /* Device tree defaults, looked up once */
+	char dt_link_led[MAX_LED_NAME];
+	char dt_activity_led[MAX_LED_NAME];
+	struct port_config cfg;        /* Settings currently applied */
+	struct sfp_led link_led;
+	struct sfp_led activity_led;
+	char sfp_name[MAX_NODE_NAME];  /* DT node name, e.g., "sfp-xfi0" */
+	char *dt_path;       /* Full path of the sfp node below DT_BASE */
 	int carrier_fd;
-	int link_led_fd;
-	int activity_led_fd;
 	int mod_present_fd;  /* Debugfs state file for module presence detection */
-	int inotify_wd;      /* inotify watch descriptor for carrier file */
+	struct event_source timer;  /* timerfd for debounce, damping and fallback polling */
+	uint64_t update_at_ms;  /* Timer deadlines on CLOCK_MONOTONIC, 0 when unset */
+	uint64_t poll_at_ms;
+	uint64_t damping_at_ms;
+	uint64_t dom_at_ms;
+	struct flap_damping damping;
+	struct sfp_dom dom;
+	struct traffic_rate rate;
+	char vpp_interface[MAX_VPP_NAME];  /* Counters come from VPP instead of the kernel */
+	uint32_t vpp_sw_if_index;
+	struct port_stats stats;
+	int ifindex;         /* Kernel interface index, used to match rtnetlink messages */
+	bool carrier;        /* IFF_LOWER_UP as last seen from rtnetlink or sysfs */
+	struct sfp_state sfp;  /* Last debugfs snapshot */
 	bool last_carrier_state;
 	bool last_module_present;
 };
 
-static struct sfp_port ports[MAX_PORTS] = {
-	{
-		.netdev = "",
-		.link_led = "sfp0:link",
-		.activity_led = "sfp0:activity",
-		.sfp_name = "sfp-xfi0",
-		.carrier_fd = -1,
-		.link_led_fd = -1,
-		.activity_led_fd = -1,
-		.mod_present_fd = -1,
-		.inotify_wd = -1,
-		.last_carrier_state = false,
-		.last_module_present = false,
-	},
-	{
-		.netdev = "",
-		.link_led = "sfp1:link",
-		.activity_led = "sfp1:activity",
-		.sfp_name = "sfp-xfi1",
-		.carrier_fd = -1,
-		.link_led_fd = -1,
-		.activity_led_fd = -1,
-		.mod_present_fd = -1,
-		.inotify_wd = -1,
-		.last_carrier_state = false,
-		.last_module_present = false,
-	},
-};
-
-static volatile sig_atomic_t running = 1;
-static int inotify_fd = -1;
-
-static void setup_netdev_trigger(struct sfp_port *port);
-static void disable_netdev_trigger(struct sfp_port *port);
+/*
+ * Open addressing hash of port pointers. Events carry either an ifindex
+ * (rtnetlink) or a device path (uevent), these let both find their port
+ * without scanning the whole port table.
+ */
+struct port_table {
+	struct sfp_port **slots;
+	size_t mask;
+};
+
+static struct sfp_port *ports;
+static size_t num_ports;
+static struct port_table ports_by_ifindex;
+static struct port_table ports_by_name;
+
+static bool running = true;
+static const char *root_dir = DEFAULT_ROOT;
+static unsigned int poll_interval_ms = POLL_INTERVAL_MSEC;
+static char stats_path[PATH_MAX];
+static char config_path[PATH_MAX];
+static bool config_required;
+static int saved_argc;         /* Command line options override the config file on every reload */
+static char **saved_argv;
+static uint64_t start_ns;
+static uint64_t loop_wakeups;
+static uint64_t loop_events;
+static bool idle;                /* No timer armed anywhere, only events can wake us */
+static uint64_t idle_since_ns;
+static uint64_t idle_ns;
+static uint64_t idle_entries;
+static struct latency_histogram loop_dispatch;  /* Time spent handling each wakeup */
+static struct event_source metrics_unix_source = { .type = EVENT_METRICS_LISTEN, .fd = -1 };
+static struct event_source metrics_tcp_source = { .type = EVENT_METRICS_LISTEN, .fd = -1 };
+static char metrics_path[PATH_MAX];
+static unsigned int metrics_tcp_port;
+static unsigned int metrics_clients;
+static struct metrics_client *metrics_client_list;
+static bool metrics_expired;   /* Timer fired, sweep after the current epoll batch */
+static struct event_source metrics_timer = { .type = EVENT_METRICS_TIMER, .fd = -1 };
+static bool fallback_polling;
+static struct damping_config default_damping = {
+	.enabled = true,
+	.penalty = DAMPING_PENALTY,
+	.suppress = DAMPING_SUPPRESS,
+	.reuse = DAMPING_REUSE,
+	.max_penalty = DAMPING_MAX_PENALTY,
+	.half_life_ms = DAMPING_HALF_LIFE_MSEC,
+	.hold_ms = DAMPING_HOLD_MSEC,
+};
+static int epoll_fd = -1;
+static struct event_source signal_source = { .type = EVENT_SIGNAL, .fd = -1 };
+static struct event_source rtnl_source = { .type = EVENT_RTNETLINK, .fd = -1 };
+static struct event_source uevent_source = { .type = EVENT_UEVENT, .fd = -1 };
+static struct event_source dom_source = { .type = EVENT_DOM, .fd = -1 };
+static pthread_t dom_thread;
+static pthread_mutex_t dom_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dom_cond = PTHREAD_COND_INITIALIZER;
+static struct dom_queue dom_requests;  /* Protected by dom_lock */
+static struct dom_queue dom_results;
+static bool dom_stop;
+static unsigned int dom_interval_ms = DOM_INTERVAL_MSEC;
+static bool dom_rx_low_enabled;
+static double dom_rx_low_dbm;
+static enum activity_mode activity_mode = ACTIVITY_NETDEV;
+static unsigned int rate_sample_ms = RATE_SAMPLE_MSEC;
+static struct event_source stats_source = { .type = EVENT_STATS, .fd = -1 };  /* RTM_GETSTATS replies */
+static struct event_source stats_timer = { .type = EVENT_STATS_TIMER, .fd = -1 };
+static unsigned int stats_timer_interval_ms;  /* 0 while disarmed */
+static uint64_t rate_idle_since_ms;
+static bool stats_dump_pending;
+static uint32_t stats_seq;
+static uint64_t stats_dumps;
+static uint64_t stats_dump_errors;
+static char vpp_stats_path[PATH_MAX];
+static struct event_source vpp_source = { .type = EVENT_VPP_STATS, .fd = -1 };  /* Pending connection */
+static const uint8_t *vpp_segment;
+static size_t vpp_segment_size;
+static ino_t vpp_socket_ino;
+static uint64_t vpp_dir_epoch = UINT64_MAX;
+static const struct vpp_stats_entry *vpp_rx;
+static const struct vpp_stats_entry *vpp_tx;
+static struct vpp_port_sample *vpp_scratch;
+static size_t vpp_ports;
+static uint64_t vpp_retry_at_ms;
+static uint64_t vpp_check_at_ms;
+static uint64_t vpp_samples;
+static uint64_t vpp_sample_retries;
+
+static struct led_device *led_devices;
+
 static void cleanup_port(struct sfp_port *port);
-static int find_netdev_for_sfp(const char *sfp_name, char *netdev_out, size_t out_size);
 
-static void signal_handler(int sig)
+/*
+ * Format an absolute sysfs/debugfs/devicetree path below the configured
+ * root, so the daemon can run against a fake tree. Returns -1 if the path
+ * didn't fit.
+ */
+static int root_path(char *buf, size_t size, const char *fmt, ...)
+{
+	va_list ap;
+	int len, ret;
+	
+	len = snprintf(buf, size, "%s", root_dir);
+	if (len < 0 || (size_t)len >= size)
+		return -1;
+	
+	va_start(ap, fmt);
+	ret = vsnprintf(buf + len, size - len, fmt, ap);
+	va_end(ap);
+	
+	return (ret < 0 || (size_t)ret >= size - len) ? -1 : 0;
+}
+
+static size_t hash_u32(uint32_t key)
 {
-	running = 0;
+	key ^= key >> 16;
+	key *= 0x45d9f3b;
+	key ^= key >> 16;
+	return key;
 }
 
-static int set_led_brightness(int fd, int brightness)
+/* FNV-1a over a length delimited string */
+static size_t hash_str(const char *str, size_t len)
 {
-	char buf[BRIGHTNESS_BUF_SIZE];
-	int len;
+	uint32_t hash = 2166136261u;
 	
-	if (fd < 0)
-		return -1;
+	while (len--) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
 	
-	len = snprintf(buf, sizeof(buf), "%d\n", brightness);
-	if (lseek(fd, 0, SEEK_SET) < 0)
+	return hash;
+}
+
+static int port_table_init(struct port_table *table, size_t entries)
+{
+	size_t size = 4;
+	
+	/* Keep the load factor at or below one half */
+	while (size < entries * 2)
+		size <<= 1;
+	
+	free(table->slots);
+	table->slots = calloc(size, sizeof(*table->slots));
+	if (!table->slots)
 		return -1;
+	table->mask = size - 1;
+	
+	return 0;
+}
+
+static void port_table_insert(struct port_table *table, size_t hash, struct sfp_port *port)
+{
+	size_t slot;
+	
+	for (slot = hash & table->mask; table->slots[slot]; slot = (slot + 1) & table->mask)
+		;
+	table->slots[slot] = port;
+}
+
+/* ifindexes are only known once a port is set up, so this is rebuilt afterwards */
+static void rebuild_ifindex_table(void)
+{
+	size_t i;
+	
+	if (port_table_init(&ports_by_ifindex, num_ports) < 0) {
+		syslog(LOG_ERR, "Failed to allocate ifindex table");
+		return;
+	}
+	
+	for (i = 0; i < num_ports; i++) {
+		if (ports[i].ifindex > 0)
+			port_table_insert(&ports_by_ifindex, hash_u32(ports[i].ifindex), &ports[i]);
+	}
+}
+
+static struct sfp_port *find_port_by_name(const char *name, size_t len)
+{
+	size_t slot;
+	struct sfp_port *port;
+	
+	if (len == 0 || len >= MAX_NODE_NAME || !ports_by_name.slots)
+		return NULL;
+	
+	for (slot = hash_str(name, len) & ports_by_name.mask;
+	     (port = ports_by_name.slots[slot]) != NULL;
+	     slot = (slot + 1) & ports_by_name.mask) {
+		if (strncmp(port->sfp_name, name, len) == 0 && port->sfp_name[len] == '\0')
+			return port;
+	}
+	
+	return NULL;
+}
+
+static int epoll_add_source(struct event_source *src)
+{
+	struct epoll_event ev;
+	
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
 	
-	if (write(fd, buf, len) != len)
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+		syslog(LOG_WARNING, "Failed to add fd %d to epoll: %s", src->fd, strerror(errno));
 		return -1;
+	}
 	
 	return 0;
 }
 
-static int read_carrier_state(int fd)
+static uint64_t now_ns(void)
 {
-	char buf[CARRIER_BUF_SIZE];
-	int ret;
+	struct timespec ts;
 	
-	if (fd < 0)
-		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_ms(void)
+{
+	return now_ns() / 1000000;
+}
+
+static unsigned int hist_index(uint64_t value)
+{
+	unsigned int exponent;
 	
-	if (lseek(fd, 0, SEEK_SET) < 0)
+	if (value < 2 * HIST_SUB_BUCKETS)
+		return value;
+	
+	exponent = 63 - __builtin_clzll(value);
+	if (exponent >= HIST_MAX_EXPONENT)
+		return HIST_BUCKETS - 1;
+	
+	/* value >> (exponent - 3) lands in [HIST_SUB_BUCKETS, 2 * HIST_SUB_BUCKETS) */
+	return (exponent - 3) * HIST_SUB_BUCKETS + (value >> (exponent - 3));
+}
+
+/* Lowest value that maps to a bucket */
+static uint64_t hist_bucket_value(unsigned int index)
+{
+	unsigned int exponent;
+	
+	if (index < 2 * HIST_SUB_BUCKETS)
+		return index;
+	
+	exponent = index / HIST_SUB_BUCKETS + 2;
+	return (uint64_t)(index % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS) << (exponent - 3);
+}
+
+static void hist_record(struct latency_histogram *h, uint64_t value_us)
+{
+	h->buckets[hist_index(value_us)]++;
+	if (h->count == 0 || value_us < h->min_us)
+		h->min_us = value_us;
+	if (value_us > h->max_us)
+		h->max_us = value_us;
+	h->count++;
+	h->sum_us += value_us;
+}
+
+static uint64_t hist_percentile(const struct latency_histogram *h, double percentile)
+{
+	uint64_t target, seen = 0;
+	unsigned int i;
+	
+	if (h->count == 0)
 		return 0;
 	
-	ret = read(fd, buf, sizeof(buf) - 1);
-	if (ret <= 0)
+	target = (uint64_t)ceil(h->count * percentile / 100.0);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		/* Report the highest value equivalent to the bucket, like HdrHistogram */
+		if (seen >= target) {
+			uint64_t value = hist_bucket_value(i + 1) - 1;
+			return value > h->max_us ? h->max_us : value;
+		}
+	}
+	
+	return h->max_us;
+}
+
+static uint64_t earliest_deadline(uint64_t a, uint64_t b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	return a < b ? a : b;
+}
+
+/*
+ * timerfd has no slack, so deadlines that don't have to be exact are
+ * rounded up onto a common grid instead. Polls, damping and diagnostics
+ * of all ports and the traffic sampling then expire together and share
+ * wakeups.
+ */
+static uint64_t coalesce_deadline(uint64_t deadline)
+{
+	if (!deadline)
 		return 0;
+	return (deadline + TIMER_COALESCE_MSEC - 1) / TIMER_COALESCE_MSEC * TIMER_COALESCE_MSEC;
+}
+
+/* The port timer always runs to the earliest of the port's pending deadlines */
+static void rearm_port_timer(struct sfp_port *port)
+{
+	struct itimerspec its;
+	uint64_t deadline;
 	
-	buf[ret] = '\0';
-	return (buf[0] == '1');
+	if (port->timer.fd < 0)
+		return;
+	
+	/* Only the event debounce is latency sensitive */
+	deadline = earliest_deadline(port->poll_at_ms, port->damping_at_ms);
+	deadline = earliest_deadline(deadline, port->dom_at_ms);
+	deadline = earliest_deadline(port->update_at_ms, coalesce_deadline(deadline));
+	
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / 1000;
+	its.it_value.tv_nsec = (deadline % 1000) * 1000000L;
+	
+	if (timerfd_settime(port->timer.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		syslog(LOG_WARNING, "%s: failed to arm timer: %s", port->sfp_name, strerror(errno));
+	}
 }
 
-static int read_module_present(int fd)
+/*
+ * Events tend to arrive in bursts (several RTM_NEWLINK per link change, a
+ * handful of uevents per module insert), so coalesce them into a single
+ * update per port after a short debounce.
+ */
+static void schedule_port_update(struct sfp_port *port)
 {
-	char buf[DEBUGFS_STATE_BUF_SIZE];
+	port->stats.events++;
+	if (!port->stats.event_ns)
+		port->stats.event_ns = now_ns();
+	
+	if (port->update_at_ms)
+		return;
+	
+	port->update_at_ms = now_ms() + DEBOUNCE_MSEC;
+	rearm_port_timer(port);
+}
+
+/*
+ * Ports whose netdev the kernel doesn't know can't get rtnetlink events.
+ * With a module in but no carrier nothing tells us about rx_los changes
+ * either, nor about a module without diagnostics (no hwmon uevent) being
+ * pulled, so debugfs is polled until the link comes up. Empty cages are
+ * left to uevents: a module without diagnostics going into one shows up
+ * only once it gets carrier.
+ */
+static bool port_needs_polling(const struct sfp_port *port)
+{
+	return fallback_polling || port->ifindex == 0 ||
+	       (port->last_module_present && !port->carrier);
+}
+
+static int read_carrier_state(int fd)
+{
+	char buf[CARRIER_BUF_SIZE];
 	int ret;
-	char *pos, *line_end;
 	
 	if (fd < 0)
-		return 0; /* Assume NOT present if we can't read */
+		return 0;
 	
 	if (lseek(fd, 0, SEEK_SET) < 0)
 		return 0;
@@ -158,66 +891,77 @@ static int read_module_present(int fd)
 		return 0;
 	
 	buf[ret] = '\0';
-	
-	pos = buf;
-	while (pos && *pos) {
-		line_end = strchr(pos, '\n');
-		if (line_end)
-			*line_end = '\0';
-		
-		/* Check if this line contains our prefix */
-		if (strncmp(pos, MODDEF0_PREFIX, MODDEF0_PREFIX_LEN) == 0) {
-			char *value = pos + MODDEF0_PREFIX_LEN;
-			while (*value == ' ') value++;
-			return (*value == '1');
-		}
-		
-		if (line_end)
-			pos = line_end + 1;
-		else
-			break;
-	}
-	
-	return 0;
+	return (buf[0] == '1');
+}
+
+static void copy_state_str(char *dst, const char *src)
+{
+	snprintf(dst, SFP_STATE_STR_LEN, "%s", src);
 }
 
-static int read_rx_los(int fd)
+/*
+ * Read and parse the whole debugfs state file in one go. On failure the
+ * snapshot describes an absent module with signal lost, which is what the
+ * LED logic should show when the SFP state can't be determined.
+ */
+static int read_sfp_state(int fd, struct sfp_state *st)
 {
 	char buf[DEBUGFS_STATE_BUF_SIZE];
-	int ret;
-	char *pos, *line_end;
+	ssize_t ret;
+	char *line, *saveptr, *value;
 	
-	if (fd < 0)
-		return 1; /* Assume signal loss if we can't read */
+	memset(st, 0, sizeof(*st));
+	st->rx_los = true;
 	
-	if (lseek(fd, 0, SEEK_SET) < 0)
-		return 1;
+	if (fd < 0)
+		return -1;
 	
-	ret = read(fd, buf, sizeof(buf) - 1);
+	ret = pread(fd, buf, sizeof(buf) - 1, 0);
 	if (ret <= 0)
-		return 1;
+		return -1;
 	
 	buf[ret] = '\0';
 	
-	pos = buf;
-	while (pos && *pos) {
-		line_end = strchr(pos, '\n');
-		if (line_end)
-			*line_end = '\0';
-		
-		if (strncmp(pos, RX_LOS_PREFIX, RX_LOS_PREFIX_LEN) == 0) {
-			char *value = pos + RX_LOS_PREFIX_LEN;
-			while (*value == ' ') value++;
-			return (*value == '1');
-		}
+	for (line = strtok_r(buf, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+		value = strchr(line, ':');
+		if (!value)
+			continue;
+		*value++ = '\0';
+		while (*value == ' ')
+			value++;
 		
-		if (line_end)
-			pos = line_end + 1;
-		else
-			break;
+		if (strcmp(line, "moddef0") == 0)
+			st->moddef0 = (*value == '1');
+		else if (strcmp(line, "rx_los") == 0)
+			st->rx_los = (*value == '1');
+		else if (strcmp(line, "tx_fault") == 0)
+			st->tx_fault = (*value == '1');
+		else if (strcmp(line, "tx_disable") == 0)
+			st->tx_disable = (*value == '1');
+		else if (strcmp(line, "rs0") == 0)
+			st->rs0 = (*value == '1');
+		else if (strcmp(line, "rs1") == 0)
+			st->rs1 = (*value == '1');
+		else if (strcmp(line, "Module state") == 0)
+			copy_state_str(st->module_state, value);
+		else if (strcmp(line, "Device state") == 0)
+			copy_state_str(st->device_state, value);
+		else if (strcmp(line, "Main state") == 0)
+			copy_state_str(st->main_state, value);
+		else if (strcmp(line, "Module probe attempts") == 0)
+			sscanf(value, "%d %d", &st->probe_attempts_init, &st->probe_attempts_hpower);
+		else if (strcmp(line, "Fault recovery remaining retries") == 0)
+			st->fault_retries = atoi(value);
+		else if (strcmp(line, "PHY probe remaining retries") == 0)
+			st->phy_retries = atoi(value);
+		else if (strcmp(line, "Signalling rate") == 0)
+			st->rate_kbd = strtoul(value, NULL, 10);
+		else if (strcmp(line, "Rate select threshold") == 0)
+			st->rs_threshold_kbd = strtoul(value, NULL, 10);
 	}
 	
-	return 1;
+	st->valid = true;
+	return 0;
 }
 
 static int open_file_ro(const char *path)
@@ -229,521 +973,4019 @@ static int open_file_ro(const char *path)
 	return fd;
 }
 
-static int open_file_wo(const char *path)
-{
-	int fd = open(path, O_WRONLY);
-	if (fd < 0) {
-		syslog(LOG_WARNING, "Failed to open %s: %s", path, strerror(errno));
-	}
-	return fd;
-}
-
-static int write_sysfs_string(const char *path, const char *value)
+static uint32_t read_dt_u32(const char *path)
 {
-	int fd, ret, len;
+	int fd;
+	uint32_t val;
+	ssize_t bytes_read;
 	
-	fd = open(path, O_WRONLY);
-	if (fd < 0) {
-		syslog(LOG_WARNING, "Failed to open %s: %s", path, strerror(errno));
-		return -1;
-	}
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
 	
-	len = strlen(value);
-	ret = write(fd, value, len);
+	bytes_read = read(fd, &val, sizeof(val));
 	close(fd);
 	
-	if (ret != len) {
-		syslog(LOG_WARNING, "Failed to write to %s: %s", path, strerror(errno));
-		return -1;
-	}
+	if (bytes_read != sizeof(val)) {
+		return 0;
+	}
+	
+	return __builtin_bswap32(val);  /* Convert from big-endian */
+}
+
+/*
+ * Map SFP phandles to network devices, built once for all cages.
+ *
+ * A netdev whose of_node carries an sfp property names itself, whatever the
+ * driver called it. Ethernet nodes under soc/fman@* that no netdev claimed
+ * this way fall back to the DPAA naming, fm1-mac with cell-index plus 1.
+ */
+struct sfp_netdev {
+	uint32_t phandle;
+	char netdev[MAX_NETDEV_NAME];
+};
+
+static struct sfp_netdev *sfp_netdev_find(struct sfp_netdev *map, size_t count, uint32_t phandle)
+{
+	size_t i;
+	
+	for (i = 0; i < count; i++) {
+		if (map[i].phandle == phandle)
+			return &map[i];
+	}
+	return NULL;
+}
+
+static void sfp_netdev_add(struct sfp_netdev **map, size_t *count, uint32_t phandle, const char *netdev)
+{
+	struct sfp_netdev *grown;
+	
+	if (phandle == 0 || strlen(netdev) >= MAX_NETDEV_NAME || sfp_netdev_find(*map, *count, phandle))
+		return;
+	
+	grown = realloc(*map, (*count + 1) * sizeof(*grown));
+	if (!grown)
+		return;
+	*map = grown;
+	grown[*count].phandle = phandle;
+	strcpy(grown[*count].netdev, netdev);
+	(*count)++;
+}
+
+static void map_netdevs_by_of_node(struct sfp_netdev **map, size_t *count)
+{
+	char path[PATH_MAX];
+	struct dirent *entry;
+	uint32_t phandle;
+	DIR *dir;
+	
+	if (root_path(path, sizeof(path), "/sys/class/net") < 0 || !(dir = opendir(path)))
+		return;
+	
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		
+		root_path(path, sizeof(path), "/sys/class/net/%s/of_node/sfp", entry->d_name);
+		phandle = read_dt_u32(path);
+		if (phandle == 0) {
+			root_path(path, sizeof(path), "/sys/class/net/%s/device/of_node/sfp", entry->d_name);
+			phandle = read_dt_u32(path);
+		}
+		sfp_netdev_add(map, count, phandle, entry->d_name);
+	}
+	
+	closedir(dir);
+}
+
+static void map_netdevs_by_cell_index(struct sfp_netdev **map, size_t *count)
+{
+	char path[PATH_MAX], fman_path[PATH_MAX], netdev[MAX_NETDEV_NAME];
+	struct dirent *entry, *eth_entry;
+	uint32_t phandle, cell_index;
+	DIR *dir, *fman_dir;
+	
+	if (root_path(path, sizeof(path), DT_BASE "/soc") < 0 || !(dir = opendir(path))) {
+		syslog(LOG_ERR, "Failed to open device tree soc directory");
+		return;
+	}
+	
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, FMAN_PREFIX, FMAN_PREFIX_LEN) != 0)
+			continue;
+		
+		root_path(fman_path, sizeof(fman_path), DT_BASE "/soc/%s", entry->d_name);
+		fman_dir = opendir(fman_path);
+		if (!fman_dir)
+			continue;
+		
+		while ((eth_entry = readdir(fman_dir)) != NULL) {
+			if (strncmp(eth_entry->d_name, ETHERNET_PREFIX, ETHERNET_PREFIX_LEN) != 0)
+				continue;
+			
+			snprintf(path, sizeof(path), "%s/%s/sfp", fman_path, eth_entry->d_name);
+			phandle = read_dt_u32(path);
+			if (phandle == 0 || sfp_netdev_find(*map, *count, phandle))
+				continue;
+			
+			snprintf(path, sizeof(path), "%s/%s/cell-index", fman_path, eth_entry->d_name);
+			cell_index = read_dt_u32(path);
+			
+			/* Validate cell_index to prevent overflow and ensure reasonable value */
+			if (cell_index > 1000) {
+				syslog(LOG_WARNING, "Invalid cell-index %u in %s, skipping",
+				       cell_index, eth_entry->d_name);
+				continue;
+			}
+			
+			snprintf(netdev, sizeof(netdev), "fm1-mac%u", cell_index + 1);
+			sfp_netdev_add(map, count, phandle, netdev);
+		}
+		
+		closedir(fman_dir);
+	}
+	
+	closedir(dir);
+}
+
+static size_t build_sfp_netdev_map(struct sfp_netdev **map)
+{
+	size_t count = 0;
+	
+	*map = NULL;
+	map_netdevs_by_of_node(map, &count);
+	map_netdevs_by_cell_index(map, &count);
+	return count;
+}
+
+/* Look up the netdev of one cage by the phandle of its node */
+static int find_netdev_for_sfp(struct sfp_port *port, struct sfp_netdev *map, size_t count)
+{
+	char path[PATH_MAX];
+	struct sfp_netdev *found;
+	uint32_t sfp_phandle;
+	
+	snprintf(path, sizeof(path), "%s/phandle", port->dt_path);
+	sfp_phandle = read_dt_u32(path);
+	if (sfp_phandle == 0) {
+		syslog(LOG_ERR, "Failed to read phandle for %s", port->sfp_name);
+		return -1;
+	}
 	
+	found = sfp_netdev_find(map, count, sfp_phandle);
+	if (!found) {
+		syslog(LOG_ERR, "Could not find ethernet node for SFP '%s' (phandle 0x%x)",
+		       port->sfp_name, sfp_phandle);
+		return -1;
+	}
+	
+	memcpy(port->dt_netdev, found->netdev, sizeof(port->dt_netdev));
+	syslog(LOG_INFO, "Found netdev '%s' for SFP '%s'", port->dt_netdev, port->sfp_name);
 	return 0;
 }
 
-static uint32_t read_dt_u32(const char *path)
+static void close_fd(int *fd)
+{
+	if (*fd >= 0) {
+		close(*fd);
+		*fd = -1;
+	}
+}
+
+static void led_init(struct sfp_led *led)
+{
+	int i;
+	
+	led->dir_fd = -1;
+	led->brightness_fd = -1;
+	led->trigger_fd = -1;
+	for (i = 0; i < LED_TRIGGER_ATTRS; i++)
+		led->attr_fd[i] = -1;
+	led->desired.trigger = LED_TRIGGER_NONE;
+	led->desired.brightness = LED_OFF;
+	led->applied.trigger = LED_TRIGGER_UNKNOWN;
+	led->applied.brightness = -1;
+}
+
+static int led_open_attr(struct sfp_led *led, const char *attr)
+{
+	int fd = openat(led->dir_fd, attr, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		syslog(LOG_WARNING, "Failed to open %s/%s: %s", led->name, attr, strerror(errno));
+	}
+	return fd;
+}
+
+static int led_write_attr(struct sfp_led *led, int fd, const char *attr, const char *value)
+{
+	size_t len = strlen(value);
+	
+	if (fd < 0)
+		return -1;
+	
+	led->writes++;
+	if (pwrite(fd, value, len, 0) != (ssize_t)len) {
+		led->write_errors++;
+		syslog(LOG_WARNING, "Failed to write %s/%s: %s", led->name, attr, strerror(errno));
+		return -1;
+	}
+	
+	return 0;
+}
+
+static int led_read_attr_at(int dir_fd, const char *attr, char *buf, size_t size)
 {
+	ssize_t len;
 	int fd;
-	uint32_t val;
-	ssize_t bytes_read;
 	
-	fd = open(path, O_RDONLY);
+	fd = openat(dir_fd, attr, O_RDONLY | O_CLOEXEC);
 	if (fd < 0)
-		return 0;
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+	return 0;
+}
+
+static int led_write_attr_at(int dir_fd, const char *attr, const char *value)
+{
+	size_t len = strlen(value);
+	ssize_t ret;
+	int fd;
 	
-	bytes_read = read(fd, &val, sizeof(val));
+	fd = openat(dir_fd, attr, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, value, len);
 	close(fd);
+	return ret == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * The multicolor class mixes its channels in multi_intensity and scales the
+ * result by brightness. Brightness is pinned at full so every channel is
+ * set directly, and a single multi_intensity write updates all of them.
+ */
+static int led_multicolor_open(struct led_device *dev)
+{
+	char path[PATH_MAX], buf[256], *tok, *save;
+	int dir_fd;
+	
+	if (root_path(path, sizeof(path), "/sys/class/leds/%s", dev->name) < 0)
+		return -1;
+	dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		syslog(LOG_WARNING, "Failed to open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	
+	dev->channels = 0;
+	if (led_read_attr_at(dir_fd, "multi_index", buf, sizeof(buf)) == 0) {
+		for (tok = strtok_r(buf, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save))
+			dev->channels++;
+	}
+	if (dev->channels > LED_DEVICE_CHANNELS)
+		dev->channels = LED_DEVICE_CHANNELS;
+	
+	dev->max_brightness = LED_MAX;
+	if (led_read_attr_at(dir_fd, "max_brightness", buf, sizeof(buf)) == 0 && atoi(buf) > 0)
+		dev->max_brightness = atoi(buf);
+	
+	snprintf(buf, sizeof(buf), "%u\n", dev->max_brightness);
+	if (dev->channels == 0 ||
+	    led_write_attr_at(dir_fd, "trigger", "none") < 0 ||
+	    led_write_attr_at(dir_fd, "brightness", buf) < 0 ||
+	    (dev->fd = openat(dir_fd, "multi_intensity", O_WRONLY | O_CLOEXEC)) < 0) {
+		syslog(LOG_WARNING, "%s is not a usable multicolor LED", dev->name);
+		close(dir_fd);
+		return -1;
+	}
+	
+	close(dir_fd);
+	return 0;
+}
+
+static int led_multicolor_commit(struct led_device *dev)
+{
+	char buf[LED_DEVICE_CHANNELS * 12];
+	unsigned int i;
+	int len = 0;
+	
+	for (i = 0; i < dev->channels; i++) {
+		len += snprintf(buf + len, sizeof(buf) - len, "%s%u", i ? " " : "",
+				(unsigned int)dev->value[i] * dev->max_brightness / LED_MAX);
+	}
+	buf[len++] = '\n';
+	
+	return pwrite(dev->fd, buf, len, 0) == len ? 0 : -1;
+}
+
+/*
+ * LP5812 register addresses are 10 bits wide, the top two go in the low
+ * bits of the I2C address. One write is one message, a whole batch of them
+ * goes out in a single I2C_RDWR transfer.
+ */
+struct lp5812_batch {
+	struct i2c_msg msgs[LP5812_MAX_MSGS];
+	uint8_t bufs[LP5812_MAX_MSGS][2];
+	unsigned int count;
+};
+
+static void lp5812_queue(struct lp5812_batch *b, uint16_t reg, uint8_t val)
+{
+	b->bufs[b->count][0] = reg & 0xff;
+	b->bufs[b->count][1] = val;
+	b->msgs[b->count].addr = (LP5812_I2C_ADDR << 2) | ((reg >> 8) & 0x3);
+	b->msgs[b->count].flags = 0;
+	b->msgs[b->count].len = 2;
+	b->msgs[b->count].buf = b->bufs[b->count];
+	b->count++;
+}
+
+static int lp5812_submit(int fd, struct lp5812_batch *b)
+{
+	struct i2c_rdwr_ioctl_data data = { .msgs = b->msgs, .nmsgs = b->count };
+	
+	return ioctl(fd, I2C_RDWR, &data) < 0 ? -1 : 0;
+}
+
+/* Direct drive mode, outputs enabled and dark, with a fixed drive current */
+static int led_lp5812_open(struct led_device *dev)
+{
+	char path[PATH_MAX];
+	struct lp5812_batch b = { .count = 0 };
+	unsigned int i;
+	
+	if (root_path(path, sizeof(path), "/dev/i2c-%s", dev->name) < 0)
+		return -1;
+	dev->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (dev->fd < 0) {
+		syslog(LOG_WARNING, "Failed to open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	
+	dev->channels = LP5812_CHANNELS;
+	dev->max_brightness = LED_MAX;
+	
+	lp5812_queue(&b, LP5812_REG_ENABLE, 0x01);
+	lp5812_queue(&b, LP5812_REG_LED_EN_1, (1 << LP5812_CHANNELS) - 1);
+	for (i = 0; i < LP5812_CHANNELS; i++) {
+		lp5812_queue(&b, LP5812_REG_MANUAL_DC + i, LP5812_DC_CURRENT);
+		lp5812_queue(&b, LP5812_REG_MANUAL_PWM + i, 0);
+		dev->applied[i] = LED_OFF;
+	}
+	lp5812_queue(&b, LP5812_REG_CMD_UPDATE, LP5812_UPDATE_KEY);
+	
+	if (lp5812_submit(dev->fd, &b) < 0) {
+		syslog(LOG_WARNING, "No LP5812 on %s: %s", path, strerror(errno));
+		close_fd(&dev->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int led_lp5812_commit(struct led_device *dev)
+{
+	struct lp5812_batch b = { .count = 0 };
+	unsigned int i;
+	
+	for (i = 0; i < dev->channels; i++) {
+		if (dev->value[i] != dev->applied[i])
+			lp5812_queue(&b, LP5812_REG_MANUAL_PWM + i, dev->value[i]);
+	}
+	return lp5812_submit(dev->fd, &b);
+}
+
+/* Devices are shared by all LEDs naming one of their channels */
+static struct led_device *led_device_get(enum led_backend backend, const char *name)
+{
+	struct led_device *dev;
+	unsigned int i;
+	int ret;
+	
+	for (dev = led_devices; dev; dev = dev->next) {
+		if (dev->backend == backend && strcmp(dev->name, name) == 0) {
+			dev->users++;
+			return dev;
+		}
+	}
+	
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+	dev->backend = backend;
+	dev->fd = -1;
+	snprintf(dev->name, sizeof(dev->name), "%s", name);
+	for (i = 0; i < LED_DEVICE_CHANNELS; i++)
+		dev->applied[i] = -1;
+	
+	ret = backend == LED_BACKEND_LP5812 ? led_lp5812_open(dev) : led_multicolor_open(dev);
+	if (ret < 0) {
+		close_fd(&dev->fd);
+		free(dev);
+		return NULL;
+	}
+	
+	dev->users = 1;
+	dev->next = led_devices;
+	led_devices = dev;
+	return dev;
+}
+
+static void led_device_put(struct led_device *dev)
+{
+	struct led_device **pp;
+	
+	if (--dev->users > 0)
+		return;
+	
+	for (pp = &led_devices; *pp; pp = &(*pp)->next) {
+		if (*pp == dev) {
+			*pp = dev->next;
+			break;
+		}
+	}
+	close_fd(&dev->fd);
+	free(dev);
+}
+
+/*
+ * Commit every channel changed since the last flush, one write or transfer
+ * per device. A failed commit leaves the channels unknown, so the next
+ * apply stages them again.
+ */
+static void led_flush(void)
+{
+	struct led_device *dev;
+	struct sfp_led *led;
+	unsigned int i;
+	int ret;
+	
+	for (dev = led_devices; dev; dev = dev->next) {
+		if (!dev->dirty)
+			continue;
+		dev->dirty = false;
+		
+		ret = dev->backend == LED_BACKEND_LP5812 ? led_lp5812_commit(dev) : led_multicolor_commit(dev);
+		dev->commits++;
+		if (ret < 0)
+			syslog(LOG_WARNING, "Failed to update LED device %s: %s", dev->name, strerror(errno));
+		
+		for (i = 0; i < dev->channels; i++) {
+			if (dev->value[i] == dev->applied[i])
+				continue;
+			led = dev->leds[i];
+			if (led) {
+				led->writes++;
+				if (ret < 0)
+					led->write_errors++;
+			}
+			dev->applied[i] = ret < 0 ? -1 : dev->value[i];
+		}
+	}
+}
+
+/* "<prefix><device>/<channel>", returns 0 if the name is not for this backend */
+static int led_parse_channel(const char *name, const char *prefix, char *device, size_t size,
+			     unsigned int *channel)
+{
+	size_t prefix_len = strlen(prefix);
+	const char *slash;
+	char *end;
+	
+	if (strncmp(name, prefix, prefix_len) != 0)
+		return 0;
+	
+	name += prefix_len;
+	slash = strrchr(name, '/');
+	if (!slash || slash == name || (size_t)(slash - name) >= size)
+		return -1;
+	*channel = strtoul(slash + 1, &end, 10);
+	if (end == slash + 1 || *end || *channel >= LED_DEVICE_CHANNELS)
+		return -1;
+	
+	memcpy(device, name, slash - name);
+	device[slash - name] = '\0';
+	return 1;
+}
+
+static int led_open_channel(struct sfp_led *led, enum led_backend backend, const char *device)
+{
+	struct led_device *dev;
+	
+	dev = led_device_get(backend, device);
+	if (!dev)
+		return -1;
+	
+	if (led->channel >= dev->channels || dev->leds[led->channel]) {
+		syslog(LOG_WARNING, "LED %s: channel %s", led->name,
+		       led->channel >= dev->channels ? "out of range" : "already in use");
+		led_device_put(dev);
+		return -1;
+	}
+	
+	dev->leds[led->channel] = led;
+	led->dev = dev;
+	return 0;
+}
+
+static int led_open(struct sfp_led *led)
+{
+	char path[PATH_MAX];
+	char device[MAX_LED_NAME];
+	int ret;
+	
+	ret = led_parse_channel(led->name, LED_MULTICOLOR_PREFIX, device, sizeof(device), &led->channel);
+	if (ret > 0)
+		return led_open_channel(led, LED_BACKEND_MULTICOLOR, device);
+	if (ret == 0)
+		ret = led_parse_channel(led->name, LED_LP5812_PREFIX, device, sizeof(device), &led->channel);
+	if (ret > 0)
+		return led_open_channel(led, LED_BACKEND_LP5812, device);
+	if (ret < 0) {
+		syslog(LOG_WARNING, "Invalid LED channel %s", led->name);
+		return -1;
+	}
+	
+	if (root_path(path, sizeof(path), "/sys/class/leds/%s", led->name) < 0) {
+		syslog(LOG_ERR, "Path too long for LED: %s", led->name);
+		return -1;
+	}
+	
+	led->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (led->dir_fd < 0) {
+		syslog(LOG_WARNING, "Failed to open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	
+	led->brightness_fd = led_open_attr(led, "brightness");
+	led->trigger_fd = led_open_attr(led, "trigger");
+	
+	return (led->brightness_fd < 0 || led->trigger_fd < 0) ? -1 : 0;
+}
+
+static void led_close_trigger_attrs(struct sfp_led *led)
+{
+	int i;
+	
+	for (i = 0; i < LED_TRIGGER_ATTRS; i++)
+		close_fd(&led->attr_fd[i]);
+}
+
+static bool led_is_open(const struct sfp_led *led)
+{
+	return led->dev || led->trigger_fd >= 0;
+}
+
+static void led_close(struct sfp_led *led)
+{
+	if (led->dev) {
+		led->dev->leds[led->channel] = NULL;
+		led_device_put(led->dev);
+		led->dev = NULL;
+	}
+	led_close_trigger_attrs(led);
+	close_fd(&led->brightness_fd);
+	close_fd(&led->trigger_fd);
+	close_fd(&led->dir_fd);
+	led->applied.trigger = LED_TRIGGER_UNKNOWN;
+	led->applied.brightness = -1;
+}
+
+static void led_set(struct sfp_led *led, int brightness)
+{
+	led->desired.trigger = LED_TRIGGER_NONE;
+	led->desired.brightness = brightness;
+}
+
+/* Without the kernel trigger to follow traffic, a batched LED is just lit */
+static void led_set_netdev(struct sfp_led *led)
+{
+	if (led->dev) {
+		led_set(led, LED_MAX);
+		return;
+	}
+	led->desired.trigger = LED_TRIGGER_NETDEV;
+	led->desired.brightness = -1;
+}
+
+/* A batched LED can't blink, its duty cycle becomes a steady brightness */
+static void led_set_blink(struct sfp_led *led, unsigned int on_ms, unsigned int off_ms)
+{
+	if (led->dev) {
+		led_set(led, LED_MAX * on_ms / (on_ms + off_ms));
+		return;
+	}
+	led->desired.trigger = LED_TRIGGER_TIMER;
+	led->desired.brightness = -1;
+	led->desired.delay_on_ms = on_ms;
+	led->desired.delay_off_ms = off_ms;
+}
+
+static int led_apply_netdev(struct sfp_led *led, const char *netdev)
+{
+	if (led_write_attr(led, led->trigger_fd, "trigger", "netdev") < 0)
+		return -1;
+	
+	/* Attributes below were just created by the trigger */
+	led_close_trigger_attrs(led);
+	led->attr_fd[0] = led_open_attr(led, "device_name");
+	led->attr_fd[1] = led_open_attr(led, "tx");
+	led->attr_fd[2] = led_open_attr(led, "rx");
+	
+	if (led_write_attr(led, led->attr_fd[0], "device_name", netdev) < 0)
+		return -1;
+	if (led_write_attr(led, led->attr_fd[1], "tx", "1") < 0 ||
+	    led_write_attr(led, led->attr_fd[2], "rx", "1") < 0)
+		syslog(LOG_WARNING, "Failed to enable tx/rx monitoring for %s", led->name);
+	
+	syslog(LOG_DEBUG, "Setup netdev trigger for %s on %s", led->name, netdev);
+	return 0;
+}
+
+static int led_apply_timer(struct sfp_led *led)
+{
+	if (led_write_attr(led, led->trigger_fd, "trigger", "timer") < 0)
+		return -1;
+	
+	led_close_trigger_attrs(led);
+	led->attr_fd[0] = led_open_attr(led, "delay_on");
+	led->attr_fd[1] = led_open_attr(led, "delay_off");
+	
+	/* Make sure the delays below are written, the trigger starts with its defaults */
+	led->applied.delay_on_ms = 0;
+	led->applied.delay_off_ms = 0;
+	return 0;
+}
+
+static int led_apply_delays(struct sfp_led *led)
+{
+	char buf[16];
+	
+	if (led->desired.delay_on_ms != led->applied.delay_on_ms) {
+		snprintf(buf, sizeof(buf), "%u\n", led->desired.delay_on_ms);
+		if (led_write_attr(led, led->attr_fd[0], "delay_on", buf) < 0)
+			return -1;
+		led->applied.delay_on_ms = led->desired.delay_on_ms;
+	}
+	
+	if (led->desired.delay_off_ms != led->applied.delay_off_ms) {
+		snprintf(buf, sizeof(buf), "%u\n", led->desired.delay_off_ms);
+		if (led_write_attr(led, led->attr_fd[1], "delay_off", buf) < 0)
+			return -1;
+		led->applied.delay_off_ms = led->desired.delay_off_ms;
+	}
+	
+	return 0;
+}
+
+/*
+ * Bring the LED in line with its desired state, touching only what differs.
+ * Batched LEDs only stage the change here, led_flush() commits it.
+ */
+static void led_apply(struct sfp_led *led, const char *netdev)
+{
+	char buf[BRIGHTNESS_BUF_SIZE];
+	
+	if (led->dev) {
+		led->dev->value[led->channel] = led->desired.brightness;
+		if (led->desired.brightness != led->dev->applied[led->channel])
+			led->dev->dirty = true;
+		return;
+	}
+	
+	if (led->trigger_fd < 0)
+		return;
+	
+	if (led->desired.trigger != led->applied.trigger) {
+		led->applied.trigger = LED_TRIGGER_UNKNOWN;
+		led->applied.brightness = -1;
+		
+		if (led->desired.trigger == LED_TRIGGER_NETDEV) {
+			if (led_apply_netdev(led, netdev) < 0)
+				return;
+		} else if (led->desired.trigger == LED_TRIGGER_TIMER) {
+			if (led_apply_timer(led) < 0)
+				return;
+		} else {
+			led_close_trigger_attrs(led);
+			if (led_write_attr(led, led->trigger_fd, "trigger", "none") < 0)
+				return;
+			/* Removing a trigger switches the LED off */
+			led->applied.brightness = LED_OFF;
+		}
+		
+		led->applied.trigger = led->desired.trigger;
+	}
+	
+	if (led->desired.trigger == LED_TRIGGER_TIMER && led_apply_delays(led) < 0) {
+		led->applied.trigger = LED_TRIGGER_UNKNOWN;
+		return;
+	}
+	
+	if (led->desired.trigger == LED_TRIGGER_NONE &&
+	    led->desired.brightness != led->applied.brightness) {
+		snprintf(buf, sizeof(buf), "%d\n", led->desired.brightness);
+		if (led_write_attr(led, led->brightness_fd, "brightness", buf) < 0) {
+			led->applied.brightness = -1;
+			return;
+		}
+		led->applied.brightness = led->desired.brightness;
+	}
+}
+
+/* Blink period interpolated geometrically between the slowest and fastest level */
+static void led_set_rate(struct sfp_led *led, unsigned int level)
+{
+	unsigned int period;
+	
+	if (level == 0) {
+		led_set(led, LED_OFF);
+		return;
+	}
+	
+	/* Dimmable instead, brighter the busier the link */
+	if (led->dev) {
+		led_set(led, LED_MAX * level / RATE_LEVELS);
+		return;
+	}
+	
+	period = (unsigned int)(RATE_BLINK_SLOW_MSEC *
+				pow((double)RATE_BLINK_FAST_MSEC / RATE_BLINK_SLOW_MSEC,
+				    (double)(level - 1) / (RATE_LEVELS - 1)));
+	led_set_blink(led, period / 2, period - period / 2);
+}
+
+/* Quantized so that small rate changes don't rewrite the trigger delays */
+static unsigned int rate_level(const struct traffic_rate *r)
+{
+	double bps, utilization;
+	
+	if (!r->valid || r->packets_per_s < RATE_IDLE_PPS)
+		return 0;
+	
+	bps = 8 * (r->rx_bytes_per_s > r->tx_bytes_per_s ? r->rx_bytes_per_s : r->tx_bytes_per_s);
+	utilization = bps / (r->speed_mbps * 1e6);
+	if (utilization < RATE_MIN_UTILIZATION)
+		utilization = RATE_MIN_UTILIZATION;
+	if (utilization > 1.0)
+		utilization = 1.0;
+	
+	return 1 + (unsigned int)lround((RATE_LEVELS - 1) * log(utilization / RATE_MIN_UTILIZATION) /
+					-log(RATE_MIN_UTILIZATION));
+}
+
+/*
+ * The sampling timer only runs while some port has light to show activity
+ * for, and slows down once none of them has seen traffic for a while.
+ */
+static void update_stats_timer(void)
+{
+	struct itimerspec its;
+	unsigned int interval = 0;
+	uint64_t first;
+	size_t i;
+	
+	if (stats_timer.fd < 0)
+		return;
+	
+	for (i = 0; i < num_ports; i++) {
+		if (ports[i].timer.fd >= 0 && (ports[i].ifindex || ports[i].vpp_interface[0]) &&
+		    ports[i].last_carrier_state)
+			interval = rate_sample_ms;
+	}
+	if (interval && rate_idle_since_ms && now_ms() - rate_idle_since_ms >= RATE_IDLE_AFTER_MSEC &&
+	    interval < RATE_IDLE_SAMPLE_MSEC)
+		interval = RATE_IDLE_SAMPLE_MSEC;
+	if (interval == stats_timer_interval_ms)
+		return;
+	
+	/* First expiry on the coalescing grid, the port timers use the same one */
+	memset(&its, 0, sizeof(its));
+	if (interval) {
+		first = coalesce_deadline(now_ms() + interval);
+		its.it_value.tv_sec = first / 1000;
+		its.it_value.tv_nsec = (first % 1000) * 1000000L;
+		its.it_interval.tv_sec = interval / 1000;
+		its.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+	}
+	
+	if (timerfd_settime(stats_timer.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		syslog(LOG_WARNING, "Failed to arm statistics timer: %s", strerror(errno));
+		return;
+	}
+	if (interval && stats_timer_interval_ms)
+		syslog(LOG_DEBUG, "Traffic sampling every %u ms", interval);
+	stats_timer_interval_ms = interval;
+}
+
+static unsigned int read_link_speed(const struct sfp_port *port)
+{
+	char path[PATH_MAX];
+	char buf[SPEED_BUF_SIZE];
+	int fd, ret, speed = -1;
+	
+	if (root_path(path, sizeof(path), "/sys/class/net/%s/speed", port->netdev) < 0)
+		return RATE_DEFAULT_SPEED_MBPS;
+	
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		ret = read(fd, buf, sizeof(buf) - 1);
+		if (ret > 0) {
+			buf[ret] = '\0';
+			speed = atoi(buf);
+		}
+		close(fd);
+	}
+	
+	/* Unknown while the link is down, reported as -1 */
+	return speed > 0 ? (unsigned int)speed : RATE_DEFAULT_SPEED_MBPS;
+}
+
+/* Rates restart from scratch on every link change */
+static void rate_link_changed(struct sfp_port *port)
+{
+	memset(&port->rate, 0, sizeof(port->rate));
+	if (activity_mode == ACTIVITY_RATE && port->last_carrier_state)
+		port->rate.speed_mbps = read_link_speed(port);
+	rate_idle_since_ms = 0;
+	update_stats_timer();
+}
+
+/*
+ * LED policy: nothing lit without a module, link LED on and activity LED
+ * following traffic with optical signal, activity LED solid on without.
+ * In rate mode the activity LED blinks faster the busier the link is.
+ * With the RX power threshold enabled, a link with weak signal blinks the
+ * link LED instead, the gpio LEDs have no brightness levels to dim with.
+ * LEDs on a batched device show both as brightness, see led_set_blink(),
+ * and have their changes for this port committed together.
+ */
+static void apply_port_leds(struct sfp_port *port, bool module_present, bool has_signal)
+{
+	uint64_t writes = port->link_led.writes + port->activity_led.writes;
+	
+	if (!module_present) {
+		led_set(&port->link_led, LED_OFF);
+		led_set(&port->activity_led, LED_OFF);
+	} else if (has_signal) {
+		if (port->dom.rx_low)
+			led_set_blink(&port->link_led, DOM_RX_LOW_BLINK_MSEC, DOM_RX_LOW_BLINK_MSEC);
+		else
+			led_set(&port->link_led, LED_MAX);
+		if (activity_mode == ACTIVITY_RATE)
+			led_set_rate(&port->activity_led, port->rate.level);
+		else
+			led_set_netdev(&port->activity_led);
+	} else {
+		led_set(&port->link_led, LED_OFF);
+		led_set(&port->activity_led, LED_MAX);
+	}
+	
+	led_apply(&port->link_led, port->netdev);
+	led_apply(&port->activity_led, port->netdev);
+	led_flush();
+	
+	/* Latency is measured up to the completion of the last LED write */
+	if (port->link_led.writes + port->activity_led.writes != writes) {
+		port->stats.led_changes++;
+		if (port->stats.event_ns)
+			hist_record(&port->stats.latency, (now_ns() - port->stats.event_ns) / 1000);
+	}
+	port->stats.event_ns = 0;
+}
+
+static int read_dt_string(const char *path, char *buf, size_t size)
+{
+	int fd;
+	ssize_t len;
+	
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	
+	len = read(fd, buf, size - 1);
+	close(fd);
+	
+	if (len <= 0)
+		return -1;
+	
+	buf[len] = '\0';
+	return 0;
+}
+
+/* compatible is a list of NUL separated strings */
+static bool dt_node_is_sfp(const char *node_path)
+{
+	char path[PATH_MAX];
+	char buf[256];
+	int fd;
+	ssize_t len;
+	const char *pos;
+	
+	if (snprintf(path, sizeof(path), "%s/compatible", node_path) >= (int)sizeof(path))
+		return false;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
+	
+	for (pos = buf; pos < buf + len; pos += strlen(pos) + 1) {
+		if (strcmp(pos, SFP_COMPATIBLE) == 0)
+			break;
+	}
+	if (pos >= buf + len)
+		return false;
+	
+	/* Disabled nodes have no sfp device bound to them */
+	if (snprintf(path, sizeof(path), "%s/status", node_path) >= (int)sizeof(path))
+		return false;
+	if (read_dt_string(path, buf, sizeof(buf)) == 0 &&
+	    strcmp(buf, "okay") != 0 && strcmp(buf, "ok") != 0)
+		return false;
+	
+	return true;
+}
+
+static void collect_sfp_nodes(const char *dir_path, int depth, char ***nodes, size_t *count)
+{
+	char path[PATH_MAX];
+	struct dirent *entry;
+	DIR *dir;
+	
+	if (depth > MAX_DT_DEPTH)
+		return;
+	
+	dir = opendir(dir_path);
+	if (!dir)
+		return;
+	
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_type != DT_DIR || entry->d_name[0] == '.')
+			continue;
+		
+		if (snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(path))
+			continue;
+		
+		if (dt_node_is_sfp(path)) {
+			char **grown = realloc(*nodes, (*count + 1) * sizeof(**nodes));
+			if (!grown)
+				break;
+			*nodes = grown;
+			(*nodes)[*count] = strdup(path);
+			if ((*nodes)[*count])
+				(*count)++;
+			continue;
+		}
+		
+		collect_sfp_nodes(path, depth + 1, nodes, count);
+	}
+	
+	closedir(dir);
+}
+
+static int compare_node_names(const void *a, const void *b)
+{
+	const char *na = strrchr(*(char * const *)a, '/') + 1;
+	const char *nb = strrchr(*(char * const *)b, '/') + 1;
+	
+	return strcmp(na, nb);
+}
+
+/*
+ * LED names come from the mono,link-led and mono,activity-led properties
+ * of the sfp node when present. Otherwise the sfpN:link and sfpN:activity
+ * convention is used, with N taken from the trailing digits of the node
+ * name (sfp-xfi0 -> sfp0) or the port's position if there are none.
+ */
+static void init_port_leds(struct sfp_port *port, size_t index)
+{
+	char path[PATH_MAX];
+	const char *digits = port->sfp_name + strlen(port->sfp_name);
+	unsigned long led_index = index;
+	
+	while (digits > port->sfp_name && digits[-1] >= '0' && digits[-1] <= '9')
+		digits--;
+	if (*digits)
+		led_index = strtoul(digits, NULL, 10);
+	
+	snprintf(path, sizeof(path), "%s/" DT_LINK_LED_PROP, port->dt_path);
+	if (read_dt_string(path, port->dt_link_led, sizeof(port->dt_link_led)) < 0)
+		snprintf(port->dt_link_led, sizeof(port->dt_link_led), "sfp%lu:link", led_index);
+	
+	snprintf(path, sizeof(path), "%s/" DT_ACTIVITY_LED_PROP, port->dt_path);
+	if (read_dt_string(path, port->dt_activity_led, sizeof(port->dt_activity_led)) < 0)
+		snprintf(port->dt_activity_led, sizeof(port->dt_activity_led), "sfp%lu:activity", led_index);
+}
+
+/* Build the port table from every enabled "sff,sfp" node in the device tree */
+static int discover_ports(void)
+{
+	char dt_base[PATH_MAX];
+	char **nodes = NULL;
+	struct sfp_netdev *netdevs;
+	size_t count = 0, num_netdevs, i;
+	
+	if (root_path(dt_base, sizeof(dt_base), DT_BASE) < 0)
+		return -1;
+	collect_sfp_nodes(dt_base, 0, &nodes, &count);
+	if (count == 0) {
+		free(nodes);
+		return -1;
+	}
+	
+	qsort(nodes, count, sizeof(*nodes), compare_node_names);
+	
+	ports = calloc(count, sizeof(*ports));
+	if (!ports || port_table_init(&ports_by_name, count) < 0) {
+		syslog(LOG_ERR, "Failed to allocate port table");
+		for (i = 0; i < count; i++)
+			free(nodes[i]);
+		free(nodes);
+		return -1;
+	}
+	
+	num_netdevs = build_sfp_netdev_map(&netdevs);
+	
+	for (i = 0; i < count; i++) {
+		struct sfp_port *port = &ports[num_ports];
+		const char *name = strrchr(nodes[i], '/') + 1;
+		
+		if (strlen(name) >= sizeof(port->sfp_name)) {
+			syslog(LOG_WARNING, "SFP node name %s too long, skipping", name);
+			free(nodes[i]);
+			continue;
+		}
+		
+		strcpy(port->sfp_name, name);
+		port->dt_path = nodes[i];
+		port->carrier_fd = -1;
+		port->mod_present_fd = -1;
+		port->timer.type = EVENT_PORT_TIMER;
+		port->timer.fd = -1;
+		port->damping.cfg = default_damping;
+		led_init(&port->link_led);
+		led_init(&port->activity_led);
+		init_port_leds(port, num_ports);
+		
+		/* Looked up once, a config reload never walks the device tree again */
+		find_netdev_for_sfp(port, netdevs, num_netdevs);
+		
+		port_table_insert(&ports_by_name, hash_str(port->sfp_name, strlen(port->sfp_name)), port);
+		num_ports++;
+		
+		syslog(LOG_DEBUG, "Discovered SFP cage %s (netdev=%s, link=%s, activity=%s)",
+		       port->sfp_name, port->dt_netdev[0] ? port->dt_netdev : "-",
+		       port->dt_link_led, port->dt_activity_led);
+	}
+	
+	free(netdevs);
+	free(nodes);
+	return num_ports > 0 ? 0 : -1;
+}
+
+static bool dom_queue_push(struct dom_queue *q, const struct dom_job *job)
+{
+	if (q->count == q->size)
+		return false;
+	q->jobs[(q->head + q->count) % q->size] = *job;
+	q->count++;
+	return true;
+}
+
+static bool dom_queue_pop(struct dom_queue *q, struct dom_job *job)
+{
+	if (q->count == 0)
+		return false;
+	*job = q->jobs[q->head];
+	q->head = (q->head + 1) % q->size;
+	q->count--;
+	return true;
+}
+
+static uint16_t get_be16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static float get_be_float(const uint8_t *p)
+{
+	uint32_t v = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+	float f;
+	
+	memcpy(&f, &v, sizeof(f));
+	return f;
+}
+
+static int ethtool_ioctl(int sock, const char *netdev, void *cmd)
+{
+	struct ifreq ifr;
+	
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", netdev);
+	ifr.ifr_data = cmd;
+	
+	return ioctl(sock, SIOCETHTOOL, &ifr) < 0 ? -errno : 0;
+}
+
+static int dom_read_eeprom(int sock, const char *netdev, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+	union {
+		struct ethtool_eeprom eeprom;
+		uint8_t raw[sizeof(struct ethtool_eeprom) + SFF8472_CAL_CONSTANTS_LEN];
+	} req;
+	int ret;
+	
+	if (len > SFF8472_CAL_CONSTANTS_LEN)
+		return -EINVAL;
+	
+	memset(&req, 0, sizeof(req));
+	req.eeprom.cmd = ETHTOOL_GMODULEEEPROM;
+	req.eeprom.offset = offset;
+	req.eeprom.len = len;
+	
+	ret = ethtool_ioctl(sock, netdev, &req);
+	if (ret < 0)
+		return ret;
+	
+	memcpy(buf, req.eeprom.data, len);
+	return 0;
+}
+
+static int dom_read_ident(int sock, const char *netdev, struct dom_ident *id)
+{
+	struct ethtool_modinfo modinfo;
+	uint8_t buf[SFF8472_CAL_CONSTANTS_LEN];
+	int i, ret;
+	
+	memset(id, 0, sizeof(*id));
+	memset(&modinfo, 0, sizeof(modinfo));
+	modinfo.cmd = ETHTOOL_GMODULEINFO;
+	ret = ethtool_ioctl(sock, netdev, &modinfo);
+	if (ret < 0)
+		return ret;
+	
+	/* SFF-8079 modules only have the A0h page */
+	if (modinfo.type != ETH_MODULE_SFF_8472 || modinfo.eeprom_len < ETH_MODULE_SFF_8472_LEN) {
+		id->known = true;
+		return 0;
+	}
+	
+	ret = dom_read_eeprom(sock, netdev, SFF8472_DIAG_TYPE, buf, 1);
+	if (ret < 0)
+		return ret;
+	id->ddm = buf[0] & SFF8472_DIAG_IMPLEMENTED;
+	id->external_cal = buf[0] & SFF8472_DIAG_EXTERNAL_CAL;
+	
+	if (id->ddm && id->external_cal) {
+		ret = dom_read_eeprom(sock, netdev, SFF8472_A2_BASE + SFF8472_CAL_CONSTANTS,
+				      buf, SFF8472_CAL_CONSTANTS_LEN);
+		if (ret < 0)
+			return ret;
+		
+		/* Stored highest order first, slopes are unsigned 8.8 fixed point */
+		for (i = 0; i < 5; i++)
+			id->rx_pwr[4 - i] = get_be_float(buf + i * 4);
+		id->tx_i_slope = get_be16(buf + 20) / 256.0;
+		id->tx_i_offset = (int16_t)get_be16(buf + 22);
+		id->tx_pwr_slope = get_be16(buf + 24) / 256.0;
+		id->tx_pwr_offset = (int16_t)get_be16(buf + 26);
+		id->t_slope = get_be16(buf + 28) / 256.0;
+		id->t_offset = (int16_t)get_be16(buf + 30);
+		id->v_slope = get_be16(buf + 32) / 256.0;
+		id->v_offset = (int16_t)get_be16(buf + 34);
+	}
+	
+	id->known = true;
+	return 0;
+}
+
+/* Runs on the worker thread, everything in here may block on I2C */
+static int dom_read(int sock, struct dom_job *job)
+{
+	const struct dom_ident *id = &job->ident;
+	struct dom_reading *r = &job->reading;
+	uint8_t buf[SFF8472_DIAG_VALUES_LEN];
+	double temp, vcc, bias, tx, rx;
+	int ret;
+	
+	if (!id->known) {
+		ret = dom_read_ident(sock, job->netdev, &job->ident);
+		if (ret < 0)
+			return ret;
+	}
+	
+	memset(r, 0, sizeof(*r));
+	if (!id->ddm)
+		return 0;
+	
+	ret = dom_read_eeprom(sock, job->netdev, SFF8472_A2_BASE + SFF8472_DIAG_VALUES,
+			      buf, SFF8472_DIAG_VALUES_LEN);
+	if (ret < 0)
+		return ret;
+	
+	temp = (int16_t)get_be16(buf);
+	vcc = get_be16(buf + 2);
+	bias = get_be16(buf + 4);
+	tx = get_be16(buf + 6);
+	rx = get_be16(buf + 8);
+	
+	if (id->external_cal) {
+		temp = id->t_slope * temp + id->t_offset;
+		vcc = id->v_slope * vcc + id->v_offset;
+		bias = id->tx_i_slope * bias + id->tx_i_offset;
+		tx = id->tx_pwr_slope * tx + id->tx_pwr_offset;
+		rx = (((id->rx_pwr[4] * rx + id->rx_pwr[3]) * rx + id->rx_pwr[2]) * rx +
+		      id->rx_pwr[1]) * rx + id->rx_pwr[0];
+	}
+	
+	/* SFF-8472 units: 1/256 C, 100 uV, 2 uA and 0.1 uW */
+	r->temp_c = temp / 256.0;
+	r->vcc_v = vcc * 100e-6;
+	r->tx_bias_ma = bias * 2e-3;
+	r->tx_power_mw = tx * 1e-4;
+	r->rx_power_mw = rx * 1e-4;
+	r->valid = true;
+	return 0;
+}
+
+/*
+ * Module EEPROM reads go over the SFP I2C bus and take milliseconds each,
+ * so they run on their own thread and never hold up the event loop.
+ * Requests and results are queued by value, an eventfd wakes the loop.
+ */
+static void *dom_worker(void *arg)
+{
+	struct dom_job job;
+	uint64_t start, one = 1;
+	int sock;
+	
+	(void)arg;
+	sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	
+	pthread_mutex_lock(&dom_lock);
+	while (!dom_stop) {
+		if (!dom_queue_pop(&dom_requests, &job)) {
+			pthread_cond_wait(&dom_cond, &dom_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&dom_lock);
+		
+		start = now_ns();
+		job.error = sock < 0 ? -EBADF : dom_read(sock, &job);
+		job.duration_us = (now_ns() - start) / 1000;
+		
+		pthread_mutex_lock(&dom_lock);
+		dom_queue_push(&dom_results, &job);
+		if (write(dom_source.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			break;
+	}
+	pthread_mutex_unlock(&dom_lock);
+	
+	if (sock >= 0)
+		close(sock);
+	return NULL;
+}
+
+static int dom_start(void)
+{
+	int ret;
+	
+	/* A port never has more than one read outstanding */
+	dom_requests.jobs = calloc(num_ports, sizeof(struct dom_job));
+	dom_results.jobs = calloc(num_ports, sizeof(struct dom_job));
+	if (!dom_requests.jobs || !dom_results.jobs)
+		return -1;
+	dom_requests.size = num_ports;
+	dom_results.size = num_ports;
+	
+	dom_source.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (dom_source.fd < 0 || epoll_add_source(&dom_source) < 0) {
+		syslog(LOG_ERR, "Failed to setup DOM eventfd: %s", strerror(errno));
+		close_fd(&dom_source.fd);
+		return -1;
+	}
+	
+	ret = pthread_create(&dom_thread, NULL, dom_worker, NULL);
+	if (ret != 0) {
+		syslog(LOG_ERR, "Failed to start DOM worker: %s", strerror(ret));
+		close_fd(&dom_source.fd);
+		return -1;
+	}
+	
+	return 0;
+}
+
+static void dom_shutdown(void)
+{
+	if (dom_source.fd >= 0) {
+		pthread_mutex_lock(&dom_lock);
+		dom_stop = true;
+		pthread_cond_signal(&dom_cond);
+		pthread_mutex_unlock(&dom_lock);
+		pthread_join(dom_thread, NULL);
+		close_fd(&dom_source.fd);
+	}
+	
+	free(dom_requests.jobs);
+	free(dom_results.jobs);
+}
+
+/* Forget everything about the previous module, a read in flight gets dropped */
+static void dom_reset(struct sfp_port *port)
+{
+	struct sfp_dom *d = &port->dom;
+	
+	d->seq++;
+	memset(&d->ident, 0, sizeof(d->ident));
+	memset(&d->reading, 0, sizeof(d->reading));
+	d->read_at_ms = 0;
+	d->next_read_ms = 0;
+	d->last_error = 0;
+	d->rx_low = false;
+	port->dom_at_ms = 0;
+}
+
+/*
+ * Ask for fresh diagnostics. Reads of one module are at least
+ * dom_interval_ms apart, a request within that window is deferred to the
+ * port timer. Callers keep using the cached values in the meantime.
+ */
+static void dom_request(struct sfp_port *port)
+{
+	struct sfp_dom *d = &port->dom;
+	struct dom_job job;
+	uint64_t now;
+	
+	if (dom_source.fd < 0 || port->timer.fd < 0 || d->busy || !port->last_module_present)
+		return;
+	if (d->ident.known && !d->ident.ddm)
+		return;
+	
+	now = now_ms();
+	if (now < d->next_read_ms) {
+		port->dom_at_ms = earliest_deadline(port->dom_at_ms, d->next_read_ms);
+		rearm_port_timer(port);
+		return;
+	}
+	
+	memset(&job, 0, sizeof(job));
+	job.port = port - ports;
+	job.seq = d->seq;
+	memcpy(job.netdev, port->netdev, sizeof(job.netdev));
+	job.ident = d->ident;
+	
+	d->busy = true;
+	d->next_read_ms = now + dom_interval_ms;
+	
+	pthread_mutex_lock(&dom_lock);
+	dom_queue_push(&dom_requests, &job);
+	pthread_cond_signal(&dom_cond);
+	pthread_mutex_unlock(&dom_lock);
+}
+
+static double mw_to_dbm(double mw)
+{
+	return mw > 0 ? 10.0 * log10(mw) : DOM_POWER_FLOOR_DBM;
+}
+
+static void dom_update_rx_low(struct sfp_port *port)
+{
+	struct sfp_dom *d = &port->dom;
+	bool rx_low = d->rx_low;
+	double dbm;
+	
+	if (!dom_rx_low_enabled)
+		return;
+	
+	if (!d->reading.valid) {
+		rx_low = false;
+	} else {
+		dbm = mw_to_dbm(d->reading.rx_power_mw);
+		if (dbm < dom_rx_low_dbm)
+			rx_low = true;
+		else if (dbm >= dom_rx_low_dbm + DOM_RX_LOW_HYSTERESIS_DB)
+			rx_low = false;
+	}
+	
+	if (rx_low != d->rx_low) {
+		d->rx_low = rx_low;
+		syslog(rx_low ? LOG_WARNING : LOG_INFO, "%s: RX power %.1f dBm, %s threshold of %.1f dBm",
+		       port->netdev, mw_to_dbm(d->reading.rx_power_mw),
+		       rx_low ? "below" : "back above", dom_rx_low_dbm);
+		
+		/* Flap damping owns the LEDs while suppressed */
+		if (!port->damping.suppressed)
+			apply_port_leds(port, port->last_module_present, port->last_carrier_state);
+	}
+	
+	/* Only the RX threshold needs diagnostics without anyone asking */
+	if (port->last_module_present)
+		dom_request(port);
+}
+
+static void handle_dom_result(struct sfp_port *port, const struct dom_job *job)
+{
+	struct sfp_dom *d = &port->dom;
+	
+	d->reads++;
+	hist_record(&d->read_time, job->duration_us);
+	
+	if (job->error < 0) {
+		d->read_errors++;
+		if (job->error != d->last_error)
+			syslog(LOG_WARNING, "%s: failed to read module diagnostics: %s",
+			       port->netdev, strerror(-job->error));
+		d->last_error = job->error;
+		memset(&d->reading, 0, sizeof(d->reading));
+	} else {
+		if (!d->ident.known)
+			syslog(LOG_INFO, "%s: module diagnostics %s", port->netdev,
+			       !job->ident.ddm ? "not implemented" :
+			       job->ident.external_cal ? "externally calibrated" : "internally calibrated");
+		d->ident = job->ident;
+		d->reading = job->reading;
+		d->read_at_ms = now_ms();
+		d->last_error = 0;
+	}
+	
+	dom_update_rx_low(port);
+}
+
+static void process_dom_results(int fd)
+{
+	struct dom_job job;
+	struct sfp_port *port;
+	uint64_t count;
+	bool have_job;
+	
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+		return;
+	
+	for (;;) {
+		pthread_mutex_lock(&dom_lock);
+		have_job = dom_queue_pop(&dom_results, &job);
+		pthread_mutex_unlock(&dom_lock);
+		if (!have_job)
+			break;
+		
+		port = &ports[job.port];
+		port->dom.busy = false;
+		
+		/* The module changed while this was being read, start over */
+		if (job.seq != port->dom.seq) {
+			dom_request(port);
+			continue;
+		}
+		handle_dom_result(port, &job);
+	}
+}
+
+/* Called before rendering metrics, scrapes get the cache and kick a refresh */
+static void dom_refresh_stale(void)
+{
+	uint64_t now = now_ms();
+	size_t i;
+	
+	for (i = 0; i < num_ports; i++) {
+		if (now - ports[i].dom.read_at_ms >= dom_interval_ms)
+			dom_request(&ports[i]);
+	}
+}
+
+static int setup_port(struct sfp_port *port)
+{
+	char path[PATH_MAX];
+	int ret;
+	
+	/* Network device from the config, or discovered from the device tree */
+	if (!port->cfg.netdev[0]) {
+		syslog(LOG_ERR, "Failed to find network device for %s", port->sfp_name);
+		return -1;
+	}
+	memcpy(port->netdev, port->cfg.netdev, sizeof(port->netdev));
+	
+	port->timer.port = port;
+	port->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (port->timer.fd < 0) {
+		syslog(LOG_ERR, "Failed to create timer for %s: %s", port->sfp_name, strerror(errno));
+		return -1;
+	}
+	if (epoll_add_source(&port->timer) < 0)
+		goto cleanup;
+	
+	/* Open carrier file */
+	ret = root_path(path, sizeof(path), "/sys/class/net/%s/carrier", port->netdev);
+	if (ret < 0) {
+		syslog(LOG_ERR, "Path too long for carrier file: %s", port->netdev);
+		goto cleanup;
+	}
+	port->carrier_fd = open_file_ro(path);
+	
+	/* rtnetlink reports links by index, resolve it once up front */
+	port->ifindex = if_nametoindex(port->netdev);
+	if (port->ifindex == 0) {
+		syslog(LOG_WARNING, "Failed to resolve ifindex for %s: %s",
+		       port->netdev, strerror(errno));
+	}
+	
+	ret = root_path(path, sizeof(path), "/sys/kernel/debug/%s/state", port->sfp_name);
+	if (ret < 0) {
+		syslog(LOG_ERR, "Path too long for debugfs: %s", port->sfp_name);
+		goto cleanup;
+	}
+	port->mod_present_fd = open_file_ro(path);
+	if (port->mod_present_fd < 0) {
+		syslog(LOG_WARNING, "Cannot open %s debugfs, module detection disabled", port->sfp_name);
+	}
+	
+	led_open(&port->link_led);
+	led_open(&port->activity_led);
+	
+	if (port->carrier_fd < 0 || !led_is_open(&port->link_led) || !led_is_open(&port->activity_led)) {
+		syslog(LOG_ERR, "Failed to setup port %s", port->netdev);
+		goto cleanup;
+	}
+	
+	/* Read initial module presence state */
+	read_sfp_state(port->mod_present_fd, &port->sfp);
+	port->last_module_present = port->sfp.moddef0;
+	port->last_carrier_state = port->sfp.moddef0 && !port->sfp.rx_los;
+	port->carrier = read_carrier_state(port->carrier_fd);
+	rate_link_changed(port);
+	
+	syslog(LOG_INFO, "Setup port %s (link=%s, activity=%s, sfp=%s, module_present=%d, carrier=%d)", 
+	       port->netdev, port->link_led.name, port->activity_led.name, port->sfp_name,
+	       port->last_module_present, port->carrier);
+	
+	/* Setup appropriate LED state based on module presence and optical signal */
+	apply_port_leds(port, port->last_module_present, port->last_carrier_state);
+	dom_request(port);
+	
+	if (port_needs_polling(port)) {
+		port->poll_at_ms = now_ms() + poll_interval_ms;
+		rearm_port_timer(port);
+	}
+	
+	return 0;
+
+cleanup:
+	cleanup_port(port);
+	return -1;
+}
+
+static void cleanup_port(struct sfp_port *port)
+{
+	dom_reset(port);
+	port->ifindex = 0;
+	port->update_at_ms = 0;
+	port->poll_at_ms = 0;
+	port->damping_at_ms = 0;
+	
+	apply_port_leds(port, false, false);
+	led_close(&port->link_led);
+	led_close(&port->activity_led);
+	
+	close_fd(&port->carrier_fd);
+	close_fd(&port->mod_present_fd);
+	close_fd(&port->timer.fd);
+	update_stats_timer();
+}
+
+static void damping_decay(struct flap_damping *d, uint64_t now)
+{
+	if (d->penalty > 0 && now > d->decayed_at_ms)
+		d->penalty *= exp2(-(double)(now - d->decayed_at_ms) / d->cfg.half_life_ms);
+	d->decayed_at_ms = now;
+}
+
+/* Time at which the current penalty will have decayed to the reuse threshold */
+static uint64_t damping_reuse_at(const struct flap_damping *d, uint64_t now)
+{
+	double halvings;
+	
+	if (d->penalty <= d->cfg.reuse)
+		return now;
+	
+	halvings = log2(d->penalty / (d->cfg.reuse ? d->cfg.reuse : 1));
+	return now + (uint64_t)ceil(halvings * d->cfg.half_life_ms);
+}
+
+static void damping_record_transition(struct sfp_port *port, uint64_t now)
+{
+	struct flap_damping *d = &port->damping;
+	
+	d->transitions++;
+	if (!d->cfg.enabled)
+		return;
+	
+	d->penalty += d->cfg.penalty;
+	if (d->penalty > d->cfg.max_penalty)
+		d->penalty = d->cfg.max_penalty;
+	
+	if (d->suppressed) {
+		d->suppressed_transitions++;
+		d->coalesced_transitions++;
+	} else if (d->penalty >= d->cfg.suppress) {
+		d->suppressed = true;
+		d->suppressed_since_ms = now;
+		d->suppressed_transitions = 0;
+		d->next_led_update_ms = now + d->cfg.hold_ms;
+		d->suppressions++;
+		syslog(LOG_WARNING, "%s: link flapping (penalty %.0f, %llu transitions total), "
+		       "limiting LED updates to one per %u ms",
+		       port->netdev, d->penalty, (unsigned long long)d->transitions, d->cfg.hold_ms);
+	}
+}
+
+static void update_port(struct sfp_port *port)
+{
+	struct flap_damping *d = &port->damping;
+	bool module_present, has_signal, changed;
+	uint64_t now = now_ms();
+	
+	port->stats.updates++;
+	port->stats.state_reads++;
+	if (read_sfp_state(port->mod_present_fd, &port->sfp) < 0)
+		port->stats.state_read_errors++;
+	module_present = port->sfp.moddef0;
+	/* Optical signal, not netdev carrier, which is informational only */
+	has_signal = module_present && !port->sfp.rx_los;
+	changed = module_present != port->last_module_present ||
+		  has_signal != port->last_carrier_state;
+	
+	damping_decay(d, now);
+	if (changed) {
+		bool was_suppressed = d->suppressed;
+		
+		damping_record_transition(port, now);
+		
+		/* While suppressed, the summary logged on recovery replaces these */
+		if (!was_suppressed) {
+			if (module_present != port->last_module_present) {
+				syslog(LOG_INFO, "%s: SFP module %s", port->netdev,
+				       module_present ? "inserted" : "removed");
+			} else {
+				syslog(LOG_INFO, "%s: optical link %s", port->netdev, has_signal ? "UP" : "DOWN");
+			}
+		}
+	}
+	
+	if (module_present != port->last_module_present)
+		dom_reset(port);
+	port->last_module_present = module_present;
+	port->last_carrier_state = has_signal;
+	port->damping_at_ms = 0;
+	
+	/* A new module or a link change is worth a fresh look at the diagnostics */
+	if (changed) {
+		dom_request(port);
+		rate_link_changed(port);
+	}
+	
+	if (d->suppressed && d->penalty < d->cfg.reuse) {
+		d->suppressed = false;
+		syslog(LOG_INFO, "%s: link stable again, %u transitions coalesced over %llu s, "
+		       "module %s, optical link %s",
+		       port->netdev, d->suppressed_transitions,
+		       (unsigned long long)(now - d->suppressed_since_ms) / 1000,
+		       module_present ? "present" : "absent", has_signal ? "UP" : "DOWN");
+	}
+	
+	if (d->suppressed) {
+		/* Coalesce into at most one LED update per hold period */
+		if (now < d->next_led_update_ms) {
+			port->damping_at_ms = d->next_led_update_ms;
+			return;
+		}
+		d->next_led_update_ms = now + d->cfg.hold_ms;
+		port->damping_at_ms = damping_reuse_at(d, now);
+	}
+	
+	apply_port_leds(port, module_present, has_signal);
+}
+
+static struct sfp_port *find_port_by_ifindex(int ifindex)
+{
+	size_t slot;
+	struct sfp_port *port;
+	
+	if (ifindex <= 0 || !ports_by_ifindex.slots)
+		return NULL;
+	
+	for (slot = hash_u32(ifindex) & ports_by_ifindex.mask;
+	     (port = ports_by_ifindex.slots[slot]) != NULL;
+	     slot = (slot + 1) & ports_by_ifindex.mask) {
+		if (port->ifindex == ifindex)
+			return port;
+	}
+	
+	return NULL;
+}
+
+/*
+ * Subscribe to RTNLGRP_LINK so carrier changes on the SFP netdevs are
+ * pushed to us as they happen instead of being discovered by polling.
+ */
+static int open_rtnetlink(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+	
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0) {
+		syslog(LOG_WARNING, "Failed to open rtnetlink socket: %s", strerror(errno));
+		return -1;
+	}
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK;
+	
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		syslog(LOG_WARNING, "Failed to bind rtnetlink socket: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+static void handle_link_msg(struct nlmsghdr *nlh)
+{
+	struct ifinfomsg *ifi;
+	struct rtattr *rta;
+	struct sfp_port *port;
+	int len;
+	bool carrier;
+	
+	if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return;
+	
+	ifi = NLMSG_DATA(nlh);
+	port = find_port_by_ifindex(ifi->ifi_index);
+	if (!port)
+		return;
+	
+	carrier = nlh->nlmsg_type == RTM_NEWLINK && (ifi->ifi_flags & IFF_LOWER_UP);
+	
+	/* Prefer operstate when the kernel reports it, it also covers dormant links */
+	len = IFLA_PAYLOAD(nlh);
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_OPERSTATE && RTA_PAYLOAD(rta) >= sizeof(__u8)) {
+			__u8 operstate = *(__u8 *)RTA_DATA(rta);
+			carrier = carrier && (operstate == IF_OPER_UP || operstate == IF_OPER_UNKNOWN);
+			break;
+		}
+	}
+	
+	if (carrier != port->carrier) {
+		syslog(LOG_DEBUG, "%s: carrier %s", port->netdev, carrier ? "up" : "down");
+		port->carrier = carrier;
+	}
+	
+	/*
+	 * Carrier is only exported, the link LED keeps showing the optical signal
+	 * from debugfs rx_los. A carrier change does mean rx_los is worth a look.
+	 */
+	schedule_port_update(port);
+}
+
+/*
+ * Drain the rtnetlink socket. Returns -1 if the socket overflowed and
+ * events may have been lost, in which case the caller should resync.
+ */
+static int process_rtnetlink(int fd)
+{
+	char buf[NETLINK_BUF_SIZE] __attribute__((aligned(__alignof__(struct nlmsghdr))));
+	struct nlmsghdr *nlh;
+	ssize_t len;
+	int ret = 0;
+	
+	for (;;) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				syslog(LOG_WARNING, "rtnetlink overrun, resyncing ports");
+				ret = -1;
+				continue;
+			}
+			break;
+		}
+		if (len == 0)
+			break;
+		
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == RTM_NEWLINK || nlh->nlmsg_type == RTM_DELLINK)
+				handle_link_msg(nlh);
+		}
+	}
+	
+	return ret;
+}
+
+/* Separate from the link event socket so dump replies never queue behind events */
+static int open_stats_netlink(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+	
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0) {
+		syslog(LOG_WARNING, "Failed to open rtnetlink stats socket: %s", strerror(errno));
+		return -1;
+	}
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		syslog(LOG_WARNING, "Failed to bind rtnetlink stats socket: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+/* One dump returns the 64-bit counters of every link in a single round trip */
+static void request_link_stats(void)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct if_stats_msg ifsm;
+	} req;
+	
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifsm));
+	req.nlh.nlmsg_type = RTM_GETSTATS;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = ++stats_seq;
+	req.ifsm.filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+	
+	if (send(stats_source.fd, &req, req.nlh.nlmsg_len, 0) < 0) {
+		stats_dump_errors++;
+		return;
+	}
+	stats_dump_pending = true;
+	stats_dumps++;
+}
+
+static void rate_sample(struct sfp_port *port, uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t packets, uint64_t now)
+{
+	struct traffic_rate *r = &port->rate;
+	unsigned int level;
+	double dt, alpha;
+	
+	/* Counters going backwards mean the device was reset, start over */
+	if (r->valid && (rx_bytes < r->rx_bytes || tx_bytes < r->tx_bytes || packets < r->packets))
+		r->valid = false;
+	
+	if (r->valid && now > r->sampled_ns) {
+		dt = (now - r->sampled_ns) / 1e9;
+		alpha = 1.0 - exp(-dt * 1000 / RATE_EWMA_TAU_MSEC);
+		r->rx_bytes_per_s += alpha * ((rx_bytes - r->rx_bytes) / dt - r->rx_bytes_per_s);
+		r->tx_bytes_per_s += alpha * ((tx_bytes - r->tx_bytes) / dt - r->tx_bytes_per_s);
+		r->packets_per_s += alpha * ((packets - r->packets) / dt - r->packets_per_s);
+	}
+	
+	r->valid = true;
+	r->sampled_ns = now;
+	r->rx_bytes = rx_bytes;
+	r->tx_bytes = tx_bytes;
+	r->packets = packets;
+	
+	level = rate_level(r);
+	if (level != r->level) {
+		r->level = level;
+		/* Flap damping owns the LEDs while suppressed */
+		if (!port->damping.suppressed)
+			apply_port_leds(port, port->last_module_present, port->last_carrier_state);
+	}
+}
+
+static void rate_stop(struct sfp_port *port)
+{
+	struct traffic_rate *r = &port->rate;
+	
+	r->valid = false;
+	r->rx_bytes_per_s = 0;
+	r->tx_bytes_per_s = 0;
+	r->packets_per_s = 0;
+	if (r->level) {
+		r->level = 0;
+		if (!port->damping.suppressed)
+			apply_port_leds(port, port->last_module_present, port->last_carrier_state);
+	}
+}
+
+static void handle_stats_msg(struct nlmsghdr *nlh, uint64_t now)
+{
+	struct if_stats_msg *ifsm;
+	struct rtnl_link_stats64 st;
+	struct rtattr *rta;
+	struct sfp_port *port;
+	int len;
+	
+	if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifsm)))
+		return;
+	
+	ifsm = NLMSG_DATA(nlh);
+	port = find_port_by_ifindex(ifsm->ifindex);
+	if (!port || !port->last_carrier_state || port->vpp_interface[0])
+		return;
+	
+	len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifsm));
+	for (rta = (struct rtattr *)((char *)ifsm + NLMSG_ALIGN(sizeof(*ifsm)));
+	     RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_STATS_LINK_64 && RTA_PAYLOAD(rta) >= sizeof(st)) {
+			/* Attribute payloads are only 4-byte aligned */
+			memcpy(&st, RTA_DATA(rta), sizeof(st));
+			rate_sample(port, st.rx_bytes, st.tx_bytes, st.rx_packets + st.tx_packets, now);
+			break;
+		}
+	}
+}
+
+static void process_link_stats(int fd)
+{
+	char buf[NETLINK_BUF_SIZE] __attribute__((aligned(__alignof__(struct nlmsghdr))));
+	struct nlmsghdr *nlh;
+	uint64_t now = now_ns();
+	ssize_t len;
+	
+	for (;;) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				/* Part of the dump was lost, the next tick starts a new one */
+				stats_dump_errors++;
+				stats_dump_pending = false;
+				continue;
+			}
+			break;
+		}
+		if (len == 0)
+			break;
+		
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_seq != stats_seq)
+				continue;
+			
+			if (nlh->nlmsg_type == RTM_NEWSTATS) {
+				handle_stats_msg(nlh, now);
+			} else if (nlh->nlmsg_type == NLMSG_DONE) {
+				stats_dump_pending = false;
+			} else if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nlh);
+				
+				if (stats_dump_errors++ == 0)
+					syslog(LOG_WARNING, "RTM_GETSTATS failed: %s", strerror(-err->error));
+				stats_dump_pending = false;
+			}
+		}
+	}
+}
+
+/*
+ * VPP stats segment. With the VPP data plane the kernel netdevs carry no
+ * traffic, but VPP publishes its interface counters in a shared memory
+ * segment. The segment fd is handed out over the stats socket, after that
+ * reads are plain memory accesses: pointers in the segment are VPP's own
+ * addresses and get rebased onto our mapping, and a read is only valid if
+ * the epoch didn't change and no writer was in progress around it.
+ */
+static const uint8_t *vpp_ptr(uint64_t p, size_t len)
+{
+	uint64_t base = ((const struct vpp_stats_header *)vpp_segment)->base;
+	
+	if (p < base || p - base > vpp_segment_size || len > vpp_segment_size - (p - base))
+		return NULL;
+	return vpp_segment + (p - base);
+}
+
+/* VPP vectors carry their length in the header just before the data */
+static bool vpp_vec(uint64_t p, size_t elt_size, const uint8_t **data, uint32_t *len)
+{
+	const uint8_t *hdr;
+	
+	if (p == 0 || !(hdr = vpp_ptr(p - VPP_VEC_HEADER_SIZE, VPP_VEC_HEADER_SIZE)))
+		return false;
+	memcpy(len, hdr, sizeof(*len));
+	*data = vpp_ptr(p, (size_t)*len * elt_size);
+	return *data != NULL;
+}
+
+static void vpp_unmap(void)
+{
+	if (vpp_segment)
+		munmap((void *)vpp_segment, vpp_segment_size);
+	vpp_segment = NULL;
+	vpp_segment_size = 0;
+	vpp_dir_epoch = UINT64_MAX;
+}
+
+static void vpp_connect(void)
+{
+	struct sockaddr_un addr;
+	uint64_t now = now_ms();
+	int fd;
+	
+	if (vpp_source.fd >= 0 || now < vpp_retry_at_ms)
+		return;
+	vpp_retry_at_ms = now + VPP_RETRY_MSEC;
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", vpp_stats_path) >= (int)sizeof(addr.sun_path))
+		return;
+	
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+	
+	/* Not running yet is the normal case at boot, keep quiet */
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+		close(fd);
+		return;
+	}
+	
+	vpp_source.fd = fd;
+	if (epoll_add_source(&vpp_source) < 0)
+		close_fd(&vpp_source.fd);
+}
+
+/* VPP sends the segment memfd as soon as it accepts the connection */
+static void vpp_receive_segment(int fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))] __attribute__((aligned(__alignof__(struct cmsghdr))));
+	const struct vpp_stats_header *hdr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct stat st;
+	char byte;
+	ssize_t ret;
+	int mfd = -1;
+	void *map;
+	
+	iov.iov_base = &byte;
+	iov.iov_len = sizeof(byte);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	
+	ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	
+	for (cmsg = ret > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&mfd, CMSG_DATA(cmsg), sizeof(mfd));
+	}
+	close_fd(&vpp_source.fd);
+	
+	if (mfd < 0) {
+		syslog(LOG_WARNING, "No stats segment received from %s", vpp_stats_path);
+		return;
+	}
+	
+	if (fstat(mfd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(mfd);
+		return;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, mfd, 0);
+	close(mfd);
+	if (map == MAP_FAILED) {
+		syslog(LOG_WARNING, "Failed to map VPP stats segment: %s", strerror(errno));
+		return;
+	}
+	
+	hdr = map;
+	if (hdr->version != VPP_STATS_VERSION) {
+		syslog(LOG_WARNING, "Unsupported VPP stats segment version %llu", (unsigned long long)hdr->version);
+		munmap(map, st.st_size);
+		return;
+	}
+	
+	vpp_segment = map;
+	vpp_segment_size = st.st_size;
+	vpp_dir_epoch = UINT64_MAX;
+	vpp_check_at_ms = now_ms() + VPP_RETRY_MSEC;
+	vpp_socket_ino = stat(vpp_stats_path, &st) == 0 ? st.st_ino : 0;
+	syslog(LOG_INFO, "Mapped VPP stats segment (%zu bytes)", vpp_segment_size);
+}
+
+/* A restarted VPP creates a new socket and segment, the old mapping just goes quiet */
+static bool vpp_segment_stale(void)
+{
+	struct stat st;
+	uint64_t now = now_ms();
+	
+	if (now < vpp_check_at_ms)
+		return false;
+	vpp_check_at_ms = now + VPP_RETRY_MSEC;
+	
+	return stat(vpp_stats_path, &st) < 0 || st.st_ino != vpp_socket_ino;
+}
+
+static const struct vpp_stats_entry *vpp_find_entry(const uint8_t *dir, uint32_t count, const char *name)
+{
+	const struct vpp_stats_entry *entry;
+	uint32_t i;
+	
+	for (i = 0; i < count; i++) {
+		entry = (const struct vpp_stats_entry *)(dir + (size_t)i * sizeof(*entry));
+		if (strncmp(entry->name, name, sizeof(entry->name)) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/* Directory entries and sw_if_index of each port, redone whenever the epoch moves */
+static int vpp_resolve(const struct vpp_stats_header *hdr)
+{
+	const struct vpp_stats_entry *names;
+	const uint8_t *dir, *vec, *str;
+	uint32_t count, len, slen, i;
+	size_t p;
+	uint64_t sp;
+	
+	if (!vpp_vec(hdr->directory_vector, sizeof(struct vpp_stats_entry), &dir, &count))
+		return -1;
+	
+	vpp_rx = vpp_find_entry(dir, count, "/if/rx");
+	vpp_tx = vpp_find_entry(dir, count, "/if/tx");
+	names = vpp_find_entry(dir, count, "/if/names");
+	if (!vpp_rx || !vpp_tx || !names ||
+	    vpp_rx->type != VPP_STAT_DIR_COUNTER_VECTOR_COMBINED ||
+	    vpp_tx->type != VPP_STAT_DIR_COUNTER_VECTOR_COMBINED ||
+	    !vpp_vec(names->data, sizeof(uint64_t), &vec, &len))
+		return -1;
+	
+	for (p = 0; p < num_ports; p++) {
+		struct sfp_port *port = &ports[p];
+		
+		port->vpp_sw_if_index = VPP_SW_IF_INDEX_INVALID;
+		if (!port->vpp_interface[0])
+			continue;
+		
+		/* Names are NUL terminated vectors, deleted interfaces leave a hole */
+		for (i = 0; i < len; i++) {
+			memcpy(&sp, vec + (size_t)i * sizeof(sp), sizeof(sp));
+			if (!vpp_vec(sp, 1, &str, &slen))
+				continue;
+			if (strnlen((const char *)str, slen) == strlen(port->vpp_interface) &&
+			    strncmp((const char *)str, port->vpp_interface, slen) == 0) {
+				port->vpp_sw_if_index = i;
+				break;
+			}
+		}
+	}
+	
+	return 0;
+}
+
+/* Sum of one interface's combined counter over all VPP threads */
+static bool vpp_read_counter(const struct vpp_stats_entry *entry, uint32_t sw_if_index,
+			     struct vpp_counter *sum)
+{
+	const uint8_t *threads, *counters;
+	uint32_t nthreads, n, t;
+	struct vpp_counter c;
+	uint64_t p;
+	
+	if (!vpp_vec(entry->data, sizeof(uint64_t), &threads, &nthreads))
+		return false;
+	
+	memset(sum, 0, sizeof(*sum));
+	for (t = 0; t < nthreads; t++) {
+		memcpy(&p, threads + (size_t)t * sizeof(p), sizeof(p));
+		if (!vpp_vec(p, sizeof(c), &counters, &n))
+			return false;
+		if (sw_if_index >= n)
+			continue;
+		memcpy(&c, counters + (size_t)sw_if_index * sizeof(c), sizeof(c));
+		sum->packets += c.packets;
+		sum->bytes += c.bytes;
+	}
+	return true;
+}
+
+static void vpp_sample(void)
+{
+	const struct vpp_stats_header *hdr;
+	struct vpp_counter rx, tx;
+	uint64_t epoch, now;
+	int attempt;
+	size_t i;
+	
+	if (!vpp_segment) {
+		vpp_connect();
+		return;
+	}
+	if (vpp_segment_stale()) {
+		syslog(LOG_INFO, "VPP stats segment went away, reconnecting");
+		vpp_unmap();
+		
+		/* Frozen counters would read as idle anyway, don't wait for the EWMA */
+		for (i = 0; i < num_ports; i++) {
+			if (ports[i].vpp_interface[0])
+				rate_stop(&ports[i]);
+		}
+		return;
+	}
+	
+	hdr = (const struct vpp_stats_header *)vpp_segment;
+	for (attempt = 0; attempt < VPP_READ_ATTEMPTS; attempt++) {
+		epoch = __atomic_load_n(&hdr->epoch, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hdr->in_progress, __ATOMIC_ACQUIRE)) {
+			vpp_sample_retries++;
+			continue;
+		}
+		
+		if (epoch != vpp_dir_epoch && vpp_resolve(hdr) < 0) {
+			vpp_dir_epoch = UINT64_MAX;
+			vpp_sample_retries++;
+			continue;
+		}
+		
+		for (i = 0; i < num_ports; i++) {
+			vpp_scratch[i].valid = ports[i].vpp_sw_if_index != VPP_SW_IF_INDEX_INVALID &&
+				vpp_read_counter(vpp_rx, ports[i].vpp_sw_if_index, &rx) &&
+				vpp_read_counter(vpp_tx, ports[i].vpp_sw_if_index, &tx);
+			vpp_scratch[i].rx = rx;
+			vpp_scratch[i].tx = tx;
+		}
+		
+		/* Anything read while VPP was rebuilding vectors is discarded */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hdr->epoch, __ATOMIC_ACQUIRE) != epoch ||
+		    __atomic_load_n(&hdr->in_progress, __ATOMIC_ACQUIRE)) {
+			vpp_dir_epoch = UINT64_MAX;
+			vpp_sample_retries++;
+			continue;
+		}
+		vpp_dir_epoch = epoch;
+		
+		now = now_ns();
+		for (i = 0; i < num_ports; i++) {
+			if (vpp_scratch[i].valid && ports[i].last_carrier_state)
+				rate_sample(&ports[i], vpp_scratch[i].rx.bytes, vpp_scratch[i].tx.bytes,
+					    vpp_scratch[i].rx.packets + vpp_scratch[i].tx.packets, now);
+		}
+		vpp_samples++;
+		return;
+	}
+}
+
+static void handle_stats_timer(int fd)
+{
+	uint64_t expirations;
+	size_t i;
+	
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+	
+	/* Judged on the previous sample, the dump below completes asynchronously */
+	for (i = 0; i < num_ports && !ports[i].rate.level; i++)
+		;
+	if (i < num_ports)
+		rate_idle_since_ms = 0;
+	else if (!rate_idle_since_ms)
+		rate_idle_since_ms = now_ms();
+	update_stats_timer();
+	
+	if (vpp_ports)
+		vpp_sample();
+	
+	/* Never more than one dump in flight, a slow one just skips a tick */
+	if (vpp_ports < num_ports && !stats_dump_pending)
+		request_link_stats();
+}
+
+/*
+ * Listen for kernel uevents. The SFP core registers a hwmon device below
+ * the sfp platform device once a module with diagnostics has been probed,
+ * and removes it again when the module goes away, which gives us insert
+ * and remove notifications that debugfs itself cannot.
+ */
+static int open_uevent(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+	
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		syslog(LOG_WARNING, "Failed to open uevent socket: %s", strerror(errno));
+		return -1;
+	}
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;  /* Kernel broadcast group */
+	
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		syslog(LOG_WARNING, "Failed to bind uevent socket: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+/*
+ * Find the port whose SFP platform device is one of the devpath components,
+ * e.g. /devices/platform/sfp-xfi0/hwmon/hwmon3. Cost depends on the path
+ * depth only, not on the number of ports.
+ */
+static struct sfp_port *find_port_by_devpath(const char *devpath)
+{
+	const char *start = devpath, *end;
+	struct sfp_port *port;
+	
+	while (*start) {
+		while (*start == '/')
+			start++;
+		end = strchrnul(start, '/');
+		
+		port = find_port_by_name(start, end - start);
+		if (port)
+			return port;
+		
+		start = end;
+	}
+	
+	return NULL;
+}
+
+static void process_uevent(int fd)
+{
+	char buf[UEVENT_BUF_SIZE];
+	ssize_t len;
+	
+	for (;;) {
+		const char *devpath = NULL;
+		struct sfp_port *port;
+		char *pos;
+		
+		len = recv(fd, buf, sizeof(buf) - 1, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				size_t i;
+				
+				syslog(LOG_WARNING, "uevent overrun, resyncing ports");
+				for (i = 0; i < num_ports; i++)
+					schedule_port_update(&ports[i]);
+				continue;
+			}
+			break;
+		}
+		if (len == 0)
+			break;
+		
+		buf[len] = '\0';
+		
+		/* Payload is "action@devpath" followed by NUL separated KEY=value pairs */
+		for (pos = buf; pos < buf + len; pos += strlen(pos) + 1) {
+			if (strncmp(pos, DEVPATH_PREFIX, DEVPATH_PREFIX_LEN) == 0) {
+				devpath = pos + DEVPATH_PREFIX_LEN;
+				break;
+			}
+		}
+		
+		if (!devpath)
+			continue;
+		
+		port = find_port_by_devpath(devpath);
+		if (!port)
+			continue;
+		
+		syslog(LOG_DEBUG, "%s: uevent %s", port->sfp_name, buf);
+		schedule_port_update(port);
+	}
+}
+
+static void daemonize(void)
+{
+	pid_t pid;
+	int fd;
+	struct rlimit rlim;
+	DIR *dir;
+	struct dirent *entry;
+
+	pid = fork();
+	if (pid < 0)
+		exit(EXIT_FAILURE);
+	
+	if (pid > 0)
+		exit(EXIT_SUCCESS);
+	
+	if (setsid() < 0)
+		exit(EXIT_FAILURE);
+	
+	pid = fork();
+	if (pid < 0)
+		exit(EXIT_FAILURE);
+	
+	if (pid > 0)
+		exit(EXIT_SUCCESS);
+	
+	umask(0);
+	
+	chdir("/");
+	
+	/*
+	 * One syscall, where looping up to RLIMIT_NOFILE could be millions.
+	 * Kernels before 5.9 get the fds that are actually open from /proc.
+	 */
+	if (syscall(SYS_close_range, 0U, ~0U, 0U) < 0) {
+		dir = opendir("/proc/self/fd");
+		if (dir) {
+			while ((entry = readdir(dir)) != NULL) {
+				fd = atoi(entry->d_name);
+				if (entry->d_name[0] != '.' && fd != dirfd(dir))
+					close(fd);
+			}
+			closedir(dir);
+		} else if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY) {
+			for (fd = 0; fd < (int)rlim.rlim_cur; fd++)
+				close(fd);
+		} else {
+			for (fd = 0; fd < 256; fd++)
+				close(fd);
+		}
+	}
+	
+	/* Redirect stdin, stdout, stderr to /dev/null */
+	fd = open("/dev/null", O_RDWR);
+	if (fd >= 0) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+}
+
+/*
+ * sd_notify() without linking libsystemd: one datagram to $NOTIFY_SOCKET.
+ * Not started by systemd, the variable isn't set and this does nothing.
+ */
+static void notify_systemd(const char *state)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *path = getenv("NOTIFY_SOCKET");
+	size_t len;
+	int fd;
+	
+	if (!path || (path[0] != '/' && path[0] != '@'))
+		return;
+	len = strlen(path);
+	if (len >= sizeof(addr.sun_path))
+		return;
+	
+	memcpy(addr.sun_path, path, len);
+	if (addr.sun_path[0] == '@')
+		addr.sun_path[0] = '\0';  /* Abstract namespace */
+	
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+	if (sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr,
+		   offsetof(struct sockaddr_un, sun_path) + len) < 0)
+		syslog(LOG_WARNING, "Failed to notify systemd: %s", strerror(errno));
+	close(fd);
+}
+
+static bool deadline_due(uint64_t deadline, uint64_t now)
+{
+	return deadline && deadline <= now;
+}
+
+static void handle_port_timer(struct sfp_port *port)
+{
+	uint64_t expirations, now;
+	
+	if (read(port->timer.fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+	
+	/* A deferred diagnostics read alone doesn't need the port re-evaluated */
+	now = now_ms();
+	if (deadline_due(port->dom_at_ms, now)) {
+		port->dom_at_ms = 0;
+		dom_request(port);
+		if (!deadline_due(port->update_at_ms, now) && !deadline_due(port->poll_at_ms, now) &&
+		    !deadline_due(port->damping_at_ms, now)) {
+			rearm_port_timer(port);
+			return;
+		}
+	}
+	
+	/* Without rtnetlink, carrier has to be polled as well */
+	if (rtnl_source.fd < 0 || port->ifindex == 0)
+		port->carrier = read_carrier_state(port->carrier_fd);
+	
+	/* Polled changes are detected right now */
+	if (!port->stats.event_ns)
+		port->stats.event_ns = now_ns();
+	
+	/* Whatever deadline fired, a single update covers all of them */
+	port->update_at_ms = 0;
+	update_port(port);
+	
+	/* Carrier may have come or gone since, which decides on polling */
+	port->poll_at_ms = port_needs_polling(port) ? now_ms() + poll_interval_ms : 0;
+	rearm_port_timer(port);
+}
+
+/* Idle means every timer is disarmed, the next wakeup can only be an event */
+static void update_idle_state(void)
+{
+	bool now_idle = stats_timer_interval_ms == 0 && !metrics_client_list;
+	size_t i;
+	
+	for (i = 0; i < num_ports && now_idle; i++) {
+		const struct sfp_port *port = &ports[i];
+		
+		if (port->update_at_ms || port->poll_at_ms || port->damping_at_ms ||
+		    port->dom_at_ms || port->dom.busy)
+			now_idle = false;
+	}
+	
+	if (now_idle == idle)
+		return;
+	
+	idle = now_idle;
+	if (idle) {
+		idle_since_ns = now_ns();
+		idle_entries++;
+	} else {
+		idle_ns += now_ns() - idle_since_ns;
+	}
+	syslog(LOG_DEBUG, "%s idle", idle ? "Entering" : "Leaving");
+}
+
+static uint64_t idle_total_ns(void)
+{
+	return idle_ns + (idle ? now_ns() - idle_since_ns : 0);
+}
+
+static void write_stats(FILE *f)
+{
+	uint64_t now = now_ns();
+	size_t i;
+	
+	fprintf(f, "uptime_s %llu\n", (unsigned long long)((now - start_ns) / 1000000000ULL));
+	fprintf(f, "loop_wakeups %llu\n", (unsigned long long)loop_wakeups);
+	fprintf(f, "loop_events %llu\n", (unsigned long long)loop_events);
+	fprintf(f, "idle %d\n", idle);
+	fprintf(f, "idle_s %llu\n", (unsigned long long)(idle_total_ns() / 1000000000ULL));
+	fprintf(f, "idle_entries %llu\n", (unsigned long long)idle_entries);
+	if (activity_mode == ACTIVITY_RATE) {
+		fprintf(f, "stats_dumps %llu\n", (unsigned long long)stats_dumps);
+		fprintf(f, "stats_dump_errors %llu\n", (unsigned long long)stats_dump_errors);
+	}
+	if (vpp_ports) {
+		fprintf(f, "vpp_connected %d\n", vpp_segment != NULL);
+		fprintf(f, "vpp_samples %llu\n", (unsigned long long)vpp_samples);
+		fprintf(f, "vpp_sample_retries %llu\n", (unsigned long long)vpp_sample_retries);
+	}
+	
+	for (i = 0; i < num_ports; i++) {
+		const struct sfp_port *port = &ports[i];
+		const struct port_stats *st = &port->stats;
+		const struct latency_histogram *h = &st->latency;
+		const struct flap_damping *d = &port->damping;
+		
+		fprintf(f, "port %s netdev=%s module=%d signal=%d carrier=%d "
+			"events=%llu updates=%llu state_reads=%llu state_read_errors=%llu "
+			"led_changes=%llu led_writes=%llu led_write_errors=%llu "
+			"transitions=%llu suppressions=%llu coalesced=%llu penalty=%.0f suppressed=%d "
+			"latency_count=%llu latency_min_us=%llu latency_avg_us=%llu "
+			"latency_p50_us=%llu latency_p90_us=%llu latency_p99_us=%llu latency_max_us=%llu\n",
+			port->sfp_name, port->netdev[0] ? port->netdev : "-",
+			port->last_module_present, port->last_carrier_state, port->carrier,
+			(unsigned long long)st->events, (unsigned long long)st->updates,
+			(unsigned long long)st->state_reads, (unsigned long long)st->state_read_errors,
+			(unsigned long long)st->led_changes,
+			(unsigned long long)(port->link_led.writes + port->activity_led.writes),
+			(unsigned long long)(port->link_led.write_errors + port->activity_led.write_errors),
+			(unsigned long long)d->transitions, (unsigned long long)d->suppressions,
+			(unsigned long long)d->coalesced_transitions, d->penalty, d->suppressed,
+			(unsigned long long)h->count, (unsigned long long)h->min_us,
+			(unsigned long long)(h->count ? h->sum_us / h->count : 0),
+			(unsigned long long)hist_percentile(h, 50), (unsigned long long)hist_percentile(h, 90),
+			(unsigned long long)hist_percentile(h, 99), (unsigned long long)h->max_us);
+		
+		if (activity_mode == ACTIVITY_RATE) {
+			fprintf(f, "rate %s source=%s rx_bytes_per_s=%.0f tx_bytes_per_s=%.0f packets_per_s=%.0f "
+				"speed_mbps=%u level=%u\n",
+				port->sfp_name, port->vpp_interface[0] ? port->vpp_interface : "kernel",
+				port->rate.rx_bytes_per_s, port->rate.tx_bytes_per_s,
+				port->rate.packets_per_s, port->rate.speed_mbps, port->rate.level);
+		}
+		
+		if (port->dom.reading.valid) {
+			const struct dom_reading *r = &port->dom.reading;
+			
+			fprintf(f, "dom %s temp_c=%.1f vcc_v=%.3f tx_bias_ma=%.2f tx_dbm=%.2f rx_dbm=%.2f "
+				"age_s=%llu rx_low=%d reads=%llu read_errors=%llu read_p99_us=%llu\n",
+				port->sfp_name, r->temp_c, r->vcc_v, r->tx_bias_ma,
+				mw_to_dbm(r->tx_power_mw), mw_to_dbm(r->rx_power_mw),
+				(unsigned long long)((now / 1000000 - port->dom.read_at_ms) / 1000),
+				port->dom.rx_low, (unsigned long long)port->dom.reads,
+				(unsigned long long)port->dom.read_errors,
+				(unsigned long long)hist_percentile(&port->dom.read_time, 99));
+		}
+	}
+}
+
+/* Log the statistics and publish them atomically under /run */
+static void dump_stats(void)
+{
+	char *buf = NULL, *line, *saveptr;
+	char tmp_path[PATH_MAX + 4];
+	size_t size = 0;
+	FILE *f;
+	
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return;
+	write_stats(f);
+	fclose(f);
+	
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", stats_path);
+	f = fopen(tmp_path, "we");
+	if (f) {
+		fwrite(buf, 1, size, f);
+		if (fclose(f) == 0 && rename(tmp_path, stats_path) == 0)
+			syslog(LOG_INFO, "Statistics written to %s", stats_path);
+	} else {
+		syslog(LOG_WARNING, "Failed to write %s: %s", tmp_path, strerror(errno));
+	}
+	
+	for (line = strtok_r(buf, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr))
+		syslog(LOG_INFO, "stats: %s", line);
+	
+	free(buf);
+}
+
+static void metrics_summary(FILE *f, const char *name, const char *labels,
+			    const struct latency_histogram *h)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 1.0 };
+	size_t i;
+	
+	for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+		fprintf(f, "%s{%s%squantile=\"%g\"} %.6f\n", name, labels, labels[0] ? "," : "",
+			quantiles[i], hist_percentile(h, quantiles[i] * 100) / 1e6);
+	}
+	fprintf(f, "%s_sum%s%s%s %.6f\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+		h->sum_us / 1e6);
+	fprintf(f, "%s_count%s%s%s %llu\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+		(unsigned long long)h->count);
+}
+
+#define METRIC_HEADER(f, name, type, help) \
+	fprintf(f, "# TYPE " name " " type "\n# HELP " name " " help "\n")
+
+/* printf spells these nan and inf, OpenMetrics wants NaN, +Inf and -Inf */
+static const char *metric_double(char *buf, size_t size, int precision, double value)
+{
+	if (isnan(value))
+		return "NaN";
+	if (isinf(value))
+		return value > 0 ? "+Inf" : "-Inf";
+	snprintf(buf, size, "%.*f", precision, value);
+	return buf;
+}
+
+#define METRIC_DOUBLE(precision, value) metric_double((char[32]){ 0 }, 32, precision, value)
+
+/* Per-port metric family, value is an expression of port */
+#define PORT_METRIC(f, name, suffix, type, help, fmt, expr) do { \
+	size_t _i; \
+	METRIC_HEADER(f, name, type, help); \
+	for (_i = 0; _i < num_ports; _i++) { \
+		const struct sfp_port *port = &ports[_i]; \
+		fprintf(f, name suffix "{port=\"%s\",netdev=\"%s\"} " fmt "\n", \
+			port->sfp_name, port->netdev, expr); \
+	} \
+} while (0)
+
+/* Rendered purely from in-memory state, a scrape never touches sysfs */
+static void write_metrics(FILE *f)
+{
+	char labels[MAX_NODE_NAME + MAX_NETDEV_NAME + 32];
+	size_t i;
+	
+	PORT_METRIC(f, "sfp_module_present", "", "gauge", "SFP module inserted (moddef0)",
+		    "%d", port->sfp.moddef0);
+	PORT_METRIC(f, "sfp_rx_los", "", "gauge", "Receiver loss of signal",
+		    "%d", port->sfp.rx_los);
+	PORT_METRIC(f, "sfp_tx_fault", "", "gauge", "Transmitter fault",
+		    "%d", port->sfp.tx_fault);
+	PORT_METRIC(f, "sfp_tx_disable", "", "gauge", "Transmitter disabled",
+		    "%d", port->sfp.tx_disable);
+	PORT_METRIC(f, "sfp_carrier", "", "gauge", "Netdev carrier (IFF_LOWER_UP)",
+		    "%d", port->carrier);
+	PORT_METRIC(f, "sfp_link_up", "", "gauge", "Module present with optical signal",
+		    "%d", port->last_carrier_state);
+	PORT_METRIC(f, "sfp_link_transitions", "_total", "counter", "Module and optical link transitions",
+		    "%llu", (unsigned long long)port->damping.transitions);
+	PORT_METRIC(f, "sfp_flap_suppressed", "", "gauge", "LED updates currently rate limited by flap damping",
+		    "%d", port->damping.suppressed);
+	PORT_METRIC(f, "sfp_flap_penalty", "", "gauge", "Flap damping penalty as of the last update",
+		    "%.0f", port->damping.penalty);
+	PORT_METRIC(f, "sfp_flap_suppressions", "_total", "counter", "Times flap damping started suppressing",
+		    "%llu", (unsigned long long)port->damping.suppressions);
+	PORT_METRIC(f, "sfp_flap_coalesced_transitions", "_total", "counter", "Transitions coalesced while suppressed",
+		    "%llu", (unsigned long long)port->damping.coalesced_transitions);
+	PORT_METRIC(f, "sfp_events", "_total", "counter", "Port events from rtnetlink, uevent and signals",
+		    "%llu", (unsigned long long)port->stats.events);
+	PORT_METRIC(f, "sfp_state_reads", "_total", "counter", "debugfs state reads",
+		    "%llu", (unsigned long long)port->stats.state_reads);
+	PORT_METRIC(f, "sfp_dom_temperature_celsius", "", "gauge", "Module temperature",
+		    "%s", METRIC_DOUBLE(2, port->dom.reading.valid ? port->dom.reading.temp_c : NAN));
+	PORT_METRIC(f, "sfp_dom_supply_volts", "", "gauge", "Module supply voltage",
+		    "%s", METRIC_DOUBLE(4, port->dom.reading.valid ? port->dom.reading.vcc_v : NAN));
+	PORT_METRIC(f, "sfp_dom_tx_bias_amperes", "", "gauge", "Laser bias current",
+		    "%s", METRIC_DOUBLE(6, port->dom.reading.valid ? port->dom.reading.tx_bias_ma / 1000 : NAN));
+	PORT_METRIC(f, "sfp_dom_tx_power_dbm", "", "gauge", "Transmitted optical power",
+		    "%s", METRIC_DOUBLE(2, port->dom.reading.valid ? mw_to_dbm(port->dom.reading.tx_power_mw) : NAN));
+	PORT_METRIC(f, "sfp_dom_rx_power_dbm", "", "gauge", "Received optical power",
+		    "%s", METRIC_DOUBLE(2, port->dom.reading.valid ? mw_to_dbm(port->dom.reading.rx_power_mw) : NAN));
+	PORT_METRIC(f, "sfp_dom_rx_low", "", "gauge", "RX power below the LED policy threshold",
+		    "%d", port->dom.rx_low);
+	PORT_METRIC(f, "sfp_dom_age_seconds", "", "gauge", "Time since the cached diagnostics were read",
+		    "%s", METRIC_DOUBLE(3, port->dom.reading.valid ? (now_ms() - port->dom.read_at_ms) / 1e3 : NAN));
+	PORT_METRIC(f, "sfp_dom_reads", "_total", "counter", "Module diagnostics reads",
+		    "%llu", (unsigned long long)port->dom.reads);
+	PORT_METRIC(f, "sfp_dom_read_errors", "_total", "counter", "Failed module diagnostics reads",
+		    "%llu", (unsigned long long)port->dom.read_errors);
+	if (activity_mode == ACTIVITY_RATE) {
+		PORT_METRIC(f, "sfp_rx_bytes_per_second", "", "gauge", "Smoothed receive rate from RTM_GETSTATS",
+			    "%.0f", port->rate.rx_bytes_per_s);
+		PORT_METRIC(f, "sfp_tx_bytes_per_second", "", "gauge", "Smoothed transmit rate from RTM_GETSTATS",
+			    "%.0f", port->rate.tx_bytes_per_s);
+		PORT_METRIC(f, "sfp_packets_per_second", "", "gauge", "Smoothed packet rate, both directions",
+			    "%.0f", port->rate.packets_per_s);
+		PORT_METRIC(f, "sfp_activity_level", "", "gauge", "Activity LED blink level, 0 when idle",
+			    "%u", port->rate.level);
+	}
+	PORT_METRIC(f, "sfp_led_writes", "_total", "counter", "LED sysfs attribute writes and batched channel updates",
+		    "%llu", (unsigned long long)(port->link_led.writes + port->activity_led.writes));
+	PORT_METRIC(f, "sfp_led_write_errors", "_total", "counter", "Failed LED writes",
+		    "%llu", (unsigned long long)(port->link_led.write_errors + port->activity_led.write_errors));
+	
+	METRIC_HEADER(f, "sfp_event_to_led_seconds", "summary", "Latency from event detection to LED write completion");
+	for (i = 0; i < num_ports; i++) {
+		snprintf(labels, sizeof(labels), "port=\"%s\",netdev=\"%s\"", ports[i].sfp_name, ports[i].netdev);
+		metrics_summary(f, "sfp_event_to_led_seconds", labels, &ports[i].stats.latency);
+	}
+	
+	METRIC_HEADER(f, "sfp_dom_read_seconds", "summary", "Duration of one module diagnostics read");
+	for (i = 0; i < num_ports; i++) {
+		snprintf(labels, sizeof(labels), "port=\"%s\",netdev=\"%s\"", ports[i].sfp_name, ports[i].netdev);
+		metrics_summary(f, "sfp_dom_read_seconds", labels, &ports[i].dom.read_time);
+	}
+	
+	METRIC_HEADER(f, "sfp_daemon_loop_wakeups", "counter", "Event loop wakeups");
+	fprintf(f, "sfp_daemon_loop_wakeups_total %llu\n", (unsigned long long)loop_wakeups);
+	METRIC_HEADER(f, "sfp_daemon_loop_events", "counter", "Events dispatched by the event loop");
+	fprintf(f, "sfp_daemon_loop_events_total %llu\n", (unsigned long long)loop_events);
+	METRIC_HEADER(f, "sfp_daemon_idle", "gauge", "No timers armed, waiting for events only");
+	fprintf(f, "sfp_daemon_idle %d\n", idle);
+	METRIC_HEADER(f, "sfp_daemon_idle_seconds", "counter", "Time spent idle");
+	fprintf(f, "sfp_daemon_idle_seconds_total %.3f\n", idle_total_ns() / 1e9);
+	METRIC_HEADER(f, "sfp_daemon_loop_dispatch_seconds", "summary", "Time spent handling one event loop wakeup");
+	metrics_summary(f, "sfp_daemon_loop_dispatch_seconds", "", &loop_dispatch);
+	if (activity_mode == ACTIVITY_RATE) {
+		METRIC_HEADER(f, "sfp_daemon_stats_dumps", "counter", "RTM_GETSTATS dumps requested");
+		fprintf(f, "sfp_daemon_stats_dumps_total %llu\n", (unsigned long long)stats_dumps);
+		METRIC_HEADER(f, "sfp_daemon_stats_dump_errors", "counter", "Failed or overrun RTM_GETSTATS dumps");
+		fprintf(f, "sfp_daemon_stats_dump_errors_total %llu\n", (unsigned long long)stats_dump_errors);
+	}
+	if (vpp_ports) {
+		METRIC_HEADER(f, "sfp_daemon_vpp_connected", "gauge", "VPP stats segment mapped");
+		fprintf(f, "sfp_daemon_vpp_connected %d\n", vpp_segment != NULL);
+		METRIC_HEADER(f, "sfp_daemon_vpp_samples", "counter", "Consistent reads of the VPP stats segment");
+		fprintf(f, "sfp_daemon_vpp_samples_total %llu\n", (unsigned long long)vpp_samples);
+		METRIC_HEADER(f, "sfp_daemon_vpp_sample_retries", "counter", "VPP stats reads discarded because VPP was writing");
+		fprintf(f, "sfp_daemon_vpp_sample_retries_total %llu\n", (unsigned long long)vpp_sample_retries);
+	}
+	METRIC_HEADER(f, "sfp_daemon_uptime_seconds", "gauge", "Time since daemon start");
+	fprintf(f, "sfp_daemon_uptime_seconds %.3f\n", (now_ns() - start_ns) / 1e9);
+	fprintf(f, "# EOF\n");
+}
+
+static int open_metrics_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+	
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		syslog(LOG_WARNING, "Metrics socket path too long: %s", path);
+		return -1;
+	}
+	
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		syslog(LOG_WARNING, "Failed to create metrics socket: %s", strerror(errno));
+		return -1;
+	}
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, METRICS_MAX_CLIENTS) < 0) {
+		syslog(LOG_WARNING, "Failed to listen on %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+/* Only ever bound to localhost, the exporter has no access control */
+static int open_metrics_tcp(unsigned int port)
+{
+	struct sockaddr_in addr;
+	int fd, one = 1;
+	
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		syslog(LOG_WARNING, "Failed to create metrics TCP socket: %s", strerror(errno));
+		return -1;
+	}
+	
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, METRICS_MAX_CLIENTS) < 0) {
+		syslog(LOG_WARNING, "Failed to listen on 127.0.0.1:%u: %s", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+/* One timer for all clients, armed for the earliest deadline */
+static void rearm_metrics_timer(void)
+{
+	struct itimerspec its;
+	struct metrics_client *client;
+	uint64_t deadline = 0;
+	
+	if (metrics_timer.fd < 0)
+		return;
+	
+	for (client = metrics_client_list; client; client = client->next)
+		deadline = earliest_deadline(deadline, client->deadline_ms);
+	
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / 1000;
+	its.it_value.tv_nsec = (deadline % 1000) * 1000000L;
+	
+	if (timerfd_settime(metrics_timer.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		syslog(LOG_WARNING, "Failed to arm metrics timer: %s", strerror(errno));
+}
+
+static void metrics_client_close(struct metrics_client *client)
+{
+	struct metrics_client **link;
+	
+	for (link = &metrics_client_list; *link; link = &(*link)->next) {
+		if (*link == client) {
+			*link = client->next;
+			break;
+		}
+	}
+	
+	close(client->src.fd);
+	free(client->response);
+	free(client);
+	metrics_clients--;
+}
+
+static void metrics_client_respond(struct metrics_client *client)
+{
+	char *body = NULL;
+	size_t body_len = 0;
+	struct epoll_event ev;
+	FILE *f;
+	
+	dom_refresh_stale();
+	
+	f = open_memstream(&body, &body_len);
+	if (!f) {
+		metrics_client_close(client);
+		return;
+	}
+	write_metrics(f);
+	fclose(f);
+	
+	if (client->http) {
+		f = open_memstream(&client->response, &client->response_len);
+		if (!f) {
+			free(body);
+			metrics_client_close(client);
+			return;
+		}
+		fprintf(f, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", body_len);
+		fwrite(body, 1, body_len, f);
+		fclose(f);
+		free(body);
+	} else {
+		client->response = body;
+		client->response_len = body_len;
+	}
+	
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.ptr = &client->src;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->src.fd, &ev) < 0)
+		metrics_client_close(client);
+}
+
+static void metrics_accept(struct event_source *listener)
+{
+	struct metrics_client *client;
+	int fd;
+	
+	while ((fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (metrics_clients >= METRICS_MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		
+		client = calloc(1, sizeof(*client));
+		if (!client) {
+			close(fd);
+			continue;
+		}
+		client->src.type = EVENT_METRICS_CLIENT;
+		client->src.fd = fd;
+		client->src.client = client;
+		client->http = listener == &metrics_tcp_source;
+		client->deadline_ms = now_ms() + METRICS_CLIENT_TIMEOUT_MSEC;
+		client->next = metrics_client_list;
+		metrics_client_list = client;
+		metrics_clients++;
+		
+		if (epoll_add_source(&client->src) < 0) {
+			metrics_client_close(client);
+			continue;
+		}
+		
+		/* Plain unix socket readers get the metrics right away */
+		if (!client->http)
+			metrics_client_respond(client);
+	}
+	
+	rearm_metrics_timer();
+}
+
+/*
+ * The same epoll batch may still hold events for the clients that expired,
+ * so they are only closed once the batch is done, see expire_metrics_clients().
+ */
+static void handle_metrics_timer(int fd)
+{
+	uint64_t expirations;
+	
+	if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+		metrics_expired = true;
+}
+
+/* Clients that never send a request, or never read the response, give up their slot */
+static void expire_metrics_clients(void)
+{
+	struct metrics_client *client, *next;
+	uint64_t now;
+	
+	if (!metrics_expired)
+		return;
+	metrics_expired = false;
+	
+	now = now_ms();
+	for (client = metrics_client_list; client; client = next) {
+		next = client->next;
+		if (deadline_due(client->deadline_ms, now))
+			metrics_client_close(client);
+	}
+	
+	rearm_metrics_timer();
+}
+
+static void metrics_client_event(struct metrics_client *client)
+{
+	ssize_t len;
+	
+	if (client->response) {
+		len = send(client->src.fd, client->response + client->response_off,
+			   client->response_len - client->response_off, MSG_NOSIGNAL);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (len < 0) {
+			metrics_client_close(client);
+			return;
+		}
+		client->response_off += len;
+		if (client->response_off >= client->response_len)
+			metrics_client_close(client);
+		return;
+	}
+	
+	len = recv(client->src.fd, client->request + client->request_len,
+		   sizeof(client->request) - 1 - client->request_len, 0);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		metrics_client_close(client);
+		return;
+	}
+	client->request_len += len;
+	client->request[client->request_len] = '\0';
+	
+	/* Any request gets the metrics, answer once the headers are complete */
+	if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n") ||
+	    client->request_len >= sizeof(client->request) - 1)
+		metrics_client_respond(client);
+}
+
+static void start_traffic_sampling(void)
+{
+	if (stats_timer.fd >= 0)
+		return;
+	
+	stats_source.fd = open_stats_netlink();
+	stats_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (stats_source.fd < 0 || stats_timer.fd < 0 ||
+	    epoll_add_source(&stats_source) < 0 || epoll_add_source(&stats_timer) < 0) {
+		syslog(LOG_WARNING, "Traffic sampling unavailable, using the netdev activity trigger");
+		close_fd(&stats_source.fd);
+		close_fd(&stats_timer.fd);
+		activity_mode = ACTIVITY_NETDEV;
+	}
+}
+
+static void stop_traffic_sampling(void)
+{
+	close_fd(&stats_source.fd);
+	close_fd(&stats_timer.fd);
+	stats_timer_interval_ms = 0;
+	stats_dump_pending = false;
+	close_fd(&vpp_source.fd);
+	vpp_unmap();
+}
+
+static void update_vpp_ports(void)
+{
+	size_t i;
+	
+	vpp_ports = 0;
+	for (i = 0; i < num_ports; i++) {
+		if (ports[i].vpp_interface[0])
+			vpp_ports++;
+	}
+	vpp_dir_epoch = UINT64_MAX;
+	
+	if (vpp_ports && !vpp_scratch) {
+		vpp_scratch = calloc(num_ports, sizeof(*vpp_scratch));
+		if (!vpp_scratch) {
+			syslog(LOG_ERR, "Failed to allocate VPP sample buffer");
+			vpp_ports = 0;
+		}
+	}
+}
+
+static void config_defaults(struct daemon_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->poll_interval_ms = POLL_INTERVAL_MSEC;
+	cfg->damping.enabled = true;
+	cfg->damping.penalty = DAMPING_PENALTY;
+	cfg->damping.suppress = DAMPING_SUPPRESS;
+	cfg->damping.reuse = DAMPING_REUSE;
+	cfg->damping.max_penalty = DAMPING_MAX_PENALTY;
+	cfg->damping.half_life_ms = DAMPING_HALF_LIFE_MSEC;
+	cfg->damping.hold_ms = DAMPING_HOLD_MSEC;
+	cfg->activity_mode = ACTIVITY_NETDEV;
+	cfg->rate_sample_ms = RATE_SAMPLE_MSEC;
+	cfg->dom_interval_ms = DOM_INTERVAL_MSEC;
+}
+
+/* Settings for a cage or netdev, merged with an earlier section of the same name */
+static struct port_config *config_add_port(struct daemon_config *cfg, const char *name)
+{
+	struct port_config *grown;
+	size_t i;
+	
+	if (!name[0] || strlen(name) >= sizeof(cfg->ports->name))
+		return NULL;
+	
+	for (i = 0; i < cfg->num_ports; i++) {
+		if (strcmp(cfg->ports[i].name, name) == 0)
+			return &cfg->ports[i];
+	}
+	
+	grown = realloc(cfg->ports, (cfg->num_ports + 1) * sizeof(*grown));
+	if (!grown)
+		return NULL;
+	cfg->ports = grown;
+	
+	grown = &cfg->ports[cfg->num_ports++];
+	memset(grown, 0, sizeof(*grown));
+	strcpy(grown->name, name);
+	grown->damping = cfg->damping;
+	return grown;
+}
+
+static int parse_damping(const char *arg, struct damping_config *cfg)
+{
+	unsigned int penalty, suppress, reuse, half_life, hold = cfg->hold_ms;
+	int n;
+	
+	if (strcmp(arg, "off") == 0) {
+		cfg->enabled = false;
+		return 0;
+	}
+	
+	n = sscanf(arg, "%u,%u,%u,%u,%u", &penalty, &suppress, &reuse, &half_life, &hold);
+	if (n < 4 || reuse >= suppress || half_life == 0 || penalty == 0)
+		return -1;
+	
+	cfg->enabled = true;
+	cfg->penalty = penalty;
+	cfg->suppress = suppress;
+	cfg->reuse = reuse;
+	cfg->half_life_ms = half_life;
+	cfg->hold_ms = hold;
+	if (cfg->max_penalty < suppress)
+		cfg->max_penalty = suppress * 4;
+	
+	return 0;
+}
+
+static int parse_msec(const char *value, unsigned int *out)
+{
+	unsigned long v;
+	char *end;
+	
+	errno = 0;
+	v = strtoul(value, &end, 10);
+	if (errno || end == value || *end || v == 0 || v > UINT_MAX)
+		return -1;
+	
+	*out = v;
+	return 0;
+}
+
+static int copy_setting(char *dst, size_t size, const char *value)
+{
+	if (!value[0] || strlen(value) >= size)
+		return -1;
+	strcpy(dst, value);
+	return 0;
+}
+
+/*
+ * Apply one setting, from the config file or the command line. Port
+ * settings need a port. Returns -1 for an invalid value and -2 for an
+ * unknown key.
+ */
+static int config_set(struct daemon_config *cfg, struct port_config *port, const char *key, const char *value)
+{
+	char *end;
+	
+	if (port) {
+		if (strcmp(key, "link-led") == 0)
+			return copy_setting(port->link_led, sizeof(port->link_led), value);
+		if (strcmp(key, "activity-led") == 0)
+			return copy_setting(port->activity_led, sizeof(port->activity_led), value);
+		if (strcmp(key, "netdev") == 0)
+			return copy_setting(port->netdev, sizeof(port->netdev), value);
+		if (strcmp(key, "vpp-interface") == 0)
+			return copy_setting(port->vpp_interface, sizeof(port->vpp_interface), value);
+		if (strcmp(key, "damping") == 0) {
+			port->damping_set = true;
+			return parse_damping(value, &port->damping);
+		}
+		return -2;
+	}
 	
-	if (bytes_read != sizeof(val)) {
+	if (strcmp(key, "poll-interval-ms") == 0)
+		return parse_msec(value, &cfg->poll_interval_ms);
+	if (strcmp(key, "damping") == 0)
+		return parse_damping(value, &cfg->damping);
+	if (strcmp(key, "dom-interval-ms") == 0)
+		return parse_msec(value, &cfg->dom_interval_ms);
+	if (strcmp(key, "rate-sample-ms") == 0)
+		return parse_msec(value, &cfg->rate_sample_ms);
+	if (strcmp(key, "activity-mode") == 0) {
+		if (strcmp(value, "rate") == 0)
+			cfg->activity_mode = ACTIVITY_RATE;
+		else if (strcmp(value, "netdev") == 0)
+			cfg->activity_mode = ACTIVITY_NETDEV;
+		else
+			return -1;
+		return 0;
+	}
+	if (strcmp(key, "rx-low-dbm") == 0) {
+		if (strcmp(value, "off") == 0) {
+			cfg->rx_low_enabled = false;
+			return 0;
+		}
+		cfg->rx_low_dbm = strtod(value, &end);
+		if (end == value || *end)
+			return -1;
+		cfg->rx_low_enabled = true;
 		return 0;
 	}
+	return -2;
+}
+
+static char *trim(char *s)
+{
+	char *end;
 	
-	return __builtin_bswap32(val);  /* Convert from big-endian */
+	while (*s == ' ' || *s == '\t')
+		s++;
+	end = s + strlen(s);
+	while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r'))
+		end--;
+	*end = '\0';
+	return s;
 }
 
 /*
- * Find the network device associated with an SFP port by reading device tree
- * 
- * Process:
- * 1. Read the phandle of the SFP device from /sys/firmware/devicetree/base/sfp-xfiX/phandle
- * 2. Search through /sys/firmware/devicetree/base/soc/fman nodes for matching sfp property
- * 3. Read the cell-index from the matching ethernet node
- * 4. The netdev is fm1-mac with cell-index plus 1
+ * "key = value" lines, '#' comments. Global settings come first, then
+ * [name] sections with the settings of one cage, where name is the
+ * device tree node of the cage or its netdev. Bad lines are logged and
+ * skipped, only an unreadable file fails the load.
  */
-static int find_netdev_for_sfp(const char *sfp_name, char *netdev_out, size_t out_size)
+static int config_load(const char *path, bool required, struct daemon_config *cfg)
 {
-	char path[PATH_MAX];
-	uint32_t sfp_phandle;
-	DIR *dir;
-	struct dirent *entry;
-	
-	/* Read the phandle of our SFP device */
-	snprintf(path, sizeof(path), "/sys/firmware/devicetree/base/%s/phandle", sfp_name);
-	sfp_phandle = read_dt_u32(path);
-	if (sfp_phandle == 0) {
-		syslog(LOG_ERR, "Failed to read phandle for %s", sfp_name);
-		return -1;
-	}
-	
-	syslog(LOG_DEBUG, "%s phandle: 0x%x", sfp_name, sfp_phandle);
+	char line[CONFIG_LINE_MAX];
+	struct port_config *port = NULL;
+	bool skip = false;
+	unsigned int lineno = 0;
+	char *key, *value, *p;
+	FILE *f;
+	int ret;
 	
-	/* Search through fman ethernet nodes */
-	dir = opendir("/sys/firmware/devicetree/base/soc");
-	if (!dir) {
-		syslog(LOG_ERR, "Failed to open device tree soc directory");
+	f = fopen(path, "re");
+	if (!f) {
+		if (errno == ENOENT && !required)
+			return 0;
+		syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
 		return -1;
 	}
 	
-	while ((entry = readdir(dir)) != NULL) {
-		if (strncmp(entry->d_name, FMAN_PREFIX, FMAN_PREFIX_LEN) != 0)
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		key = trim(line);
+		if (!key[0])
 			continue;
 		
-		/* Found an fman node, search its ethernet children */
-		DIR *fman_dir;
-		struct dirent *eth_entry;
-		char fman_path[PATH_MAX];
-		
-		snprintf(fman_path, sizeof(fman_path), "/sys/firmware/devicetree/base/soc/%s", entry->d_name);
-		fman_dir = opendir(fman_path);
-		if (!fman_dir)
+		if (key[0] == '[') {
+			p = strchr(key, ']');
+			if (p && p[1] == '\0') {
+				*p = '\0';
+				port = config_add_port(cfg, trim(key + 1));
+			}
+			skip = !port;
+			if (skip)
+				syslog(LOG_WARNING, "%s:%u: invalid section, skipping it", path, lineno);
+			continue;
+		}
+		if (skip)
 			continue;
 		
-		while ((eth_entry = readdir(fman_dir)) != NULL) {
-			if (strncmp(eth_entry->d_name, ETHERNET_PREFIX, ETHERNET_PREFIX_LEN) != 0)
-				continue;
-			
-			/* Check if this ethernet node has an sfp property */
-			snprintf(path, sizeof(path), "%s/%s/sfp", fman_path, eth_entry->d_name);
-			uint32_t eth_sfp_phandle = read_dt_u32(path);
-			
-			if (eth_sfp_phandle == sfp_phandle) {
-				/* Found matching ethernet node! Read its cell-index */
-				uint32_t cell_index;
-				
-				snprintf(path, sizeof(path), "%s/%s/cell-index", fman_path, eth_entry->d_name);
-				cell_index = read_dt_u32(path);
-				
-				/* Validate cell_index to prevent overflow and ensure reasonable value */
-				if (cell_index > 1000) {
-					syslog(LOG_WARNING, "Invalid cell-index %u for SFP '%s', skipping", 
-					       cell_index, sfp_name);
-					continue;
-				}
-				
-				snprintf(netdev_out, out_size, "fm1-mac%u", cell_index + 1);
-				
-				closedir(fman_dir);
-				closedir(dir);
-				
-				syslog(LOG_INFO, "Found netdev '%s' for SFP '%s' (cell-index=%u)", 
-				       netdev_out, sfp_name, cell_index);
-				return 0;
-			}
+		p = strchr(key, '=');
+		if (!p) {
+			syslog(LOG_WARNING, "%s:%u: expected key = value", path, lineno);
+			continue;
 		}
+		*p = '\0';
+		value = trim(p + 1);
+		key = trim(key);
 		
-		closedir(fman_dir);
+		ret = config_set(cfg, port, key, value);
+		if (ret == -2)
+			syslog(LOG_WARNING, "%s:%u: unknown %ssetting '%s'", path, lineno, port ? "port " : "", key);
+		else if (ret < 0)
+			syslog(LOG_WARNING, "%s:%u: invalid value '%s' for %s", path, lineno, value, key);
 	}
 	
-	closedir(dir);
-	syslog(LOG_ERR, "Could not find ethernet node for SFP '%s' (phandle 0x%x)", sfp_name, sfp_phandle);
-	return -1;
+	fclose(f);
+	return 0;
 }
 
-static int setup_port(struct sfp_port *port)
+/*
+ * Command line options. Startup-only ones go to opts, tunables go through
+ * config_set() like config file entries. Runs again after every config
+ * load, with opts NULL, so the command line keeps overriding the file.
+ */
+static int parse_args(int argc, char *argv[], struct daemon_config *cfg, struct options *opts)
 {
-	char path[PATH_MAX];
-	int ret;
+	struct port_config *port;
+	const char *key;
+	bool no_damping = false;
+	char *eq;
+	int c;
 	
-	/* Discover the network device name for this SFP from device tree */
-	if (find_netdev_for_sfp(port->sfp_name, port->netdev, sizeof(port->netdev)) < 0) {
-		syslog(LOG_ERR, "Failed to find network device for %s", port->sfp_name);
-		return -1;
+	optind = 0;
+	opterr = opts != NULL;
+	while ((c = getopt(argc, argv, "fnd:r:i:m:t:l:D:a:s:V:M:c:")) != -1) {
+		key = NULL;
+		switch (c) {
+		case 'f':
+			if (opts)
+				opts->foreground = true;
+			break;
+		case 'r':
+			if (!opts)
+				break;
+			/* Resolved now, daemonize() changes to / */
+			root_dir = realpath(optarg, NULL);
+			if (!root_dir) {
+				fprintf(stderr, "Invalid root '%s': %s\n", optarg, strerror(errno));
+				return -1;
+			}
+			if (strcmp(root_dir, "/") == 0)
+				root_dir = DEFAULT_ROOT;
+			break;
+		case 'm':
+			if (opts)
+				opts->metrics_socket = optarg;
+			break;
+		case 't':
+			metrics_tcp_port = strtoul(optarg, NULL, 10);
+			if (metrics_tcp_port == 0 || metrics_tcp_port > 65535)
+				return -1;
+			break;
+		case 'V':
+			if (opts)
+				opts->vpp_socket = optarg;
+			break;
+		case 'c':
+			if (opts) {
+				opts->config_file = optarg;
+				opts->config_required = true;
+			}
+			break;
+		case 'n':
+			no_damping = true;
+			break;
+		case 'd':
+			key = "damping";
+			break;
+		case 'i':
+			key = "poll-interval-ms";
+			break;
+		case 'l':
+			key = "rx-low-dbm";
+			break;
+		case 'D':
+			key = "dom-interval-ms";
+			break;
+		case 'a':
+			key = "activity-mode";
+			break;
+		case 's':
+			key = "rate-sample-ms";
+			break;
+		case 'M':
+			eq = strchr(optarg, '=');
+			if (!eq || eq == optarg || eq - optarg >= MAX_VPP_NAME ||
+			    !(port = config_add_port(cfg, eq + 1)))
+				return -1;
+			memcpy(port->vpp_interface, optarg, eq - optarg);
+			port->vpp_interface[eq - optarg] = '\0';
+			break;
+		default:
+			return -1;
+		}
+		
+		if (key && config_set(cfg, NULL, key, optarg) < 0) {
+			if (opts)
+				fprintf(stderr, "Invalid value '%s' for -%c\n", optarg, c);
+			return -1;
+		}
 	}
 	
-	/* Open carrier file */
-	ret = snprintf(path, sizeof(path), "/sys/class/net/%s/carrier", port->netdev);
-	if (ret >= sizeof(path)) {
-		syslog(LOG_ERR, "Path too long for carrier file: %s", port->netdev);
+	if (no_damping)
+		cfg->damping.enabled = false;
+	
+	return 0;
+}
+
+/* Defaults, then the config file, then the command line */
+static int load_config(struct daemon_config *cfg)
+{
+	config_defaults(cfg);
+	if (config_load(config_path, config_required, cfg) < 0 ||
+	    parse_args(saved_argc, saved_argv, cfg, NULL) < 0) {
+		free(cfg->ports);
+		cfg->ports = NULL;
 		return -1;
 	}
-	port->carrier_fd = open_file_ro(path);
+	return 0;
+}
+
+/* What the device tree says, overridden by every section naming this port */
+static void resolve_port_config(const struct daemon_config *cfg, const struct sfp_port *port,
+				struct port_config *pc)
+{
+	const struct port_config *e;
+	size_t i;
 	
-	/* Setup inotify watch on carrier file */
-	if (inotify_fd >= 0 && port->carrier_fd >= 0) {
-		/* Watch the parent directory since carrier file gets replaced */
-		ret = snprintf(path, sizeof(path), "/sys/class/net/%s", port->netdev);
-		if (ret >= sizeof(path)) {
-			syslog(LOG_ERR, "Path too long for netdev: %s", port->netdev);
-			goto cleanup;
-		}
-		port->inotify_wd = inotify_add_watch(inotify_fd, path, IN_MODIFY | IN_ATTRIB);
-		if (port->inotify_wd < 0) {
-			syslog(LOG_WARNING, "Failed to add inotify watch for %s: %s", 
-			       path, strerror(errno));
-		}
-	}
+	memset(pc, 0, sizeof(*pc));
+	memcpy(pc->name, port->sfp_name, sizeof(pc->name));
+	memcpy(pc->link_led, port->dt_link_led, sizeof(pc->link_led));
+	memcpy(pc->activity_led, port->dt_activity_led, sizeof(pc->activity_led));
+	memcpy(pc->netdev, port->dt_netdev, sizeof(pc->netdev));
+	pc->damping = cfg->damping;
 	
-	ret = snprintf(path, sizeof(path), "/sys/kernel/debug/%s/state", port->sfp_name);
-	if (ret >= sizeof(path)) {
-		syslog(LOG_ERR, "Path too long for debugfs: %s", port->sfp_name);
-		goto cleanup;
+	for (i = 0; i < cfg->num_ports; i++) {
+		e = &cfg->ports[i];
+		if (strcmp(e->name, port->sfp_name) != 0 && strcmp(e->name, port->dt_netdev) != 0)
+			continue;
+		
+		if (e->link_led[0])
+			memcpy(pc->link_led, e->link_led, sizeof(pc->link_led));
+		if (e->activity_led[0])
+			memcpy(pc->activity_led, e->activity_led, sizeof(pc->activity_led));
+		if (e->netdev[0])
+			memcpy(pc->netdev, e->netdev, sizeof(pc->netdev));
+		if (e->vpp_interface[0])
+			memcpy(pc->vpp_interface, e->vpp_interface, sizeof(pc->vpp_interface));
+		if (e->damping_set)
+			pc->damping = e->damping;
 	}
-	port->mod_present_fd = open_file_ro(path);
-	if (port->mod_present_fd < 0) {
-		syslog(LOG_WARNING, "Cannot open %s debugfs, module detection disabled", port->sfp_name);
+}
+
+static bool damping_config_equal(const struct damping_config *a, const struct damping_config *b)
+{
+	return a->enabled == b->enabled && a->penalty == b->penalty && a->suppress == b->suppress &&
+	       a->reuse == b->reuse && a->max_penalty == b->max_penalty &&
+	       a->half_life_ms == b->half_life_ms && a->hold_ms == b->hold_ms;
+}
+
+static bool port_config_equal(const struct port_config *a, const struct port_config *b)
+{
+	return strcmp(a->link_led, b->link_led) == 0 &&
+	       strcmp(a->activity_led, b->activity_led) == 0 &&
+	       strcmp(a->netdev, b->netdev) == 0 &&
+	       strcmp(a->vpp_interface, b->vpp_interface) == 0 &&
+	       damping_config_equal(&a->damping, &b->damping);
+}
+
+/* Settings only, no I/O */
+static void port_set_config(struct sfp_port *port, const struct port_config *pc)
+{
+	port->cfg = *pc;
+	memcpy(port->link_led.name, pc->link_led, sizeof(port->link_led.name));
+	memcpy(port->activity_led.name, pc->activity_led, sizeof(port->activity_led.name));
+	memcpy(port->vpp_interface, pc->vpp_interface, sizeof(port->vpp_interface));
+	port->damping.cfg = pc->damping;
+}
+
+/* The old LED is handed back dark, the new one starts from unknown state */
+static void port_replace_led(struct sfp_port *port, struct sfp_led *led, const char *name)
+{
+	syslog(LOG_INFO, "%s: LED %s replaced by %s", port->sfp_name, led->name, name);
+	
+	if (led_is_open(led)) {
+		led_set(led, LED_OFF);
+		led_apply(led, port->netdev);
+		led_flush();
 	}
+	led_close(led);
+	memcpy(led->name, name, sizeof(led->name));
+	led_open(led);
+}
+
+/*
+ * Redo only what changed. A different netdev means different sysfs files
+ * and ifindex, so that port is set up from scratch. Returns true if the
+ * ifindex table needs rebuilding.
+ */
+static bool reconfigure_port(struct sfp_port *port, const struct port_config *pc)
+{
+	struct flap_damping *d = &port->damping;
+	bool apply = false;
 	
-	/* Open link LED brightness file */
-	ret = snprintf(path, sizeof(path), "/sys/class/leds/%s/brightness", port->link_led);
-	if (ret >= sizeof(path)) {
-		syslog(LOG_ERR, "Path too long for link LED: %s", port->link_led);
-		goto cleanup;
+	if (port->timer.fd < 0 || strcmp(port->cfg.netdev, pc->netdev) != 0) {
+		syslog(LOG_INFO, "%s: setting up again with netdev %s", port->sfp_name, pc->netdev);
+		cleanup_port(port);
+		port_set_config(port, pc);
+		if (setup_port(port) < 0)
+			syslog(LOG_WARNING, "Failed to setup port %s", port->sfp_name);
+		return true;
 	}
-	port->link_led_fd = open_file_wo(path);
 	
-	/* Open activity LED brightness file */
-	ret = snprintf(path, sizeof(path), "/sys/class/leds/%s/brightness", port->activity_led);
-	if (ret >= sizeof(path)) {
-		syslog(LOG_ERR, "Path too long for activity LED: %s", port->activity_led);
-		goto cleanup;
+	if (strcmp(port->cfg.link_led, pc->link_led) != 0) {
+		port_replace_led(port, &port->link_led, pc->link_led);
+		apply = true;
+	}
+	if (strcmp(port->cfg.activity_led, pc->activity_led) != 0) {
+		port_replace_led(port, &port->activity_led, pc->activity_led);
+		apply = true;
 	}
-	port->activity_led_fd = open_file_wo(path);
 	
-	if (port->carrier_fd < 0 || port->link_led_fd < 0 || port->activity_led_fd < 0) {
-		syslog(LOG_ERR, "Failed to setup port %s", port->netdev);
-		goto cleanup;
+	if (strcmp(port->cfg.vpp_interface, pc->vpp_interface) != 0) {
+		syslog(LOG_INFO, "%s: traffic counters from %s%s", port->netdev,
+		       pc->vpp_interface[0] ? "VPP interface " : "the kernel", pc->vpp_interface);
+		memcpy(port->vpp_interface, pc->vpp_interface, sizeof(port->vpp_interface));
+		rate_link_changed(port);
+		apply = true;
 	}
 	
-	/* Read initial module presence state */
-	port->last_module_present = read_module_present(port->mod_present_fd);
-	port->last_carrier_state = false;
-	
-	set_led_brightness(port->link_led_fd, LED_OFF);
-	set_led_brightness(port->activity_led_fd, LED_OFF);
-	
-	syslog(LOG_INFO, "Setup port %s (link=%s, activity=%s, sfp=%s, module_present=%d)", 
-	       port->netdev, port->link_led, port->activity_led, port->sfp_name,
-	       port->last_module_present);
-	
-	/* Setup appropriate LED state based on module presence and carrier */
-	if (port->last_module_present) {
-		bool rx_los = read_rx_los(port->mod_present_fd);
-		if (!rx_los) {
-			/* Module present with optical signal - setup netdev trigger for activity LED */
-			setup_netdev_trigger(port);
-			set_led_brightness(port->link_led_fd, LED_MAX);
-		} else {
-			/* Module present but no optical signal - activity LED solid ON */
-			set_led_brightness(port->activity_led_fd, LED_MAX);
+	/* Penalty and suppression history carry over to the new parameters */
+	if (!damping_config_equal(&port->cfg.damping, &pc->damping)) {
+		d->cfg = pc->damping;
+		if (!d->cfg.enabled && d->suppressed) {
+			d->suppressed = false;
+			port->damping_at_ms = 0;
+			rearm_port_timer(port);
+			apply = true;
 		}
 	}
 	
-	return 0;
-
-cleanup:
-	cleanup_port(port);
-	return -1;
+	port->cfg = *pc;
+	if (apply && !d->suppressed)
+		apply_port_leds(port, port->last_module_present, port->last_carrier_state);
+	return false;
 }
 
-static void cleanup_port(struct sfp_port *port)
+/*
+ * Make a loaded config live. At startup this only sets things up for
+ * setup_port(), on reload ports whose settings didn't change are left
+ * alone entirely: same fds, trigger state and damping history.
+ */
+static void apply_config(const struct daemon_config *cfg, bool startup)
 {
-	if (inotify_fd >= 0 && port->inotify_wd >= 0) {
-		inotify_rm_watch(inotify_fd, port->inotify_wd);
-		port->inotify_wd = -1;
+	enum activity_mode mode = cfg->activity_mode;
+	unsigned int old_poll_ms = poll_interval_ms;
+	bool rx_low_changed, rebuild = false;
+	struct port_config pc;
+	struct sfp_port *port;
+	size_t i, j;
+	
+	for (j = 0; j < cfg->num_ports; j++) {
+		for (i = 0; i < num_ports; i++) {
+			if (strcmp(cfg->ports[j].name, ports[i].sfp_name) == 0 ||
+			    strcmp(cfg->ports[j].name, ports[i].dt_netdev) == 0)
+				break;
+		}
+		if (i == num_ports)
+			syslog(LOG_WARNING, "No SFP cage or netdev %s, ignoring its settings", cfg->ports[j].name);
 	}
 	
-	set_led_brightness(port->link_led_fd, LED_OFF);
-	set_led_brightness(port->activity_led_fd, LED_OFF);
+	rx_low_changed = cfg->rx_low_enabled != dom_rx_low_enabled ||
+			 (cfg->rx_low_enabled && cfg->rx_low_dbm != dom_rx_low_dbm);
+	poll_interval_ms = cfg->poll_interval_ms;
+	default_damping = cfg->damping;
+	dom_interval_ms = cfg->dom_interval_ms;
+	dom_rx_low_enabled = cfg->rx_low_enabled;
+	dom_rx_low_dbm = cfg->rx_low_dbm;
+	rate_sample_ms = cfg->rate_sample_ms;
 	
-	if (port->carrier_fd >= 0) {
-		close(port->carrier_fd);
-		port->carrier_fd = -1;
-	}
-	if (port->link_led_fd >= 0) {
-		close(port->link_led_fd);
-		port->link_led_fd = -1;
-	}
-	if (port->activity_led_fd >= 0) {
-		close(port->activity_led_fd);
-		port->activity_led_fd = -1;
-	}
-	if (port->mod_present_fd >= 0) {
-		close(port->mod_present_fd);
-		port->mod_present_fd = -1;
+	for (i = 0; i < num_ports; i++) {
+		resolve_port_config(cfg, &ports[i], &pc);
+		if (pc.vpp_interface[0])
+			mode = ACTIVITY_RATE;
+		
+		if (startup)
+			port_set_config(&ports[i], &pc);
+		else if (!port_config_equal(&ports[i].cfg, &pc))
+			rebuild |= reconfigure_port(&ports[i], &pc);
 	}
-}
-
-static void setup_netdev_trigger(struct sfp_port *port)
-{
-	char path[PATH_MAX];
+	update_vpp_ports();
 	
-	snprintf(path, sizeof(path), "/sys/class/leds/%s/trigger", port->activity_led);
-	if (write_sysfs_string(path, "netdev") < 0) {
+	if (startup) {
+		activity_mode = mode;
 		return;
 	}
+	if (rebuild)
+		rebuild_ifindex_table();
 	
-	snprintf(path, sizeof(path), "/sys/class/leds/%s/device_name", port->activity_led);
-	if (write_sysfs_string(path, port->netdev) < 0) {
-		syslog(LOG_WARNING, "Failed to set device_name for %s activity LED", port->netdev);
-		return;
+	if (mode != activity_mode) {
+		syslog(LOG_INFO, "Activity LED mode changed to %s", mode == ACTIVITY_RATE ? "rate" : "netdev");
+		activity_mode = mode;
+		if (mode == ACTIVITY_RATE)
+			start_traffic_sampling();
+		else
+			stop_traffic_sampling();
+		
+		for (i = 0; i < num_ports; i++) {
+			port = &ports[i];
+			if (port->timer.fd < 0)
+				continue;
+			rate_link_changed(port);
+			if (!port->damping.suppressed)
+				apply_port_leds(port, port->last_module_present, port->last_carrier_state);
+		}
+	} else if (!vpp_ports) {
+		close_fd(&vpp_source.fd);
+		vpp_unmap();
 	}
 	
-	snprintf(path, sizeof(path), "/sys/class/leds/%s/tx", port->activity_led);
-	if (write_sysfs_string(path, "1") < 0) {
-		syslog(LOG_WARNING, "Failed to enable tx monitoring for %s activity LED", port->netdev);
-	}
+	/* Picks up a changed sample interval */
+	update_stats_timer();
 	
-	snprintf(path, sizeof(path), "/sys/class/leds/%s/rx", port->activity_led);
-	if (write_sysfs_string(path, "1") < 0) {
-		syslog(LOG_WARNING, "Failed to enable rx monitoring for %s activity LED", port->netdev);
+	for (i = 0; i < num_ports; i++) {
+		port = &ports[i];
+		if (port->timer.fd < 0)
+			continue;
+		
+		if (poll_interval_ms != old_poll_ms && port->poll_at_ms) {
+			port->poll_at_ms = now_ms() + poll_interval_ms;
+			rearm_port_timer(port);
+		}
+		
+		if (rx_low_changed) {
+			if (dom_rx_low_enabled) {
+				dom_update_rx_low(port);
+			} else if (port->dom.rx_low) {
+				port->dom.rx_low = false;
+				if (!port->damping.suppressed)
+					apply_port_leds(port, port->last_module_present, port->last_carrier_state);
+			}
+		}
 	}
-	
-	syslog(LOG_INFO, "Setup netdev trigger for %s activity LED", port->netdev);
 }
 
-static void disable_netdev_trigger(struct sfp_port *port)
+static void reload_config(void)
 {
-	char path[PATH_MAX];
+	struct daemon_config cfg;
+	
+	if (load_config(&cfg) < 0) {
+		syslog(LOG_WARNING, "Keeping the current configuration");
+		return;
+	}
 	
-	snprintf(path, sizeof(path), "/sys/class/leds/%s/trigger", port->activity_led);
-	write_sysfs_string(path, "none");
+	apply_config(&cfg, false);
+	free(cfg.ports);
+	syslog(LOG_INFO, "Configuration reloaded");
 }
 
-static void update_port(struct sfp_port *port)
+static void handle_signal(int fd)
 {
-	bool module_present = read_module_present(port->mod_present_fd);
-	bool rx_los = read_rx_los(port->mod_present_fd);
-	bool has_signal = module_present && !rx_los;
-	
-	/* Check for module presence change */
-	if (module_present != port->last_module_present) {
-		if (!module_present) {
-			/* Module removed - disable netdev trigger and turn off both LEDs */
-			disable_netdev_trigger(port);
-			set_led_brightness(port->link_led_fd, LED_OFF);
-			set_led_brightness(port->activity_led_fd, LED_OFF);
-			syslog(LOG_INFO, "%s: SFP module removed", port->netdev);
-		} else {
-			/* Module inserted */
-			syslog(LOG_INFO, "%s: SFP module inserted", port->netdev);
-			
-			if (!rx_los) {
-				setup_netdev_trigger(port);
-				set_led_brightness(port->link_led_fd, LED_MAX);
-			} else {
-				set_led_brightness(port->activity_led_fd, LED_MAX);
+	struct signalfd_siginfo si;
+	size_t i;
+	
+	while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+		case SIGTERM:
+		case SIGINT:
+			running = false;
+			break;
+		case SIGHUP:
+			syslog(LOG_INFO, "SIGHUP received, reloading configuration and resyncing ports");
+			notify_systemd("RELOADING=1");
+			reload_config();
+			for (i = 0; i < num_ports; i++) {
+				if (ports[i].timer.fd >= 0)
+					schedule_port_update(&ports[i]);
 			}
+			notify_systemd("READY=1");
+			break;
+		case SIGUSR1:
+			dump_stats();
+			break;
 		}
-		port->last_module_present = module_present;
-		port->last_carrier_state = has_signal;
 	}
+}
+
+static void dispatch_event(struct event_source *src)
+{
+	size_t i;
 	
-	/* Handle optical signal changes when module is present */
-	if (module_present && (has_signal != port->last_carrier_state)) {
-		if (has_signal) {
-			/* Optical signal detected - enable netdev trigger and turn on link LED */
-			set_led_brightness(port->link_led_fd, LED_MAX);
-			disable_netdev_trigger(port);
-			set_led_brightness(port->activity_led_fd, LED_OFF);
-			setup_netdev_trigger(port);
-			
-			syslog(LOG_INFO, "%s: optical link UP", port->netdev);
-		} else {
-			/* Optical signal lost - disable netdev trigger, turn off link LED, activity LED solid ON */
-			disable_netdev_trigger(port);
-			set_led_brightness(port->link_led_fd, LED_OFF);
-			set_led_brightness(port->activity_led_fd, LED_MAX);
-			syslog(LOG_INFO, "%s: optical link DOWN", port->netdev);
+	switch (src->type) {
+	case EVENT_SIGNAL:
+		handle_signal(src->fd);
+		break;
+	case EVENT_RTNETLINK:
+		if (process_rtnetlink(src->fd) < 0) {
+			for (i = 0; i < num_ports; i++)
+				schedule_port_update(&ports[i]);
 		}
-		
-		port->last_carrier_state = has_signal;
-	}
-	
-	if (!module_present) {
-		set_led_brightness(port->link_led_fd, LED_OFF);
-		set_led_brightness(port->activity_led_fd, LED_OFF);
+		break;
+	case EVENT_UEVENT:
+		process_uevent(src->fd);
+		break;
+	case EVENT_PORT_TIMER:
+		handle_port_timer(src->port);
+		break;
+	case EVENT_METRICS_LISTEN:
+		metrics_accept(src);
+		break;
+	case EVENT_METRICS_CLIENT:
+		metrics_client_event(src->client);
+		break;
+	case EVENT_METRICS_TIMER:
+		handle_metrics_timer(src->fd);
+		break;
+	case EVENT_DOM:
+		process_dom_results(src->fd);
+		break;
+	case EVENT_STATS:
+		process_link_stats(src->fd);
+		break;
+	case EVENT_STATS_TIMER:
+		handle_stats_timer(src->fd);
+		break;
+	case EVENT_VPP_STATS:
+		vpp_receive_segment(src->fd);
+		break;
 	}
 }
 
-static void daemonize(void)
+static void usage(const char *prog)
 {
-	pid_t pid;
-	int fd;
-	struct rlimit rlim;
+	fprintf(stderr,
+		"Usage: %s [-f] [-n] [-d penalty,suppress,reuse,half-life-ms[,hold-ms]]\n"
+		"          [-r root] [-i poll-interval-ms] [-m metrics-socket] [-t tcp-port]\n"
+		"          [-l rx-low-dbm] [-D dom-interval-ms] [-a netdev|rate] [-s sample-ms]\n"
+		"          [-V vpp-stats-socket] [-M vpp-interface=netdev]... [-c config]\n"
+		"  -f  run in foreground\n"
+		"  -n  disable link flap damping\n"
+		"  -d  flap damping parameters (default %u,%u,%u,%u,%u)\n"
+		"  -r  look up sysfs, debugfs, devicetree and /run below root, this\n"
+		"      implies polling since the kernel can't notify about a fake tree\n"
+		"  -i  fallback poll interval (default %u)\n"
+		"  -m  OpenMetrics unix socket, \"none\" to disable (default " METRICS_SOCKET ")\n"
+		"  -t  also serve OpenMetrics over HTTP on 127.0.0.1:tcp-port\n"
+		"  -l  blink the link LED while RX power is below rx-low-dbm, this\n"
+		"      keeps module diagnostics refreshed every dom-interval-ms\n"
+		"  -D  minimum time between diagnostics reads of a module (default %u)\n"
+		"  -a  activity LED mode: netdev blinks per packet (default), rate\n"
+		"      blinks faster with line utilization\n"
+		"  -s  traffic sampling interval in rate mode (default %u)\n"
+		"  -M  take the port's traffic counters from this VPP interface in the\n"
+		"      VPP stats segment instead of the kernel, implies rate mode\n"
+		"  -V  VPP stats socket (default " VPP_STATS_SOCKET ")\n"
+		"  -c  config file (default " CONFIG_FILE "), options given here\n"
+		"      override it, SIGHUP reloads it\n"
+		"Send SIGUSR1 to log statistics and write them to " STATS_FILE "\n",
+		prog, DAMPING_PENALTY, DAMPING_SUPPRESS, DAMPING_REUSE,
+		DAMPING_HALF_LIFE_MSEC, DAMPING_HOLD_MSEC, POLL_INTERVAL_MSEC, DOM_INTERVAL_MSEC,
+		RATE_SAMPLE_MSEC);
+}
 
-	pid = fork();
-	if (pid < 0)
-		exit(EXIT_FAILURE);
-	
-	if (pid > 0)
-		exit(EXIT_SUCCESS);
-	
-	if (setsid() < 0)
-		exit(EXIT_FAILURE);
-	
-	pid = fork();
-	if (pid < 0)
-		exit(EXIT_FAILURE);
-	
-	if (pid > 0)
-		exit(EXIT_SUCCESS);
+int main(int argc, char *argv[])
+{
+	int i, n;
+	size_t p;
+	uint64_t dispatch_start;
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	struct daemon_config cfg;
+	struct options opts = {
+		.metrics_socket = METRICS_SOCKET,
+		.vpp_socket = VPP_STATS_SOCKET,
+		.config_file = CONFIG_FILE,
+	};
+	sigset_t sigmask;
 	
-	umask(0);
+	/* Validates everything up front, tunables are parsed again on top of the config file */
+	config_defaults(&cfg);
+	n = parse_args(argc, argv, &cfg, &opts);
+	free(cfg.ports);
+	if (n < 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	saved_argc = argc;
+	saved_argv = argv;
 	
-	chdir("/");
+	if (opts.config_file[0] == '/' ? root_path(config_path, sizeof(config_path), "%s", opts.config_file) < 0
+				       : !realpath(opts.config_file, config_path)) {
+		fprintf(stderr, "Invalid config file '%s'\n", opts.config_file);
+		return EXIT_FAILURE;
+	}
+	config_required = opts.config_required;
 	
-	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
-		int max_fd = (rlim.rlim_cur != RLIM_INFINITY) ? rlim.rlim_cur : 1024;
-		for (fd = 0; fd < max_fd; fd++)
-			close(fd);
-	} else {
-		for (fd = 0; fd < 256; fd++)
-			close(fd);
+	if (strcmp(opts.metrics_socket, "none") != 0 &&
+	    (opts.metrics_socket[0] == '/' ? root_path(metrics_path, sizeof(metrics_path), "%s", opts.metrics_socket)
+					   : snprintf(metrics_path, sizeof(metrics_path), "%s", opts.metrics_socket)) < 0) {
+		fprintf(stderr, "Metrics socket path too long\n");
+		return EXIT_FAILURE;
 	}
 	
-	/* Redirect stdin, stdout, stderr to /dev/null */
-	fd = open("/dev/null", O_RDWR);
-	if (fd >= 0) {
-		dup2(fd, STDIN_FILENO);
-		dup2(fd, STDOUT_FILENO);
-		dup2(fd, STDERR_FILENO);
-		if (fd > STDERR_FILENO)
-			close(fd);
+	if (root_path(stats_path, sizeof(stats_path), STATS_FILE) < 0 ||
+	    root_path(vpp_stats_path, sizeof(vpp_stats_path), "%s", opts.vpp_socket) < 0) {
+		fprintf(stderr, "Root path too long\n");
+		return EXIT_FAILURE;
 	}
-}
-
-int main(int argc, char *argv[])
-{
-	int i;
-	bool daemon_mode = true;
-	fd_set readfds;
-	struct timespec timeout;
-	char inotify_buf[INOTIFY_BUF_LEN];
-	int max_fd;
-	sigset_t sigmask, orig_sigmask;
-	struct sigaction sa;
-	
-	/* Check for -f (foreground) flag */
-	if (argc > 1 && strcmp(argv[1], "-f") == 0)
-		daemon_mode = false;
-	
-	if (daemon_mode) {
+	
+	if (!opts.foreground) {
 		daemonize();
 		openlog("sfp-led-daemon", LOG_PID, LOG_DAEMON);
 		syslog(LOG_INFO, "Starting SFP LED daemon");
 	} else {
-		openlog("sfp-led-daemon", LOG_PID | LOG_PERROR, LOG_DAEMON);
+		/* Under systemd stderr already goes to the journal, don't log twice */
+		openlog("sfp-led-daemon", LOG_PID | (getenv("JOURNAL_STREAM") ? 0 : LOG_PERROR), LOG_DAEMON);
 		syslog(LOG_INFO, "Starting SFP LED daemon in foreground mode");
 	}
 	
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = signal_handler;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = 0;
+	start_ns = now_ns();
 	
-	if (sigaction(SIGTERM, &sa, NULL) < 0) {
-		syslog(LOG_ERR, "Failed to setup SIGTERM handler: %s", strerror(errno));
+	if (load_config(&cfg) < 0)
 		exit(EXIT_FAILURE);
-	}
-	if (sigaction(SIGINT, &sa, NULL) < 0) {
-		syslog(LOG_ERR, "Failed to setup SIGINT handler: %s", strerror(errno));
+	
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		syslog(LOG_ERR, "Failed to create epoll instance: %s", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 	
-	/* Block signals during normal operation - pselect will unblock them atomically */
+	/* Signals are only ever delivered through the signalfd */
 	sigemptyset(&sigmask);
 	sigaddset(&sigmask, SIGTERM);
 	sigaddset(&sigmask, SIGINT);
-	if (sigprocmask(SIG_BLOCK, &sigmask, &orig_sigmask) < 0) {
+	sigaddset(&sigmask, SIGHUP);
+	sigaddset(&sigmask, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0) {
 		syslog(LOG_ERR, "Failed to block signals: %s", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 	
-	inotify_fd = inotify_init1(IN_NONBLOCK);
-	if (inotify_fd < 0) {
-		syslog(LOG_ERR, "Failed to initialize inotify: %s", strerror(errno));
+	signal_source.fd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_source.fd < 0 || epoll_add_source(&signal_source) < 0) {
+		syslog(LOG_ERR, "Failed to setup signalfd: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	
+	rtnl_source.fd = open_rtnetlink();
+	if (rtnl_source.fd >= 0 && epoll_add_source(&rtnl_source) < 0) {
+		close(rtnl_source.fd);
+		rtnl_source.fd = -1;
+	}
+	if (rtnl_source.fd < 0) {
+		syslog(LOG_WARNING, "Link events unavailable, falling back to polling carrier");
+	}
+	
+	uevent_source.fd = open_uevent();
+	if (uevent_source.fd >= 0 && epoll_add_source(&uevent_source) < 0) {
+		close(uevent_source.fd);
+		uevent_source.fd = -1;
+	}
+	if (uevent_source.fd < 0) {
+		syslog(LOG_WARNING, "Module events unavailable, falling back to polling debugfs");
+	}
+	
+	/*
+	 * With both event sources available only ports without carrier are
+	 * polled, see port_needs_polling().
+	 */
+	fallback_polling = rtnl_source.fd < 0 || uevent_source.fd < 0 || root_dir[0] != '\0';
+	
+	if (discover_ports() < 0) {
+		syslog(LOG_ERR, "No SFP cages found in device tree");
+		exit(EXIT_FAILURE);
 	}
 	
+	apply_config(&cfg, true);
+	free(cfg.ports);
+	
+	if (activity_mode == ACTIVITY_RATE)
+		start_traffic_sampling();
+	
+	/* Without the worker, diagnostics are simply never read */
+	if (dom_start() < 0)
+		syslog(LOG_WARNING, "Module diagnostics unavailable");
+	
 	/* Setup all ports */
-	for (i = 0; i < MAX_PORTS; i++) {
-		if (setup_port(&ports[i]) < 0) {
-			syslog(LOG_WARNING, "Failed to setup port %d, continuing anyway", i);
+	for (p = 0; p < num_ports; p++) {
+		if (setup_port(&ports[p]) < 0) {
+			syslog(LOG_WARNING, "Failed to setup port %s, continuing anyway", ports[p].sfp_name);
+		}
+	}
+	rebuild_ifindex_table();
+	
+	if (metrics_path[0]) {
+		metrics_unix_source.fd = open_metrics_unix(metrics_path);
+		if (metrics_unix_source.fd >= 0 && epoll_add_source(&metrics_unix_source) < 0)
+			close_fd(&metrics_unix_source.fd);
+	}
+	if (metrics_tcp_port) {
+		metrics_tcp_source.fd = open_metrics_tcp(metrics_tcp_port);
+		if (metrics_tcp_source.fd >= 0 && epoll_add_source(&metrics_tcp_source) < 0)
+			close_fd(&metrics_tcp_source.fd);
+	}
+	if (metrics_unix_source.fd >= 0 || metrics_tcp_source.fd >= 0) {
+		metrics_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (metrics_timer.fd < 0 || epoll_add_source(&metrics_timer) < 0) {
+			syslog(LOG_WARNING, "Failed to setup metrics timer, idle clients won't time out");
+			close_fd(&metrics_timer.fd);
 		}
 	}
 	
+	update_idle_state();
 	syslog(LOG_INFO, "SFP LED daemon running");
+	notify_systemd("READY=1");
 	
 	/* Main event loop */
 	while (running) {
-		FD_ZERO(&readfds);
-		max_fd = -1;
-		
-		/* Add inotify fd to the set if available */
-		if (inotify_fd >= 0) {
-			FD_SET(inotify_fd, &readfds);
-			max_fd = inotify_fd;
-		}
-		
-		timeout.tv_sec = POLL_INTERVAL_SEC;
-		timeout.tv_nsec = POLL_INTERVAL_USEC * 1000;
+		n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
 		
-		int ret = pselect(max_fd + 1, &readfds, NULL, NULL, &timeout, &orig_sigmask);
-		
-		if (ret < 0) {
+		if (n < 0) {
 			if (errno == EINTR)
 				continue;
-			syslog(LOG_ERR, "pselect() failed: %s", strerror(errno));
+			syslog(LOG_ERR, "epoll_wait() failed: %s", strerror(errno));
 			break;
 		}
 		
-		/* Check if inotify has events */
-		if (ret > 0 && inotify_fd >= 0 && FD_ISSET(inotify_fd, &readfds)) {
-			int len = read(inotify_fd, inotify_buf, sizeof(inotify_buf));
-			if (len > 0) {
-				for (i = 0; i < MAX_PORTS; i++) {
-					update_port(&ports[i]);
-				}
-			}
-		}
+		dispatch_start = now_ns();
+		loop_wakeups++;
+		loop_events += n;
+		for (i = 0; i < n; i++)
+			dispatch_event(events[i].data.ptr);
+		expire_metrics_clients();
+		update_idle_state();
+		hist_record(&loop_dispatch, (now_ns() - dispatch_start) / 1000);
+	}
+	
+	syslog(LOG_INFO, "SFP LED daemon shutting down");
+	notify_systemd("STOPPING=1");
+	
+	dom_shutdown();
+	
+	for (p = 0; p < num_ports; p++) {
+		struct flap_damping *d = &ports[p].damping;
 		
-		/* Periodic check for module presence (debugfs doesn't support inotify) */
-		if (ret == 0) {
-			for (i = 0; i < MAX_PORTS; i++) {
-				update_port(&ports[i]);
-			}
+		if (d->transitions) {
+			syslog(LOG_INFO, "%s: %llu link transitions, %llu suppressions, %llu coalesced",
+			       ports[p].sfp_name, (unsigned long long)d->transitions,
+			       (unsigned long long)d->suppressions,
+			       (unsigned long long)d->coalesced_transitions);
 		}
+		cleanup_port(&ports[p]);
+		free(ports[p].dt_path);
 	}
+	free(ports);
+	free(ports_by_ifindex.slots);
+	free(ports_by_name.slots);
 	
-	syslog(LOG_INFO, "SFP LED daemon shutting down");
+	if (rtnl_source.fd >= 0) {
+		close(rtnl_source.fd);
+	}
 	
-	for (i = 0; i < MAX_PORTS; i++) {
-		cleanup_port(&ports[i]);
+	if (uevent_source.fd >= 0) {
+		close(uevent_source.fd);
 	}
 	
-	if (inotify_fd >= 0) {
-		close(inotify_fd);
+	close_fd(&stats_source.fd);
+	close_fd(&stats_timer.fd);
+	close_fd(&vpp_source.fd);
+	vpp_unmap();
+	free(vpp_scratch);
+	
+	if (metrics_unix_source.fd >= 0) {
+		close(metrics_unix_source.fd);
+		unlink(metrics_path);
 	}
+	close_fd(&metrics_tcp_source.fd);
+	while (metrics_client_list)
+		metrics_client_close(metrics_client_list);
+	close_fd(&metrics_timer.fd);
+	
+	close(signal_source.fd);
+	close(epoll_fd);
 	
 	closelog();
 	
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
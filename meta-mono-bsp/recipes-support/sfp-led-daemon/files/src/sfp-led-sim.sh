@@ -0,0 +1,231 @@
+#!/bin/sh
+#
+# Flap benchmark for sfp-led-daemon on any Linux host.
+#
+# Builds a fake devicetree, netdev, debugfs and LED tree in tmpfs, starts
+# the daemon on it with -r and flaps the links and modules by rewriting
+# the debugfs state and carrier files. Each round flaps every cage at
+# once and waits for all link LEDs to follow, so the wall time covers
+# poll delay plus daemon work. A fake tree is always polled and polls are
+# aligned to the daemon's 250ms timer grid, so throughput comes from the
+# number of cages rather than the poll interval. The daemon's own
+# event-to-LED latency and CPU time per update are taken from its
+# statistics at the end.
+#
+# Not installed, run it from the source directory:
+#   gcc -O2 -o sfp-led-daemon sfp-led-daemon.c -lm -pthread
+#   ./sfp-led-sim.sh -d ./sfp-led-daemon -p 16 -n 200
+
+DAEMON=./sfp-led-daemon
+PORTS=8
+ROUNDS=100
+INTERVAL=10
+TIMEOUT_MS=2000
+ROOT=
+KEEP=0
+STRACE=0
+
+usage() {
+    cat >&2 <<EOF
+Usage: $0 [-d daemon] [-p ports] [-n rounds] [-i poll-interval-ms] [-r root] [-k] [-S]
+  -d  daemon binary (default $DAEMON)
+  -p  number of fake SFP cages (default $PORTS)
+  -n  rounds of flapping every port, alternating link and module (default $ROUNDS)
+  -i  daemon poll interval (default $INTERVAL)
+  -r  build the fake tree here instead of a new directory in /dev/shm
+  -k  keep the fake tree afterwards
+  -S  run the daemon under strace -c and print its syscall summary
+EOF
+    exit 1
+}
+
+while getopts "d:p:n:i:r:kS" opt; do
+    case $opt in
+        d) DAEMON=$OPTARG ;;
+        p) PORTS=$OPTARG ;;
+        n) ROUNDS=$OPTARG ;;
+        i) INTERVAL=$OPTARG ;;
+        r) ROOT=$OPTARG ;;
+        k) KEEP=1 ;;
+        S) STRACE=1 ;;
+        *) usage ;;
+    esac
+done
+
+[ -x "$DAEMON" ] || { echo "$DAEMON is not executable" >&2; exit 1; }
+[ "$PORTS" -ge 1 ] && [ "$PORTS" -le 255 ] || usage
+if [ "$STRACE" = 1 ] && ! command -v strace > /dev/null; then
+    echo "strace not found" >&2
+    exit 1
+fi
+
+if [ -z "$ROOT" ]; then
+    ROOT=$(mktemp -d "${TMPDIR:-/dev/shm}/sfp-led-sim.XXXXXX") || exit 1
+else
+    mkdir -p "$ROOT" || exit 1
+fi
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# Rewritten in place with fixed length, the daemon keeps these open and
+# must never see them empty or with a stale tail
+write_state() {
+    # port moddef0 rx_los
+    printf 'moddef0: %d\nrx_los: %d\ntx_fault: 0\ntx_disable: 0\n' \
+        "$2" "$3" 1<>"$ROOT/sys/kernel/debug/sfp-xfi$1/state"
+    printf '%d\n' "$(( $2 && ! $3 ))" 1<>"$ROOT/sys/class/net/sim$1/carrier"
+}
+
+make_led() {
+    mkdir -p "$ROOT/sys/class/leds/$1"
+    for attr in brightness trigger device_name tx rx delay_on delay_off; do
+        : > "$ROOT/sys/class/leds/$1/$attr"
+    done
+    echo 255 > "$ROOT/sys/class/leds/$1/max_brightness"
+}
+
+# The daemon overwrites without truncating, the first line is current
+link_led() {
+    read -r value < "$ROOT/sys/class/leds/sfp$1:link/brightness"
+    echo "${value:-0}"
+}
+
+wait_led() {
+    # port brightness
+    deadline=$(( $(now_ms) + TIMEOUT_MS ))
+    while [ "$(link_led "$1")" != "$2" ]; do
+        if [ "$(now_ms)" -ge "$deadline" ]; then
+            echo "sfp-xfi$1: link LED did not go to $2 within ${TIMEOUT_MS}ms" >&2
+            return 1
+        fi
+        sleep 0.001
+    done
+}
+
+cpu_ticks() {
+    # utime and stime, fields 14 and 15 after the parenthesized comm
+    sed 's/.*) //' "/proc/$1/stat" | awk '{ print $12 + $13 }'
+}
+
+cleanup() {
+    [ -n "$PID" ] && kill "$PID" 2>/dev/null && wait "$PID" 2>/dev/null
+    [ "$FAILED" = 1 ] && tail -n 20 "$ROOT/daemon.log" >&2
+    [ "$KEEP" = 1 ] && echo "Fake tree kept in $ROOT" || rm -rf "$ROOT"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+fail() {
+    FAILED=1
+    exit 1
+}
+
+# Flip every port to one state, then wait for all link LEDs
+flap_all() {
+    # moddef0 rx_los brightness
+    i=0
+    while [ "$i" -lt "$PORTS" ]; do
+        write_state "$i" "$1" "$2"
+        i=$(( i + 1 ))
+    done
+    i=0
+    while [ "$i" -lt "$PORTS" ]; do
+        wait_led "$i" "$3" || fail
+        i=$(( i + 1 ))
+    done
+}
+
+# Fake tree, phandle i+1 links sfp-xfi<i> to netdev sim<i>
+DT=$ROOT/sys/firmware/devicetree/base
+mkdir -p "$DT/soc" "$ROOT/run" "$ROOT/etc"
+i=0
+while [ "$i" -lt "$PORTS" ]; do
+    phandle=$(printf '\\000\\000\\000\\%03o' $(( i + 1 )))
+
+    mkdir -p "$DT/sfp-xfi$i"
+    printf 'sff,sfp\000' > "$DT/sfp-xfi$i/compatible"
+    printf "$phandle" > "$DT/sfp-xfi$i/phandle"
+    printf 'sfp%d:link\000' "$i" > "$DT/sfp-xfi$i/mono,link-led"
+    printf 'sfp%d:activity\000' "$i" > "$DT/sfp-xfi$i/mono,activity-led"
+
+    mkdir -p "$ROOT/sys/class/net/sim$i/of_node"
+    printf "$phandle" > "$ROOT/sys/class/net/sim$i/of_node/sfp"
+    echo 10000 > "$ROOT/sys/class/net/sim$i/speed"
+    : > "$ROOT/sys/class/net/sim$i/carrier"
+
+    mkdir -p "$ROOT/sys/kernel/debug/sfp-xfi$i"
+    : > "$ROOT/sys/kernel/debug/sfp-xfi$i/state"
+    write_state "$i" 1 0
+
+    make_led "sfp$i:link"
+    make_led "sfp$i:activity"
+    i=$(( i + 1 ))
+done
+
+# Damping off, every flap has to reach the LEDs
+if [ "$STRACE" = 1 ]; then
+    strace -c -f -o "$ROOT/strace.out" "$DAEMON" -f -n -m none -r "$ROOT" -i "$INTERVAL" \
+        > "$ROOT/daemon.log" 2>&1 &
+else
+    "$DAEMON" -f -n -m none -r "$ROOT" -i "$INTERVAL" > "$ROOT/daemon.log" 2>&1 &
+fi
+PID=$!
+
+flap_all 1 0 255
+
+# Under strace the tracer is $PID, the daemon is its child
+DPID=$PID
+[ "$STRACE" = 1 ] && DPID=$(pgrep -P "$PID" | head -n 1)
+ticks_start=$(cpu_ticks "$DPID")
+start=$(now_ms)
+
+# Even rounds take the links down through rx_los, odd ones pull the modules
+n=0
+while [ "$n" -lt "$ROUNDS" ]; do
+    flap_all $(( n % 2 )) 1 0
+    flap_all 1 0 255
+    n=$(( n + 1 ))
+done
+
+elapsed=$(( $(now_ms) - start ))
+ticks=$(( $(cpu_ticks "$DPID") - ticks_start ))
+
+rm -f "$ROOT/run/sfp-led-daemon.stats"
+kill -USR1 "$DPID"
+n=0
+while [ ! -f "$ROOT/run/sfp-led-daemon.stats" ] && [ "$n" -lt 100 ]; do
+    sleep 0.01
+    n=$(( n + 1 ))
+done
+
+echo "rounds $ROUNDS ports $PORTS poll_interval_ms $INTERVAL"
+echo "flaps $(( ROUNDS * PORTS )) elapsed_ms $elapsed avg_ms_per_round $(( elapsed / ROUNDS ))"
+cat "$ROOT/run/sfp-led-daemon.stats"
+awk -v ticks="$ticks" -v hz="$(getconf CLK_TCK)" '
+    /^port / {
+        for (i = 3; i <= NF; i++) {
+            split($i, kv, "=")
+            if (kv[1] == "updates")
+                updates += kv[2]
+            else if (kv[1] == "led_changes")
+                changes += kv[2]
+        }
+    }
+    END {
+        cpu_us = ticks * 1000000 / hz
+        printf "cpu_ms %.0f", cpu_us / 1000
+        if (updates)
+            printf " cpu_us_per_update %.1f", cpu_us / updates
+        if (changes)
+            printf " cpu_us_per_led_change %.1f", cpu_us / changes
+        printf "\n"
+    }' "$ROOT/run/sfp-led-daemon.stats"
+
+if [ "$STRACE" = 1 ]; then
+    kill "$DPID"
+    wait "$PID" 2>/dev/null
+    PID=
+    cat "$ROOT/strace.out"
+fi
@@ -0,0 +1,259 @@
+#!/bin/sh
+#
+# Benchmark for the sfp_led plugin on a stock VPP, no board needed.
+#
+# Builds a tmpfs root with plain LED brightness files and debugfs state,
+# starts VPP with "root" pointing there and binds loopback interfaces as
+# ports, plus a packet-generator interface that carries traffic for the
+# activity LED. The loopbacks are then flapped with "set interface state"
+# in rounds, every round waits for all link LEDs to follow. A few module
+# flaps go through debugfs, which the plugin polls every second. At the
+# end "show sfp-led runtime" reports the plugin's main thread cost and its
+# event-to-LED latency.
+#
+# Not installed, run it against a VPP build that has the plugin:
+#   ./sfp-led-bench.sh -v build-root/install-vpp-native/vpp/bin \
+#       -P build-root/install-vpp-native/vpp/lib/x86_64-linux-gnu/vpp_plugins
+
+VPP_BIN=
+PLUGIN_PATH=
+PORTS=4
+ROUNDS=200
+MODULE_FLAPS=3
+RATE=100000
+TIMEOUT_MS=5000
+ROOT=
+KEEP=0
+
+usage() {
+    cat >&2 <<EOF
+Usage: $0 [-v vpp-bin-dir] [-P plugin-path] [-p ports] [-n rounds] [-m module-flaps]
+          [-R pps] [-r root] [-k]
+  -v  directory holding vpp and vppctl (default: from PATH)
+  -P  VPP plugin path, when the plugin isn't in the default one
+  -p  loopback ports to flap (default $PORTS)
+  -n  rounds of taking every loopback down and up again (default $ROUNDS)
+  -m  module pull and insert cycles through debugfs (default $MODULE_FLAPS)
+  -R  packet-generator rate on the traffic port (default $RATE)
+  -r  build the fake tree here instead of a new directory in /dev/shm
+  -k  keep the fake tree and VPP log afterwards
+EOF
+    exit 1
+}
+
+while getopts "v:P:p:n:m:R:r:k" opt; do
+    case $opt in
+        v) VPP_BIN=$OPTARG/ ;;
+        P) PLUGIN_PATH=$OPTARG ;;
+        p) PORTS=$OPTARG ;;
+        n) ROUNDS=$OPTARG ;;
+        m) MODULE_FLAPS=$OPTARG ;;
+        R) RATE=$OPTARG ;;
+        r) ROOT=$OPTARG ;;
+        k) KEEP=1 ;;
+        *) usage ;;
+    esac
+done
+
+command -v "${VPP_BIN}vpp" > /dev/null || { echo "${VPP_BIN}vpp not found" >&2; exit 1; }
+command -v "${VPP_BIN}vppctl" > /dev/null || { echo "${VPP_BIN}vppctl not found" >&2; exit 1; }
+# The plugin takes at most 64 ports, the traffic port included
+[ "$PORTS" -ge 1 ] && [ "$PORTS" -lt 64 ] && [ "$ROUNDS" -ge 1 ] || usage
+
+if [ -z "$ROOT" ]; then
+    ROOT=$(mktemp -d "${TMPDIR:-/dev/shm}/sfp-led-bench.XXXXXX") || exit 1
+else
+    mkdir -p "$ROOT" || exit 1
+fi
+
+# The traffic port comes after the loopbacks
+TRAFFIC=$PORTS
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+cli() {
+    "${VPP_BIN}vppctl" -s "$ROOT/cli.sock" "$@"
+}
+
+# Rewritten in place with fixed length, the plugin keeps it open
+write_state() {
+    # port moddef0
+    printf 'moddef0: %d\nrx_los: 0\ntx_fault: 0\n' "$2" 1<>"$ROOT/sys/kernel/debug/sfp-xfi$1/state"
+}
+
+# The plugin overwrites without truncating, the first line is current
+link_led() {
+    read -r value < "$ROOT/sys/class/leds/sfp$1:link/brightness"
+    echo "${value:-0}"
+}
+
+wait_led() {
+    # port brightness
+    deadline=$(( $(now_ms) + TIMEOUT_MS ))
+    while [ "$(link_led "$1")" != "$2" ]; do
+        if [ "$(now_ms)" -ge "$deadline" ]; then
+            echo "port $1: link LED did not go to $2 within ${TIMEOUT_MS}ms" >&2
+            return 1
+        fi
+        sleep 0.001
+    done
+}
+
+cleanup() {
+    if [ -n "$PID" ]; then
+        kill "$PID" 2>/dev/null
+        wait "$PID" 2>/dev/null
+    fi
+    [ "$FAILED" = 1 ] && tail -n 20 "$ROOT/vpp.log" >&2
+    [ "$KEEP" = 1 ] && echo "Fake tree kept in $ROOT" || rm -rf "$ROOT"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+fail() {
+    FAILED=1
+    exit 1
+}
+
+# One CLI script for all loopbacks, a vppctl per command would dominate
+flap_all() {
+    # state brightness
+    i=0
+    while [ "$i" -lt "$PORTS" ]; do
+        echo "set interface state loop$i $1"
+        i=$(( i + 1 ))
+    done > "$ROOT/flap.cli"
+    cli exec "$ROOT/flap.cli" > /dev/null
+    i=0
+    while [ "$i" -lt "$PORTS" ]; do
+        wait_led "$i" "$2" || fail
+        i=$(( i + 1 ))
+    done
+}
+
+i=0
+while [ "$i" -le "$PORTS" ]; do
+    for led in link activity; do
+        mkdir -p "$ROOT/sys/class/leds/sfp$i:$led"
+        : > "$ROOT/sys/class/leds/sfp$i:$led/brightness"
+    done
+    mkdir -p "$ROOT/sys/kernel/debug/sfp-xfi$i"
+    : > "$ROOT/sys/kernel/debug/sfp-xfi$i/state"
+    write_state "$i" 1
+    i=$(( i + 1 ))
+done
+
+# Own sockets and shared memory prefix, a system VPP may be running
+cat > "$ROOT/startup.conf" <<EOF
+unix {
+	nodaemon
+	log $ROOT/vpp.log
+	cli-listen $ROOT/cli.sock
+}
+
+api-segment {
+	prefix sfp-led-bench
+}
+
+statseg {
+	socket-name $ROOT/stats.sock
+}
+
+plugins {
+	${PLUGIN_PATH:+path $PLUGIN_PATH}
+	plugin default { disable }
+	plugin sfp_led_plugin.so { enable }
+}
+
+sfp-led {
+	root $ROOT
+}
+EOF
+
+"${VPP_BIN}vpp" -c "$ROOT/startup.conf" > /dev/null 2>&1 &
+PID=$!
+
+n=0
+until cli show version > /dev/null 2>&1; do
+    kill -0 "$PID" 2>/dev/null && [ "$n" -lt 100 ] || fail
+    sleep 0.1
+    n=$(( n + 1 ))
+done
+
+# Paths are given as on the board, the plugin prefixes them with root
+i=0
+while [ "$i" -le "$PORTS" ]; do
+    if [ "$i" = "$TRAFFIC" ]; then
+        echo "create packet-generator interface pg0"
+        intf=pg0
+    else
+        echo "create loopback interface instance $i"
+        intf=loop$i
+    fi
+    echo "set sfp-led $intf link-led /sys/class/leds/sfp$i:link/brightness" \
+         "activity-led /sys/class/leds/sfp$i:activity/brightness" \
+         "sfp-debug /sys/kernel/debug/sfp-xfi$i/state"
+    echo "set interface state $intf up"
+    i=$(( i + 1 ))
+done > "$ROOT/setup.cli"
+
+cat >> "$ROOT/setup.cli" <<EOF
+packet-generator new {
+    name sfp-led-bench
+    limit -1
+    rate $RATE
+    size 64-64
+    interface pg0
+    node ethernet-input
+    data {
+        IP4: 1.2.3 -> 4.5.6
+        UDP: 192.168.1.1 -> 192.168.1.2
+        UDP: 1234 -> 2345
+        incrementing 22
+    }
+}
+packet-generator enable-stream sfp-led-bench
+EOF
+cli exec "$ROOT/setup.cli" || fail
+
+i=0
+while [ "$i" -le "$PORTS" ]; do
+    wait_led "$i" 255 || fail
+    i=$(( i + 1 ))
+done
+
+# Node runtime then covers the flaps only, the plugin's counters include setup
+cli clear runtime > /dev/null
+start=$(now_ms)
+
+n=0
+while [ "$n" -lt "$ROUNDS" ]; do
+    flap_all down 0
+    flap_all up 255
+    n=$(( n + 1 ))
+done
+elapsed=$(( $(now_ms) - start ))
+
+# Module changes are only seen on the plugin's debugfs poll
+n=0
+module_start=$(now_ms)
+while [ "$n" -lt "$MODULE_FLAPS" ]; do
+    write_state 0 0
+    wait_led 0 0 || fail
+    write_state 0 1
+    wait_led 0 255 || fail
+    n=$(( n + 1 ))
+done
+module_elapsed=$(( $(now_ms) - module_start ))
+
+echo "ports $PORTS rounds $ROUNDS pg_rate $RATE"
+echo "link flaps $(( ROUNDS * PORTS )) elapsed_ms $elapsed avg_ms_per_round $(( elapsed / ROUNDS ))"
+echo "module flaps $MODULE_FLAPS elapsed_ms $module_elapsed"
+cli show sfp-led runtime
+cli show runtime | grep -E "^ *Name|sfp-led-process"
+cli show interface pg0
+if command -v "${VPP_BIN}vpp_get_stats" > /dev/null; then
+    "${VPP_BIN}vpp_get_stats" socket-name "$ROOT/stats.sock" dump /sfp-led/
+fi
@@ -3,6 +3,37 @@
  * 
  * Monitors VPP/DPDK interface link state and controls SFP+ port LEDs accordingly.
  * 
+ * All debugfs and sysfs access happens on a helper thread. The main thread
+ * (process node, link/admin callbacks) only queues LED commands and picks up
+ * module presence snapshots through a pair of single producer, single
+ * consumer rings, so it never waits on kernel file I/O.
+ * 
+ * Nothing on the main thread runs on a timer unless some port has traffic
+ * to show: link/admin callbacks and module changes signal the process node,
+ * which only arms its sampling clock while a port is up with a module in.
+ * 
+ * Ports come from the sfp-led startup.conf section and can be added,
+ * rebound or removed at runtime with "set sfp-led" or the binary API. The
+ * port vector is reserved up front so it never moves under the I/O thread;
+ * removed slots are reused once the I/O thread has closed their files.
+ * 
+ * Ports are found by sw_if_index through a direct lookup table, traffic is
+ * sampled in one pass over the per-thread counter vectors, and the I/O
+ * thread coalesces queued LED changes into one write per LED and wakeup.
+ * 
+ * Per-port traffic rates, SFP state and LED state are published as gauges
+ * in the stats segment under /sfp/<interface>/, for vpp_get_stats and other
+ * shared memory readers, along with module diagnostics (SFF-8472 DOM) read
+ * through the DPDK module EEPROM API. What the plugin itself costs, on the main thread
+ * and in I/O, goes under /sfp-led/ and "show sfp-led runtime". The gauges
+ * are published on every main thread wakeup, which the I/O thread forces
+ * at least every RUNTIME_PUBLISH_MSEC.
+ * 
+ * Any VPP interface can be a port, modules are only read on DPDK ones. With
+ * "root <dir>" in the sfp-led section every LED and debugfs path is looked
+ * up under <dir>, so loop, tap or pg interfaces and plain files on a tmpfs
+ * stand in for the board when measuring the plugin on a stock VPP.
+ * 
  * Copyright 2025 Mono Technologies Inc.
  * Author: Tomaz Zaman <tomaz@mono.si>
  */
@@ -10,18 +41,219 @@
 #include <vnet/vnet.h>
 #include <vnet/plugin/plugin.h>
 #include <vnet/interface.h>
+#include <vlib/unix/unix.h>
+#include <vlib/stats/stats.h>
+#include <dpdk/device/dpdk.h>
+#include <vlibapi/api.h>
+#include <vlibmemory/api.h>
+
+#include <sfp_led/sfp_led.api_enum.h>
+#include <sfp_led/sfp_led.api_types.h>
 #include <vppinfra/error.h>
 #include <vppinfra/hash.h>
+#include <vppinfra/atomics.h>
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <math.h>
 
 #define LED_OFF 0
 #define LED_MAX 255
 #define POLL_INTERVAL_SEC 0.05
+#define MODULE_POLL_MSEC 1000        /* debugfs SFP state, on the I/O thread */
+#define DOM_POLL_MSEC 10000          /* Module diagnostics, on the I/O thread */
+#define RUNTIME_PUBLISH_MSEC 5000    /* I/O thread nudges the main thread to publish /sfp-led/ */
+#define DOM_POWER_FLOOR_DBM -40.0    /* Shown for zero power */
+
+/* Module diagnostics (SFF-8472), DPDK maps the A2h page after A0h */
+#define SFF8472_A2_BASE 256
+#define SFF8472_DIAG_TYPE 92         /* A0h */
+#define SFF8472_DIAG_IMPLEMENTED 0x40
+#define SFF8472_DIAG_EXTERNAL_CAL 0x10
+#define SFF8472_CAL_CONSTANTS 56     /* A2h, external calibration */
+#define SFF8472_CAL_CONSTANTS_LEN 36
+#define SFF8472_DIAG_VALUES 96       /* A2h, temperature through RX power */
+#define SFF8472_DIAG_VALUES_LEN 10
+#define SFP_LED_RING_SIZE 256        /* Power of two */
+#define SFP_LED_MAX_PORTS 64         /* Reserved up front, ports never moves */
+#define RATE_EWMA_SEC 1.0            /* Time constant of the published rates */
+
+/* SFP state flags, as read from debugfs */
+#define SFP_STATE_MODULE (1 << 0)    /* moddef0 */
+#define SFP_STATE_RX_LOS (1 << 1)
+
+/* Process node events, the data is the port index */
+#define SFP_LED_EVENT_PORT_CHANGED 1
+
+typedef enum {
+    /* Main thread to I/O thread */
+    SFP_LED_OP_OPEN,            /* Open the port files, LEDs off */
+    SFP_LED_OP_CLOSE,           /* LEDs off, close the port files */
+    SFP_LED_OP_LINK_LED,        /* value: brightness */
+    SFP_LED_OP_ACTIVITY_LED,    /* value: brightness */
+    SFP_LED_OP_TRIGGER_NONE,    /* Take the activity LED back from the netdev trigger */
+    SFP_LED_OP_SHUTDOWN,        /* LEDs off, close everything, exit */
+    /* I/O thread to main thread */
+    SFP_LED_OP_OPENED,          /* value: SFP state flags */
+    SFP_LED_OP_SFP_STATE,       /* value: SFP state flags, sent on change */
+    SFP_LED_OP_DOM,             /* New diagnostics in the port's io_dom */
+    SFP_LED_OP_CLOSED,          /* Done with the port, its slot can be reused */
+} sfp_led_op_t;
+
+typedef enum {
+    SFP_LED_ACTIVITY_BLINK,     /* Blink with traffic, solid while down with a module */
+    SFP_LED_ACTIVITY_SOLID,     /* On while the link is up */
+    SFP_LED_ACTIVITY_OFF,
+    SFP_LED_N_ACTIVITY_MODES,
+} sfp_led_activity_mode_t;
+
+static char *sfp_led_activity_mode_names[SFP_LED_N_ACTIVITY_MODES] = {
+    [SFP_LED_ACTIVITY_BLINK] = "blink",
+    [SFP_LED_ACTIVITY_SOLID] = "solid",
+    [SFP_LED_ACTIVITY_OFF] = "off",
+};
+
+/* Gauges under /sfp/<interface>/ */
+typedef enum {
+    SFP_LED_STAT_RX_PPS,
+    SFP_LED_STAT_TX_PPS,
+    SFP_LED_STAT_RX_BPS,
+    SFP_LED_STAT_TX_BPS,
+    SFP_LED_STAT_MODULE_PRESENT,
+    SFP_LED_STAT_RX_LOS,
+    SFP_LED_STAT_LINK_LED,
+    SFP_LED_STAT_ACTIVITY_LED,
+    SFP_LED_STAT_TEMPERATURE,   /* Millidegrees C, signed */
+    SFP_LED_STAT_VCC,           /* mV */
+    SFP_LED_STAT_TX_BIAS,       /* uA */
+    SFP_LED_STAT_TX_POWER,      /* nW */
+    SFP_LED_STAT_RX_POWER,      /* nW */
+    SFP_LED_N_STATS,
+} sfp_led_stat_t;
+
+/* Gauges under /sfp-led/ */
+typedef enum {
+    SFP_LED_RT_PROCESS_CALLS,
+    SFP_LED_RT_PROCESS_CLOCKS,
+    SFP_LED_RT_PROCESS_MAX_CLOCKS,
+    SFP_LED_RT_CALLBACK_CALLS,
+    SFP_LED_RT_CALLBACK_CLOCKS,
+    SFP_LED_RT_CALLBACK_MAX_CLOCKS,
+    SFP_LED_RT_MAIN_SYSCALLS,
+    SFP_LED_RT_IO_WAKEUPS,
+    SFP_LED_RT_IO_SYSCALLS,
+    SFP_LED_RT_IO_READ_ERRORS,
+    SFP_LED_RT_IO_WRITE_ERRORS,
+    SFP_LED_RT_IO_MAX_CLOCKS,
+    SFP_LED_RT_LINK_EVENTS,
+    SFP_LED_RT_LINK_LATENCY_CLOCKS,
+    SFP_LED_RT_LINK_MAX_LATENCY_CLOCKS,
+    SFP_LED_N_RT_STATS,
+} sfp_led_rt_stat_t;
+
+static char *sfp_led_rt_stat_names[SFP_LED_N_RT_STATS] = {
+    [SFP_LED_RT_PROCESS_CALLS] = "process_calls",
+    [SFP_LED_RT_PROCESS_CLOCKS] = "process_clocks",
+    [SFP_LED_RT_PROCESS_MAX_CLOCKS] = "process_max_clocks",
+    [SFP_LED_RT_CALLBACK_CALLS] = "callback_calls",
+    [SFP_LED_RT_CALLBACK_CLOCKS] = "callback_clocks",
+    [SFP_LED_RT_CALLBACK_MAX_CLOCKS] = "callback_max_clocks",
+    [SFP_LED_RT_MAIN_SYSCALLS] = "main_syscalls",
+    [SFP_LED_RT_IO_WAKEUPS] = "io_wakeups",
+    [SFP_LED_RT_IO_SYSCALLS] = "io_syscalls",
+    [SFP_LED_RT_IO_READ_ERRORS] = "io_read_errors",
+    [SFP_LED_RT_IO_WRITE_ERRORS] = "io_write_errors",
+    [SFP_LED_RT_IO_MAX_CLOCKS] = "io_max_clocks",
+    [SFP_LED_RT_LINK_EVENTS] = "link_events",
+    [SFP_LED_RT_LINK_LATENCY_CLOCKS] = "link_latency_clocks",
+    [SFP_LED_RT_LINK_MAX_LATENCY_CLOCKS] = "link_max_latency_clocks",
+};
+
+static char *sfp_led_stat_names[SFP_LED_N_STATS] = {
+    [SFP_LED_STAT_RX_PPS] = "rx_pps",
+    [SFP_LED_STAT_TX_PPS] = "tx_pps",
+    [SFP_LED_STAT_RX_BPS] = "rx_bps",
+    [SFP_LED_STAT_TX_BPS] = "tx_bps",
+    [SFP_LED_STAT_MODULE_PRESENT] = "module_present",
+    [SFP_LED_STAT_RX_LOS] = "rx_los",
+    [SFP_LED_STAT_LINK_LED] = "link_led",
+    [SFP_LED_STAT_ACTIVITY_LED] = "activity_led",
+    [SFP_LED_STAT_TEMPERATURE] = "temperature_mc",
+    [SFP_LED_STAT_VCC] = "vcc_mv",
+    [SFP_LED_STAT_TX_BIAS] = "tx_bias_ua",
+    [SFP_LED_STAT_TX_POWER] = "tx_power_nw",
+    [SFP_LED_STAT_RX_POWER] = "rx_power_nw",
+};
+
+typedef struct {
+    u32 port_index;
+    u8 op;
+    u8 value;
+} sfp_led_msg_t;
+
+/* What a module says about its diagnostics, read once per inserted module */
+typedef struct {
+    u8 known;
+    u8 ddm;                     /* Diagnostics implemented */
+    u8 external_cal;            /* Raw values need the A2h calibration constants */
+    f32 rx_pwr[5];              /* Rx_PWR(0) through Rx_PWR(4) */
+    f64 tx_i_slope, tx_i_offset;
+    f64 tx_pwr_slope, tx_pwr_offset;
+    f64 t_slope, t_offset;
+    f64 v_slope, v_offset;
+} sfp_led_dom_ident_t;
+
+typedef struct {
+    u8 valid;
+    f64 temp_c;
+    f64 vcc_v;
+    f64 tx_bias_ma;
+    f64 tx_power_mw;
+    f64 rx_power_mw;
+} sfp_led_dom_t;
+
+/* Main thread cost of one kind of work, in CPU clocks */
+typedef struct {
+    u64 calls;
+    u64 clocks;
+    u64 max_clocks;
+} sfp_led_cost_t;
+
+/* Written by the I/O thread only, the main thread reads it for display */
+typedef struct {
+    CLIB_CACHE_LINE_ALIGN_MARK(cacheline0);
+    u64 wakeups;
+    u64 syscalls;
+    u64 reads;
+    u64 writes;
+    u64 read_errors;
+    u64 write_errors;
+    u64 io_clocks;
+    u64 max_io_clocks;          /* Slowest single debugfs read or sysfs write */
+    u64 link_events;            /* Link LED writes with a callback behind them */
+    u64 link_latency_clocks;    /* Callback to written link LED, summed */
+    u64 link_max_latency_clocks;
+} sfp_led_io_stats_t;
+
+/*
+ * Lock-free ring with exactly one producer and one consumer thread. Head
+ * and tail sit on their own cache lines, each written by one side only.
+ */
+typedef struct {
+    CLIB_CACHE_LINE_ALIGN_MARK(cacheline0);
+    u32 head;
+    CLIB_CACHE_LINE_ALIGN_MARK(cacheline1);
+    u32 tail;
+    CLIB_CACHE_LINE_ALIGN_MARK(cacheline2);
+    sfp_led_msg_t msgs[SFP_LED_RING_SIZE];
+} sfp_led_ring_t;
 
 typedef struct {
     u8 *vpp_interface_name;
@@ -30,121 +262,212 @@ typedef struct {
     u8 *activity_led_path;
     u8 *sfp_debug_path;
     
+    /* Main thread only */
     u32 sw_if_index;
-    int link_led_fd;
-    int activity_led_fd;
-    int sfp_debug_fd;
+    u8 deleted;                 /* Waiting for the I/O thread, or free */
+    u8 resend;                  /* An LED command was dropped, in resend_ports */
+    u8 close_pending;           /* Deleted, CLOSE still to be queued */
+    u8 activity_mode;
     u8 last_link_state;
     u8 last_module_present;
+    u8 last_rx_los;
     u64 last_rx_packets;
     u64 last_tx_packets;
+    u64 last_rx_bytes;
+    u64 last_tx_bytes;
+    f64 last_sample_time;       /* 0 until the first sample sets the baseline */
+    f64 rx_pps, tx_pps, rx_bps, tx_bps;
+    u32 stats[SFP_LED_N_STATS]; /* Stats segment entries, ~0 until registered */
+    u16 dpdk_port_id;           /* ~0 when not a DPDK port, set before the I/O thread opens it */
+    sfp_led_dom_t dom;          /* Last diagnostics picked up */
+    f64 dom_time;
+    
+    /* Written by the I/O thread, read by the main thread under io_dom_seq */
+    u32 io_dom_seq;             /* Odd while io_dom is being written */
+    sfp_led_dom_t io_dom;
+    u8 link_led_state;
     u8 activity_led_state;
-    u8 activity_blink_countdown;
-    u8 skip_activity_monitoring;
+    u8 sampling;                /* Admin and link up with a module, activity is sampled */
+    u64 link_event_clock;       /* Callback behind the last queued link LED, 0 for none */
+    
+    /* Written by the I/O thread before OPENED, logged by the main thread */
+    int link_led_errno;
+    int activity_led_errno;
+    int sfp_debug_errno;
+    
+    /* I/O thread only */
+    int link_led_fd;
+    int activity_led_fd;
+    int sfp_debug_fd;
+    u8 io_open;
+    u8 io_sfp_state;            /* Last reported to the main thread */
+    u8 io_link_led;             /* Queued brightness, written on commit */
+    u8 io_activity_led;
+    u8 io_link_led_applied;     /* Last written brightness */
+    u8 io_activity_led_applied;
+    u8 io_dirty;
+    u8 io_pending_op;           /* OPENED or CLOSED that didn't fit in state_ring */
+    u64 io_link_event_clock;    /* Oldest event the link LED write is pending for */
+    u32 io_dirty_next;          /* Next port to commit, ~0 ends the list */
+    sfp_led_dom_ident_t io_dom_ident;
 } sfp_led_port_t;
 
+/* A port to add, the vectors are handed over to it */
+typedef struct {
+    u8 *link_led_path;
+    u8 *activity_led_path;
+    u8 *sfp_debug_path;
+    u8 *linux_interface_name;
+    u8 activity_mode;
+} sfp_led_port_args_t;
+
 typedef struct {
     sfp_led_port_t *ports;
+    u32 *free_ports;            /* Deleted slots the I/O thread is done with */
     vnet_main_t *vnet_main;
     u32 process_node_index;
-    u8 initialized;
+    u16 msg_id_base;
+    u8 *root;                   /* Prefix for every LED and debugfs path, for testing */
+    
+    sfp_led_ring_t *cmd_ring;       /* Main thread to I/O thread */
+    sfp_led_ring_t *state_ring;     /* I/O thread to main thread */
+    int io_eventfd;             /* Wakes the I/O thread */
+    int state_eventfd;          /* Wakes the main thread, through the file poller */
+    u32 state_file_index;
+    u32 *port_by_sw_if_index;   /* Port index, ~0 when not monitored */
+    u32 *sampled_ports;         /* Port indices with activity sampling on */
+    u32 *resend_ports;          /* Port indices with a dropped LED command */
+    vlib_counter_t *rx_sums;    /* Per sampled port, scratch for each tick */
+    vlib_counter_t *tx_sums;
+    pthread_t io_thread;
+    u8 io_running;
+    u8 io_kick;
+    u32 io_n_ports;             /* I/O thread only, slots it has opened so far */
+    u8 io_pending;              /* I/O thread only, some port has io_pending_op */
+    u64 cmd_drops;
+    
+    /* Runtime accounting */
+    sfp_led_cost_t process_cost;    /* Process node, per wakeup */
+    sfp_led_cost_t callback_cost;   /* Link/admin callbacks and state pickup */
+    u64 event_clock;            /* Start of the callback being handled, 0 outside one */
+    u64 main_syscalls;
+    u32 rt_stats[SFP_LED_N_RT_STATS];
+    sfp_led_io_stats_t io_stats;
+    
+    /* DPDK, looked up in dpdk_plugin.so as plugins can't link each other */
+    dpdk_main_t *dpdk_main;
+    typeof(rte_eth_dev_get_module_info) *get_module_info;
+    typeof(rte_eth_dev_get_module_eeprom) *get_module_eeprom;
 } sfp_led_main_t;
 
 sfp_led_main_t sfp_led_main;
 
-/* Cleanup function to turn off all LEDs */
-static void
-sfp_led_cleanup(void)
+static_always_inline int
+sfp_led_ring_push(sfp_led_ring_t *r, sfp_led_msg_t *msg)
 {
-    sfp_led_main_t *slm = &sfp_led_main;
+    u32 head = r->head;
     
-    sfp_led_port_t *port;
-    vec_foreach(port, slm->ports) {
-        if (port->link_led_fd >= 0) {
-            int fd = port->link_led_fd;
-            char buf[8];
-            int len = snprintf(buf, sizeof(buf), "%d\n", LED_OFF);
-            if (lseek(fd, 0, SEEK_SET) >= 0) {
-                write(fd, buf, len);
-            }
-            close(fd);
-        }
-        if (port->activity_led_fd >= 0) {
-            int fd = port->activity_led_fd;
-            char buf[8];
-            int len = snprintf(buf, sizeof(buf), "%d\n", LED_OFF);
-            if (lseek(fd, 0, SEEK_SET) >= 0) {
-                write(fd, buf, len);
-            }
-            close(fd);
-        }
-        if (port->sfp_debug_fd >= 0) {
-            close(port->sfp_debug_fd);
-        }
-    }
+    if (head - clib_atomic_load_acq_n(&r->tail) == SFP_LED_RING_SIZE)
+        return -1;
+    
+    r->msgs[head & (SFP_LED_RING_SIZE - 1)] = *msg;
+    clib_atomic_store_rel_n(&r->head, head + 1);
+    return 0;
 }
 
-/* Signal handler to cleanup on termination */
-static void
-sfp_led_signal_handler(int signum)
+static_always_inline int
+sfp_led_ring_pop(sfp_led_ring_t *r, sfp_led_msg_t *msg)
 {
-    sfp_led_cleanup();
-    signal(signum, SIG_DFL);
-    raise(signum);
+    u32 tail = r->tail;
+    
+    if (tail == clib_atomic_load_acq_n(&r->head))
+        return -1;
+    
+    *msg = r->msgs[tail & (SFP_LED_RING_SIZE - 1)];
+    clib_atomic_store_rel_n(&r->tail, tail + 1);
+    return 0;
 }
 
-static void setup_netdev_trigger(sfp_led_port_t *port);
-static clib_error_t *setup_sfp_port(sfp_led_port_t *port, vnet_main_t *vnm);
+/*
+ * Everything below down to the I/O thread loop runs on the I/O thread.
+ */
+
+static_always_inline void
+sfp_led_io_account(u64 start, u64 *count, u64 *errors, int failed)
+{
+    sfp_led_io_stats_t *st = &sfp_led_main.io_stats;
+    u64 clocks = clib_cpu_time_now() - start;
+    
+    st->syscalls++;
+    st->io_clocks += clocks;
+    if (clocks > st->max_io_clocks)
+        st->max_io_clocks = clocks;
+    (*count)++;
+    if (failed)
+        (*errors)++;
+}
 
 static int
 set_led_brightness(int fd, int brightness)
 {
+    sfp_led_io_stats_t *st = &sfp_led_main.io_stats;
     char buf[8];
-    int len;
+    int len, failed;
+    u64 start;
     
     if (fd < 0)
         return -1;
     
     len = snprintf(buf, sizeof(buf), "%d\n", brightness);
-    if (lseek(fd, 0, SEEK_SET) < 0)
-        return -1;
     
-    if (write(fd, buf, len) != len)
-        return -1;
+    start = clib_cpu_time_now();
+    failed = pwrite(fd, buf, len, 0) != len;
+    sfp_led_io_account(start, &st->writes, &st->write_errors, failed);
     
-    return 0;
+    return failed ? -1 : 0;
 }
 
-static int
-read_module_present(int fd)
+/* SFP state flags, a module that can't be read is absent with signal lost */
+static u8
+read_sfp_state(int fd)
 {
+    sfp_led_io_stats_t *st = &sfp_led_main.io_stats;
     char buf[512];
     int ret;
-    char *line, *saveptr;
+    char *line, *saveptr, *value;
+    u8 state = SFP_STATE_RX_LOS;
+    u64 start;
     
     if (fd < 0)
-        return 0;
+        return state;
     
-    if (lseek(fd, 0, SEEK_SET) < 0)
-        return 0;
-    
-    ret = read(fd, buf, sizeof(buf) - 1);
+    start = clib_cpu_time_now();
+    ret = pread(fd, buf, sizeof(buf) - 1, 0);
+    sfp_led_io_account(start, &st->reads, &st->read_errors, ret <= 0);
     if (ret <= 0)
-        return 0;
+        return state;
     
     buf[ret] = '\0';
     
     line = strtok_r(buf, "\n", &saveptr);
     while (line != NULL) {
-        if (strncmp(line, "moddef0:", 8) == 0) {
-            char *value = line + 8;
+        value = strchr(line, ':');
+        if (value) {
+            value++;
             while (*value == ' ') value++;
-            return (*value == '1');
+            
+            if (strncmp(line, "moddef0:", 8) == 0) {
+                if (*value == '1')
+                    state |= SFP_STATE_MODULE;
+            } else if (strncmp(line, "rx_los:", 7) == 0) {
+                if (*value == '0')
+                    state &= ~SFP_STATE_RX_LOS;
+            }
         }
         line = strtok_r(NULL, "\n", &saveptr);
     }
     
-    return 0;
+    return state;
 }
 
 static void
@@ -212,7 +535,9 @@ disable_netdev_trigger(sfp_led_port_t *port)
         return;
     
     int len = led_name - (char *)port->activity_led_path;
-    snprintf(path, sizeof(path), "%.*s/trigger", len, (char *)port->activity_led_path);
+    snprintf(path, sizeof(path), "%.*s%.*s/trigger",
+             vec_len(sfp_led_main.root), (char *)sfp_led_main.root,
+             len, (char *)port->activity_led_path);
     
     fd = open(path, O_WRONLY);
     if (fd >= 0) {
@@ -221,302 +546,1703 @@ disable_netdev_trigger(sfp_led_port_t *port)
     }
 }
 
-static clib_error_t *
-sfp_led_link_change(vnet_main_t *vnm, u32 hw_if_index, u32 flags)
+/* Wake the main thread, it picks up state_ring from its file poller */
+static void
+sfp_led_io_notify(sfp_led_main_t *slm)
+{
+    u64 one = 1;
+    
+    slm->io_stats.syscalls++;
+    write(slm->state_eventfd, &one, sizeof(one));
+}
+
+/* Paths are built on the stack, this thread stays off the VPP heap */
+static int
+sfp_led_open_path(u8 *path_vec, int flags)
 {
     sfp_led_main_t *slm = &sfp_led_main;
-    vnet_hw_interface_t *hi = vnet_get_hw_interface(vnm, hw_if_index);
-    u32 sw_if_index = hi->sw_if_index;
+    char path[256];
     
-    if (!slm->initialized && vec_len(slm->ports) > 0) {
-        slm->initialized = 1;
-        
-        sfp_led_port_t *p;
-        vec_foreach(p, slm->ports) {
-            clib_error_t *error = setup_sfp_port(p, vnm);
-            if (error) {
-                clib_warning("Failed to setup SFP LED port: %s", error->what);
-                clib_error_free(error);
-            }
-        }
-    }
+    snprintf(path, sizeof(path), "%.*s%.*s", vec_len(slm->root), (char *)slm->root,
+             vec_len(path_vec), (char *)path_vec);
+    return open(path, flags | O_CLOEXEC);
+}
+
+/*
+ * OPENED and CLOSED must reach the main thread, a port without them is
+ * never brought up or its slot never reused. What doesn't fit in the ring
+ * is retried from the I/O thread loop rather than waited for here, the
+ * main thread may be waiting for this thread at the same time.
+ */
+static void
+sfp_led_io_report(sfp_led_main_t *slm, u32 port_index, u8 op)
+{
+    sfp_led_port_t *port = vec_elt_at_index(slm->ports, port_index);
+    sfp_led_msg_t msg = { .port_index = port_index, .op = op };
     
-    sfp_led_port_t *port;
-    vec_foreach(port, slm->ports) {
-        if (port->sw_if_index == sw_if_index) {
-            u8 link_up = (flags & VNET_HW_INTERFACE_FLAG_LINK_UP) != 0;
-            u8 module_present = read_module_present(port->sfp_debug_fd);
-            
-            vnet_sw_interface_t *si = vnet_get_sw_interface(vnm, sw_if_index);
-            u8 admin_up = (si->flags & VNET_SW_INTERFACE_FLAG_ADMIN_UP) != 0;
-            
-            if (module_present && admin_up && link_up) {
-                set_led_brightness(port->link_led_fd, LED_MAX);
-                clib_warning("%v: link up", port->vpp_interface_name);
-            } else {
-                set_led_brightness(port->link_led_fd, LED_OFF);
-                if (module_present) {
-                    clib_warning("%v: link down", port->vpp_interface_name);
-                }
-            }
-            
-            port->last_link_state = link_up;
-            break;
-        }
-    }
+    if (op == SFP_LED_OP_OPENED)
+        msg.value = port->io_sfp_state;
     
-    return 0;
+    if (sfp_led_ring_push(slm->state_ring, &msg) == 0) {
+        sfp_led_io_notify(slm);
+    } else {
+        port->io_pending_op = op;
+        slm->io_pending = 1;
+    }
 }
 
-VNET_HW_INTERFACE_LINK_UP_DOWN_FUNCTION(sfp_led_link_change);
-
-static clib_error_t *
-sfp_led_admin_change(vnet_main_t *vnm, u32 sw_if_index, u32 flags)
+static void
+sfp_led_io_open_port(sfp_led_main_t *slm, u32 port_index)
 {
-    sfp_led_main_t *slm = &sfp_led_main;
+    sfp_led_port_t *port = vec_elt_at_index(slm->ports, port_index);
     
-    if (!slm->initialized) {
-        return 0;
+    if (port->io_open)
+        return;
+    
+    slm->io_n_ports = clib_max(slm->io_n_ports, port_index + 1);
+    port->link_led_fd = -1;
+    port->activity_led_fd = -1;
+    port->sfp_debug_fd = -1;
+    port->io_dirty = 0;
+    port->io_pending_op = 0;
+    port->io_link_event_clock = 0;
+    port->io_dom_ident.known = 0;
+    port->link_led_errno = 0;
+    port->activity_led_errno = 0;
+    port->sfp_debug_errno = 0;
+    
+    if (port->link_led_path) {
+        port->link_led_fd = sfp_led_open_path(port->link_led_path, O_WRONLY);
+        if (port->link_led_fd < 0)
+            port->link_led_errno = errno;
     }
     
-    sfp_led_port_t *port;
-    vec_foreach(port, slm->ports) {
-        if (port->sw_if_index == sw_if_index) {
-            u8 module_present = read_module_present(port->sfp_debug_fd);
-            u8 admin_up = (flags & VNET_SW_INTERFACE_FLAG_ADMIN_UP) != 0;
-            
-            vnet_hw_interface_t *hi = vnet_get_sup_hw_interface(vnm, sw_if_index);
-            u8 link_up = (hi->flags & VNET_HW_INTERFACE_FLAG_LINK_UP) != 0;
-            
-            if (module_present && admin_up && link_up) {
-                set_led_brightness(port->link_led_fd, LED_MAX);
-            } else {
-                set_led_brightness(port->link_led_fd, LED_OFF);
-            }
-            
-            break;
-        }
+    if (port->activity_led_path) {
+        port->activity_led_fd = sfp_led_open_path(port->activity_led_path, O_WRONLY);
+        if (port->activity_led_fd < 0)
+            port->activity_led_errno = errno;
     }
     
-    return 0;
+    if (port->sfp_debug_path) {
+        port->sfp_debug_fd = sfp_led_open_path(port->sfp_debug_path, O_RDONLY);
+        if (port->sfp_debug_fd < 0)
+            port->sfp_debug_errno = errno;
+    }
+    
+    set_led_brightness(port->link_led_fd, LED_OFF);
+    set_led_brightness(port->activity_led_fd, LED_OFF);
+    port->io_link_led = port->io_link_led_applied = LED_OFF;
+    port->io_activity_led = port->io_activity_led_applied = LED_OFF;
+    
+    port->io_open = 1;
+    port->io_sfp_state = read_sfp_state(port->sfp_debug_fd);
+    sfp_led_io_report(slm, port_index, SFP_LED_OP_OPENED);
 }
 
-VNET_SW_INTERFACE_ADMIN_UP_DOWN_FUNCTION(sfp_led_admin_change);
+static void
+sfp_led_io_close_port(sfp_led_port_t *port)
+{
+    if (!port->io_open)
+        return;
+    
+    set_led_brightness(port->link_led_fd, LED_OFF);
+    set_led_brightness(port->activity_led_fd, LED_OFF);
+    
+    if (port->link_led_fd >= 0)
+        close(port->link_led_fd);
+    if (port->activity_led_fd >= 0)
+        close(port->activity_led_fd);
+    if (port->sfp_debug_fd >= 0)
+        close(port->sfp_debug_fd);
+    
+    port->link_led_fd = -1;
+    port->activity_led_fd = -1;
+    port->sfp_debug_fd = -1;
+    port->io_open = 0;
+    port->io_dom_ident.known = 0;
+}
 
-static uword
-sfp_led_process(vlib_main_t *vm, vlib_node_runtime_t *rt, vlib_frame_t *f)
+/* Retry what didn't fit in state_ring, the main thread is draining it */
+static void
+sfp_led_io_flush_pending(sfp_led_main_t *slm)
 {
-    sfp_led_main_t *slm = &sfp_led_main;
-    u32 poll_count = 0;
+    sfp_led_port_t *port;
+    u8 op;
     
-    while (1) {
-        vlib_process_wait_for_event_or_clock(vm, POLL_INTERVAL_SEC);
-        poll_count++;
+    if (!slm->io_pending)
+        return;
+    
+    slm->io_pending = 0;
+    for (port = slm->ports; port < slm->ports + slm->io_n_ports; port++) {
+        if (!(op = port->io_pending_op))
+            continue;
+        port->io_pending_op = 0;
+        sfp_led_io_report(slm, port - slm->ports, op);
+    }
+}
+
+/* Report state changes only, a full ring is retried on the next poll */
+static void
+sfp_led_io_poll_modules(sfp_led_main_t *slm)
+{
+    sfp_led_port_t *port;
+    sfp_led_msg_t msg = { .op = SFP_LED_OP_SFP_STATE };
+    u8 sfp_state;
+    
+    for (port = slm->ports; port < slm->ports + slm->io_n_ports; port++) {
+        if (!port->io_open || port->sfp_debug_fd < 0)
+            continue;
         
-        sfp_led_port_t *port;
-        vec_foreach(port, slm->ports) {
-            u8 module_present = read_module_present(port->sfp_debug_fd);
-            
-            if (poll_count % 20 == 0) {
-                if (module_present != port->last_module_present) {
-                    if (!module_present) {
-                        disable_netdev_trigger(port);
-                        set_led_brightness(port->link_led_fd, LED_OFF);
-                        set_led_brightness(port->activity_led_fd, LED_OFF);
-                        port->activity_led_state = 0;
-                        clib_warning("%v: SFP module removed", port->vpp_interface_name);
-                    } else {
-                        clib_warning("%v: SFP module inserted", port->vpp_interface_name);
-                        
-                        port->last_rx_packets = 0;
-                        port->last_tx_packets = 0;
-                        port->activity_led_state = 0;
-                    }
-                    
-                    port->last_module_present = module_present;
-                }
-            }
-            
-            if (module_present && port->sw_if_index != ~0) {
-                vnet_sw_interface_t *si = 
-                    vnet_get_sw_interface(slm->vnet_main, port->sw_if_index);
-                vnet_hw_interface_t *hi = 
-                    vnet_get_sup_hw_interface(slm->vnet_main, port->sw_if_index);
-                
-                u8 admin_up = (si->flags & VNET_SW_INTERFACE_FLAG_ADMIN_UP) != 0;
-                u8 link_up = (hi->flags & VNET_HW_INTERFACE_FLAG_LINK_UP) != 0;
-                
-                if (admin_up && link_up) {
-                    vlib_combined_counter_main_t *rxc = 
-                        &slm->vnet_main->interface_main.combined_sw_if_counters[VNET_INTERFACE_COUNTER_RX];
-                    vlib_combined_counter_main_t *txc = 
-                        &slm->vnet_main->interface_main.combined_sw_if_counters[VNET_INTERFACE_COUNTER_TX];
-                    
-                    vlib_counter_t rx, tx;
-                    vlib_get_combined_counter(rxc, port->sw_if_index, &rx);
-                    vlib_get_combined_counter(txc, port->sw_if_index, &tx);
-                    
-                    u64 rx_packets = rx.packets;
-                    u64 tx_packets = tx.packets;
-                    
-                    if (rx_packets != port->last_rx_packets || tx_packets != port->last_tx_packets) {
-                        if (port->activity_led_state) {
-                            set_led_brightness(port->activity_led_fd, LED_OFF);
-                            port->activity_led_state = 0;
-                        } else {
-                            set_led_brightness(port->activity_led_fd, LED_MAX);
-                            port->activity_led_state = 1;
-                        }
-                    } else {
-                        if (port->activity_led_state) {
-                            set_led_brightness(port->activity_led_fd, LED_OFF);
-                            port->activity_led_state = 0;
-                        }
-                    }
-                    
-                    port->last_rx_packets = rx_packets;
-                    port->last_tx_packets = tx_packets;
-                } else {
-                    set_led_brightness(port->activity_led_fd, LED_MAX);
-                    port->activity_led_state = 1;
-                    port->last_rx_packets = 0;
-                    port->last_tx_packets = 0;
-                }
-            } else {
-                if (port->activity_led_state) {
-                    set_led_brightness(port->activity_led_fd, LED_OFF);
-                    port->activity_led_state = 0;
-                }
-            }
+        sfp_state = read_sfp_state(port->sfp_debug_fd);
+        if (sfp_state == port->io_sfp_state)
+            continue;
+        
+        msg.port_index = port - slm->ports;
+        msg.value = sfp_state;
+        if (sfp_led_ring_push(slm->state_ring, &msg) == 0) {
+            port->io_sfp_state = sfp_state;
+            sfp_led_io_notify(slm);
         }
     }
+}
+
+/*
+ * How long a link change took from its callback to the LED. Both ends use
+ * the CPU clock, which is invariant and synchronized across cores on the
+ * platforms VPP runs on.
+ */
+static void
+sfp_led_io_link_latency(sfp_led_main_t *slm, u64 event_clock)
+{
+    sfp_led_io_stats_t *st = &slm->io_stats;
+    u64 clocks = clib_cpu_time_now() - event_clock;
     
-    return 0;
+    st->link_events++;
+    st->link_latency_clocks += clocks;
+    if (clocks > st->link_max_latency_clocks)
+        st->link_max_latency_clocks = clocks;
 }
 
-VLIB_REGISTER_NODE(sfp_led_process_node) = {
-    .function = sfp_led_process,
-    .type = VLIB_NODE_TYPE_PROCESS,
-    .name = "sfp-led-process",
-};
+static_always_inline void
+sfp_led_io_mark_dirty(sfp_led_port_t *port, u32 port_index, u32 *dirty)
+{
+    if (port->io_dirty)
+        return;
+    
+    port->io_dirty = 1;
+    port->io_dirty_next = *dirty;
+    *dirty = port_index;
+}
 
-static clib_error_t *
-sfp_led_config(vlib_main_t *vm, unformat_input_t *input)
+/*
+ * Write the LEDs changed since the last commit, once each. A blink queued
+ * on and off again within one wakeup costs no write at all.
+ */
+static u32
+sfp_led_io_commit(sfp_led_main_t *slm, u32 dirty)
 {
-    sfp_led_main_t *slm = &sfp_led_main;
-    sfp_led_port_t *port = NULL;
-    u8 *interface_name = NULL;
+    sfp_led_port_t *port;
     
-    while (unformat_check_input(input) != UNFORMAT_END_OF_INPUT) {
-        if (unformat(input, "interface %v", &interface_name)) {
-            vec_add2(slm->ports, port, 1);
-            memset(port, 0, sizeof(*port));
-            port->vpp_interface_name = interface_name;
-            port->link_led_fd = -1;
-            port->activity_led_fd = -1;
-            port->sfp_debug_fd = -1;
-            port->sw_if_index = ~0;
-            interface_name = NULL;
-        }
-        else if (port && unformat(input, "linux-interface %v", &port->linux_interface_name))
-            ;
-        else if (port && unformat(input, "link-led %v", &port->link_led_path))
-            ;
-        else if (port && unformat(input, "activity-led %v", &port->activity_led_path))
-            ;
-        else if (port && unformat(input, "sfp-debug %v", &port->sfp_debug_path))
-            ;
-        else {
-            return clib_error_return(0, "unknown input `%U'",
-                                   format_unformat_error, input);
+    while (dirty != ~0) {
+        port = vec_elt_at_index(slm->ports, dirty);
+        dirty = port->io_dirty_next;
+        port->io_dirty = 0;
+        
+        if (port->io_link_led != port->io_link_led_applied &&
+            set_led_brightness(port->link_led_fd, port->io_link_led) == 0) {
+            port->io_link_led_applied = port->io_link_led;
+            if (port->io_link_event_clock)
+                sfp_led_io_link_latency(slm, port->io_link_event_clock);
         }
+        port->io_link_event_clock = 0;
+        
+        if (port->io_activity_led != port->io_activity_led_applied &&
+            set_led_brightness(port->activity_led_fd, port->io_activity_led) == 0)
+            port->io_activity_led_applied = port->io_activity_led;
     }
     
-    return 0;
+    return ~0;
 }
 
-VLIB_CONFIG_FUNCTION(sfp_led_config, "sfp-led");
+static u16
+sfp_led_be16(const u8 *p)
+{
+    return (u16)(p[0] << 8 | p[1]);
+}
 
-static clib_error_t *
-setup_sfp_port(sfp_led_port_t *port, vnet_main_t *vnm)
+static f32
+sfp_led_be_float(const u8 *p)
 {
-    char *ifname_cstr = (char *)format(0, "%v%c", port->vpp_interface_name, 0);
-    
-    u32 sw_if_index = ~0;
+    u32 v = (u32)p[0] << 24 | (u32)p[1] << 16 | (u32)p[2] << 8 | p[3];
+    f32 f;
     
-    unformat_input_t input;
-    unformat_init_string(&input, ifname_cstr, strlen(ifname_cstr));
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+static int
+sfp_led_io_read_eeprom(sfp_led_main_t *slm, sfp_led_port_t *port, u32 offset, u8 *buf, u32 len)
+{
+    struct rte_dev_eeprom_info info = { .data = buf, .offset = offset, .length = len };
+    u64 start = clib_cpu_time_now();
+    int ret;
     
-    if (!unformat_user(&input, unformat_vnet_sw_interface, vnm, &sw_if_index)) {
-        unformat_free(&input);
-        vec_free(ifname_cstr);
-        return clib_error_return(0, "Interface %v not found",
-                                port->vpp_interface_name);
-    }
-    unformat_free(&input);
-    vec_free(ifname_cstr);
+    ret = slm->get_module_eeprom(port->dpdk_port_id, &info);
+    sfp_led_io_account(start, &slm->io_stats.reads, &slm->io_stats.read_errors, ret != 0);
+    return ret;
+}
+
+static int
+sfp_led_io_read_dom_ident(sfp_led_main_t *slm, sfp_led_port_t *port)
+{
+    sfp_led_dom_ident_t *id = &port->io_dom_ident;
+    struct rte_eth_dev_module_info modinfo = { 0 };
+    u8 buf[SFF8472_CAL_CONSTANTS_LEN];
+    int i, ret;
     
-    port->sw_if_index = sw_if_index;
+    memset(id, 0, sizeof(*id));
+    ret = slm->get_module_info(port->dpdk_port_id, &modinfo);
+    if (ret)
+        return ret;
     
-    if (port->link_led_path) {
-        char *path = (char *)format(0, "%v%c", port->link_led_path, 0);
-        port->link_led_fd = open(path, O_WRONLY);
-        vec_free(path);
-        if (port->link_led_fd < 0) {
-            return clib_error_return(0, "Failed to open %v: %s",
-                                   port->link_led_path, strerror(errno));
-        }
+    /* SFF-8079 modules only have the A0h page */
+    if (modinfo.type != RTE_ETH_MODULE_SFF_8472 ||
+        modinfo.eeprom_len < RTE_ETH_MODULE_SFF_8472_LEN) {
+        id->known = 1;
+        return 0;
     }
     
-    if (port->activity_led_path) {
-        char *path = (char *)format(0, "%v%c", port->activity_led_path, 0);
-        port->activity_led_fd = open(path, O_WRONLY);
-        vec_free(path);
-        if (port->activity_led_fd < 0) {
-            return clib_error_return(0, "Failed to open %v: %s",
-                                   port->activity_led_path, strerror(errno));
-        }
+    ret = sfp_led_io_read_eeprom(slm, port, SFF8472_DIAG_TYPE, buf, 1);
+    if (ret)
+        return ret;
+    id->ddm = (buf[0] & SFF8472_DIAG_IMPLEMENTED) != 0;
+    id->external_cal = (buf[0] & SFF8472_DIAG_EXTERNAL_CAL) != 0;
+    
+    if (id->ddm && id->external_cal) {
+        ret = sfp_led_io_read_eeprom(slm, port, SFF8472_A2_BASE + SFF8472_CAL_CONSTANTS,
+                                     buf, SFF8472_CAL_CONSTANTS_LEN);
+        if (ret)
+            return ret;
+        
+        /* Stored highest order first, slopes are unsigned 8.8 fixed point */
+        for (i = 0; i < 5; i++)
+            id->rx_pwr[4 - i] = sfp_led_be_float(buf + i * 4);
+        id->tx_i_slope = sfp_led_be16(buf + 20) / 256.0;
+        id->tx_i_offset = (i16)sfp_led_be16(buf + 22);
+        id->tx_pwr_slope = sfp_led_be16(buf + 24) / 256.0;
+        id->tx_pwr_offset = (i16)sfp_led_be16(buf + 26);
+        id->t_slope = sfp_led_be16(buf + 28) / 256.0;
+        id->t_offset = (i16)sfp_led_be16(buf + 30);
+        id->v_slope = sfp_led_be16(buf + 32) / 256.0;
+        id->v_offset = (i16)sfp_led_be16(buf + 34);
     }
     
-    if (port->sfp_debug_path) {
-        char *path = (char *)format(0, "%v%c", port->sfp_debug_path, 0);
-        port->sfp_debug_fd = open(path, O_RDONLY);
-        vec_free(path);
-        if (port->sfp_debug_fd < 0) {
-            clib_warning("Failed to open %v: %s (module detection disabled)",
-                       port->sfp_debug_path, strerror(errno));
+    id->known = 1;
+    return 0;
+}
+
+static void
+sfp_led_io_read_dom(sfp_led_main_t *slm, sfp_led_port_t *port, sfp_led_dom_t *r)
+{
+    sfp_led_dom_ident_t *id = &port->io_dom_ident;
+    u8 buf[SFF8472_DIAG_VALUES_LEN];
+    f64 temp, vcc, bias, tx, rx;
+    
+    memset(r, 0, sizeof(*r));
+    
+    if (!id->known && sfp_led_io_read_dom_ident(slm, port))
+        return;
+    
+    if (!id->ddm ||
+        sfp_led_io_read_eeprom(slm, port, SFF8472_A2_BASE + SFF8472_DIAG_VALUES,
+                               buf, SFF8472_DIAG_VALUES_LEN))
+        return;
+    
+    temp = (i16)sfp_led_be16(buf);
+    vcc = sfp_led_be16(buf + 2);
+    bias = sfp_led_be16(buf + 4);
+    tx = sfp_led_be16(buf + 6);
+    rx = sfp_led_be16(buf + 8);
+    
+    if (id->external_cal) {
+        temp = id->t_slope * temp + id->t_offset;
+        vcc = id->v_slope * vcc + id->v_offset;
+        bias = id->tx_i_slope * bias + id->tx_i_offset;
+        tx = id->tx_pwr_slope * tx + id->tx_pwr_offset;
+        rx = (((id->rx_pwr[4] * rx + id->rx_pwr[3]) * rx + id->rx_pwr[2]) * rx +
+              id->rx_pwr[1]) * rx + id->rx_pwr[0];
+    }
+    
+    /* SFF-8472 units: 1/256 C, 100 uV, 2 uA and 0.1 uW */
+    r->temp_c = temp / 256.0;
+    r->vcc_v = vcc * 100e-6;
+    r->tx_bias_ma = bias * 2e-3;
+    r->tx_power_mw = tx * 1e-4;
+    r->rx_power_mw = rx * 1e-4;
+    r->valid = 1;
+}
+
+/*
+ * Module EEPROM reads go over the SFP I2C bus and take milliseconds each,
+ * so like debugfs they stay on this thread. Readings are handed over
+ * through a per-port sequence count, a message tells the main thread.
+ */
+static void
+sfp_led_io_poll_dom(sfp_led_main_t *slm)
+{
+    sfp_led_port_t *port;
+    sfp_led_msg_t msg = { .op = SFP_LED_OP_DOM };
+    sfp_led_dom_t dom;
+    
+    for (port = slm->ports; port < slm->ports + slm->io_n_ports; port++) {
+        if (!port->io_open || port->dpdk_port_id == (u16)~0)
+            continue;
+        
+        if (!(port->io_sfp_state & SFP_STATE_MODULE)) {
+            /* Whatever goes in next is identified afresh */
+            port->io_dom_ident.known = 0;
+            if (!port->io_dom.valid)
+                continue;
+            memset(&dom, 0, sizeof(dom));
+        } else {
+            sfp_led_io_read_dom(slm, port, &dom);
+        }
+        
+        clib_atomic_store_relax_n(&port->io_dom_seq, port->io_dom_seq + 1);
+        CLIB_MEMORY_STORE_BARRIER();
+        port->io_dom = dom;
+        clib_atomic_store_rel_n(&port->io_dom_seq, port->io_dom_seq + 1);
+        
+        msg.port_index = port - slm->ports;
+        if (sfp_led_ring_push(slm->state_ring, &msg) == 0)
+            sfp_led_io_notify(slm);
+    }
+}
+
+static u64
+sfp_led_io_now_ms(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *
+sfp_led_io_thread_fn(void *arg)
+{
+    sfp_led_main_t *slm = arg;
+    struct pollfd pfd = { .fd = slm->io_eventfd, .events = POLLIN };
+    sfp_led_port_t *port;
+    sfp_led_msg_t msg;
+    u64 now, next_poll = 0, count;
+    u64 next_dom_poll = slm->get_module_eeprom ? 0 : ~0ULL;
+    u64 next_publish = 0;
+    u32 dirty = ~0;
+    int timeout;
+    
+    while (1) {
+        now = sfp_led_io_now_ms();
+        if (now >= next_poll) {
+            sfp_led_io_poll_modules(slm);
+            next_poll = now + MODULE_POLL_MSEC;
+        }
+        if (now >= next_dom_poll) {
+            sfp_led_io_poll_dom(slm);
+            next_dom_poll = now + DOM_POLL_MSEC;
+        }
+        /* The process node may sleep for good, keep the I/O gauges current */
+        if (now >= next_publish) {
+            sfp_led_io_notify(slm);
+            next_publish = now + RUNTIME_PUBLISH_MSEC;
+        }
+        
+        timeout = slm->io_pending ? 1 : 
+            clib_min(clib_min(next_poll, next_dom_poll), next_publish) - now;
+        if (poll(&pfd, 1, timeout) > 0) {
+            read(slm->io_eventfd, &count, sizeof(count));
+            slm->io_stats.syscalls++;
+        }
+        slm->io_stats.syscalls++;
+        slm->io_stats.wakeups++;
+        
+        while (sfp_led_ring_pop(slm->cmd_ring, &msg) == 0) {
+            port = vec_elt_at_index(slm->ports, msg.port_index);
+            
+            switch (msg.op) {
+            case SFP_LED_OP_OPEN:
+                sfp_led_io_open_port(slm, msg.port_index);
+                break;
+            case SFP_LED_OP_LINK_LED:
+                port->io_link_led = msg.value;
+                if (!port->io_link_event_clock)
+                    port->io_link_event_clock = 
+                        clib_atomic_load_relax_n(&port->link_event_clock);
+                sfp_led_io_mark_dirty(port, msg.port_index, &dirty);
+                break;
+            case SFP_LED_OP_ACTIVITY_LED:
+                port->io_activity_led = msg.value;
+                sfp_led_io_mark_dirty(port, msg.port_index, &dirty);
+                break;
+            case SFP_LED_OP_TRIGGER_NONE:
+                disable_netdev_trigger(port);
+                break;
+            case SFP_LED_OP_CLOSE:
+                /* Off the dirty list before the main thread may reuse the slot */
+                dirty = sfp_led_io_commit(slm, dirty);
+                sfp_led_io_close_port(port);
+                port->io_pending_op = 0;
+                sfp_led_io_report(slm, msg.port_index, SFP_LED_OP_CLOSED);
+                break;
+            case SFP_LED_OP_SHUTDOWN:
+                for (port = slm->ports; port < slm->ports + slm->io_n_ports; port++)
+                    sfp_led_io_close_port(port);
+                return 0;
+            }
+        }
+        
+        dirty = sfp_led_io_commit(slm, dirty);
+        sfp_led_io_flush_pending(slm);
+    }
+    
+    return 0;
+}
+
+/*
+ * Main thread side.
+ */
+
+static int
+sfp_led_send(sfp_led_port_t *port, u8 op, u8 value)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    sfp_led_msg_t msg = { .port_index = port - slm->ports, .op = op, .value = value };
+    
+    if (!slm->io_running || sfp_led_ring_push(slm->cmd_ring, &msg) < 0) {
+        slm->cmd_drops++;
+        return -1;
+    }
+    
+    slm->io_kick = 1;
+    return 0;
+}
+
+/* Wake the I/O thread once for everything queued since the last kick */
+static void
+sfp_led_kick(sfp_led_main_t *slm)
+{
+    u64 one = 1;
+    
+    if (!slm->io_kick)
+        return;
+    
+    slm->io_kick = 0;
+    slm->main_syscalls++;
+    write(slm->io_eventfd, &one, sizeof(one));
+}
+
+static_always_inline void
+sfp_led_cost_add(sfp_led_cost_t *cost, u64 start)
+{
+    u64 clocks = clib_cpu_time_now() - start;
+    
+    cost->calls++;
+    cost->clocks += clocks;
+    if (clocks > cost->max_clocks)
+        cost->max_clocks = clocks;
+}
+
+static void
+sfp_led_stats_register(sfp_led_port_t *port)
+{
+    int i;
+    
+    for (i = 0; i < SFP_LED_N_STATS; i++) {
+        if (port->stats[i] == ~0)
+            port->stats[i] = vlib_stats_add_gauge("/sfp/%v/%s", port->vpp_interface_name,
+                                                  sfp_led_stat_names[i]);
+    }
+}
+
+static void
+sfp_led_stats_unregister(sfp_led_port_t *port)
+{
+    int i;
+    
+    for (i = 0; i < SFP_LED_N_STATS; i++) {
+        if (port->stats[i] != ~0)
+            vlib_stats_remove_entry(port->stats[i]);
+        port->stats[i] = ~0;
+    }
+}
+
+static_always_inline void
+sfp_led_stat_set(sfp_led_port_t *port, sfp_led_stat_t stat, u64 value)
+{
+    if (port->stats[stat] != ~0)
+        vlib_stats_set_gauge(port->stats[stat], value);
+}
+
+/* The process node works out the LEDs again, see sfp_led_resend() */
+static void
+sfp_led_resend_later(sfp_led_port_t *port)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    
+    if (port->resend)
+        return;
+    
+    port->resend = 1;
+    vec_add1(slm->resend_ports, port - slm->ports);
+}
+
+/* Only changes are queued, a dropped command is retried by the process node */
+static void
+sfp_led_set_link(sfp_led_port_t *port, u8 on)
+{
+    if (port->link_led_state == on)
+        return;
+    
+    clib_atomic_store_relax_n(&port->link_event_clock, sfp_led_main.event_clock);
+    if (sfp_led_send(port, SFP_LED_OP_LINK_LED, on ? LED_MAX : LED_OFF) == 0) {
+        port->link_led_state = on;
+        sfp_led_stat_set(port, SFP_LED_STAT_LINK_LED, on);
+    } else {
+        sfp_led_resend_later(port);
+    }
+}
+
+static void
+sfp_led_set_activity(sfp_led_port_t *port, u8 on)
+{
+    if (port->activity_led_state == on)
+        return;
+    
+    if (sfp_led_send(port, SFP_LED_OP_ACTIVITY_LED, on ? LED_MAX : LED_OFF) == 0) {
+        port->activity_led_state = on;
+        sfp_led_stat_set(port, SFP_LED_STAT_ACTIVITY_LED, on);
+    } else {
+        sfp_led_resend_later(port);
+    }
+}
+
+static void
+sfp_led_update_link_led(vnet_main_t *vnm, sfp_led_port_t *port)
+{
+    if (port->sw_if_index == ~0)
+        return;
+    
+    vnet_sw_interface_t *si = vnet_get_sw_interface(vnm, port->sw_if_index);
+    vnet_hw_interface_t *hi = vnet_get_sup_hw_interface(vnm, port->sw_if_index);
+    u8 admin_up = (si->flags & VNET_SW_INTERFACE_FLAG_ADMIN_UP) != 0;
+    u8 link_up = (hi->flags & VNET_HW_INTERFACE_FLAG_LINK_UP) != 0;
+    
+    sfp_led_set_link(port, port->last_module_present && admin_up && link_up);
+}
+
+static_always_inline sfp_led_port_t *
+sfp_led_port_by_sw_if_index(sfp_led_main_t *slm, u32 sw_if_index)
+{
+    u32 *port_index;
+    
+    if (sw_if_index >= vec_len(slm->port_by_sw_if_index))
+        return 0;
+    
+    port_index = vec_elt_at_index(slm->port_by_sw_if_index, sw_if_index);
+    return *port_index == ~0 ? 0 : vec_elt_at_index(slm->ports, *port_index);
+}
+
+/* The process node re-evaluates the port and decides whether to sample it */
+static void
+sfp_led_port_changed(sfp_led_main_t *slm, sfp_led_port_t *port)
+{
+    vlib_process_signal_event(vlib_get_main(), slm->process_node_index,
+                              SFP_LED_EVENT_PORT_CHANGED, port - slm->ports);
+}
+
+static void
+sfp_led_module_changed(sfp_led_main_t *slm, sfp_led_port_t *port, u8 module_present)
+{
+    if (module_present == port->last_module_present)
+        return;
+    
+    port->last_module_present = module_present;
+    
+    if (!module_present) {
+        sfp_led_send(port, SFP_LED_OP_TRIGGER_NONE, 0);
+        sfp_led_set_link(port, 0);
+        sfp_led_set_activity(port, 0);
+        clib_warning("%v: SFP module removed", port->vpp_interface_name);
+    } else {
+        clib_warning("%v: SFP module inserted", port->vpp_interface_name);
+        
+        port->last_rx_packets = 0;
+        port->last_tx_packets = 0;
+        sfp_led_update_link_led(slm->vnet_main, port);
+    }
+}
+
+static_always_inline u64
+sfp_led_dom_scale(f64 value, f64 scale)
+{
+    /* Cast through i64 so negative temperatures read back as signed */
+    return (u64)(i64)(value * scale);
+}
+
+/* Copy the I/O thread's last reading, retrying while it is being written */
+static void
+sfp_led_dom_pickup(sfp_led_port_t *port)
+{
+    sfp_led_dom_t *dom = &port->dom;
+    u32 seq;
+    
+    do {
+        seq = clib_atomic_load_acq_n(&port->io_dom_seq);
+        *dom = port->io_dom;
+        CLIB_MEMORY_BARRIER();
+    } while ((seq & 1) || seq != clib_atomic_load_relax_n(&port->io_dom_seq));
+    
+    port->dom_time = vlib_time_now(vlib_get_main());
+    
+    sfp_led_stat_set(port, SFP_LED_STAT_TEMPERATURE, sfp_led_dom_scale(dom->temp_c, 1e3));
+    sfp_led_stat_set(port, SFP_LED_STAT_VCC, sfp_led_dom_scale(dom->vcc_v, 1e3));
+    sfp_led_stat_set(port, SFP_LED_STAT_TX_BIAS, sfp_led_dom_scale(dom->tx_bias_ma, 1e3));
+    sfp_led_stat_set(port, SFP_LED_STAT_TX_POWER, sfp_led_dom_scale(dom->tx_power_mw, 1e6));
+    sfp_led_stat_set(port, SFP_LED_STAT_RX_POWER, sfp_led_dom_scale(dom->rx_power_mw, 1e6));
+}
+
+/* The I/O thread has closed the port's files, nothing refers to it anymore */
+static void
+sfp_led_port_free(sfp_led_main_t *slm, sfp_led_port_t *port)
+{
+    vec_free(port->vpp_interface_name);
+    vec_free(port->linux_interface_name);
+    vec_free(port->link_led_path);
+    vec_free(port->activity_led_path);
+    vec_free(port->sfp_debug_path);
+    vec_add1(slm->free_ports, port - slm->ports);
+}
+
+/* The I/O thread can't log, it stays off the VPP heap */
+static void
+sfp_led_log_open_errors(sfp_led_port_t *port)
+{
+    if (port->link_led_errno)
+        clib_warning("Failed to open %v: %s", port->link_led_path,
+                     strerror(port->link_led_errno));
+    if (port->activity_led_errno)
+        clib_warning("Failed to open %v: %s", port->activity_led_path,
+                     strerror(port->activity_led_errno));
+    if (port->sfp_debug_errno)
+        clib_warning("Failed to open %v: %s (module detection disabled)",
+                     port->sfp_debug_path, strerror(port->sfp_debug_errno));
+}
+
+static void
+sfp_led_drain_state(sfp_led_main_t *slm)
+{
+    sfp_led_port_t *port;
+    sfp_led_msg_t msg;
+    
+    while (sfp_led_ring_pop(slm->state_ring, &msg) == 0) {
+        port = vec_elt_at_index(slm->ports, msg.port_index);
+        
+        if (msg.op == SFP_LED_OP_CLOSED) {
+            sfp_led_port_free(slm, port);
+            continue;
+        }
+        
+        /* Left over from before the port was removed */
+        if (port->deleted)
+            continue;
+        
+        if (msg.op == SFP_LED_OP_DOM) {
+            sfp_led_dom_pickup(port);
+            continue;
+        }
+        
+        if (msg.op == SFP_LED_OP_OPENED) {
+            sfp_led_log_open_errors(port);
+            port->last_module_present = (msg.value & SFP_STATE_MODULE) != 0;
+            clib_warning("Initialized SFP LED control for %v (sw_if_index=%d, module_present=%d)",
+                        port->vpp_interface_name, port->sw_if_index, port->last_module_present);
+            sfp_led_update_link_led(slm->vnet_main, port);
+        } else if (msg.op == SFP_LED_OP_SFP_STATE) {
+            sfp_led_module_changed(slm, port, (msg.value & SFP_STATE_MODULE) != 0);
+        }
+        port->last_rx_los = (msg.value & SFP_STATE_RX_LOS) != 0;
+        sfp_led_stat_set(port, SFP_LED_STAT_MODULE_PRESENT, port->last_module_present);
+        sfp_led_stat_set(port, SFP_LED_STAT_RX_LOS, port->last_rx_los);
+        sfp_led_port_changed(slm, port);
+    }
+}
+
+static void
+sfp_led_runtime_publish(sfp_led_main_t *slm)
+{
+    sfp_led_io_stats_t *io = &slm->io_stats;
+    u64 values[SFP_LED_N_RT_STATS] = {
+        [SFP_LED_RT_PROCESS_CALLS] = slm->process_cost.calls,
+        [SFP_LED_RT_PROCESS_CLOCKS] = slm->process_cost.clocks,
+        [SFP_LED_RT_PROCESS_MAX_CLOCKS] = slm->process_cost.max_clocks,
+        [SFP_LED_RT_CALLBACK_CALLS] = slm->callback_cost.calls,
+        [SFP_LED_RT_CALLBACK_CLOCKS] = slm->callback_cost.clocks,
+        [SFP_LED_RT_CALLBACK_MAX_CLOCKS] = slm->callback_cost.max_clocks,
+        [SFP_LED_RT_MAIN_SYSCALLS] = slm->main_syscalls,
+        [SFP_LED_RT_IO_WAKEUPS] = io->wakeups,
+        [SFP_LED_RT_IO_SYSCALLS] = io->syscalls,
+        [SFP_LED_RT_IO_READ_ERRORS] = io->read_errors,
+        [SFP_LED_RT_IO_WRITE_ERRORS] = io->write_errors,
+        [SFP_LED_RT_IO_MAX_CLOCKS] = io->max_io_clocks,
+        [SFP_LED_RT_LINK_EVENTS] = io->link_events,
+        [SFP_LED_RT_LINK_LATENCY_CLOCKS] = io->link_latency_clocks,
+        [SFP_LED_RT_LINK_MAX_LATENCY_CLOCKS] = io->link_max_latency_clocks,
+    };
+    int i;
+    
+    for (i = 0; i < SFP_LED_N_RT_STATS; i++) {
+        if (slm->rt_stats[i] != ~0)
+            vlib_stats_set_gauge(slm->rt_stats[i], values[i]);
+    }
+}
+
+/* The I/O thread has module state for us */
+static clib_error_t *
+sfp_led_state_ready(clib_file_t *uf)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    u64 start = clib_cpu_time_now();
+    u64 count;
+    
+    read(uf->file_descriptor, &count, sizeof(count));
+    slm->main_syscalls++;
+    sfp_led_drain_state(slm);
+    sfp_led_kick(slm);
+    sfp_led_cost_add(&slm->callback_cost, start);
+    sfp_led_runtime_publish(slm);
+    return 0;
+}
+
+static clib_error_t *
+sfp_led_io_start(sfp_led_main_t *slm)
+{
+    clib_file_t template = { 0 };
+    sigset_t sigs, old_sigs;
+    clib_error_t *error;
+    int rv;
+    
+    /* The I/O thread holds on to ports, it must never be reallocated */
+    vec_alloc(slm->ports, SFP_LED_MAX_PORTS - vec_len(slm->ports));
+    
+    slm->cmd_ring = clib_mem_alloc_aligned(sizeof(sfp_led_ring_t), CLIB_CACHE_LINE_BYTES);
+    slm->state_ring = clib_mem_alloc_aligned(sizeof(sfp_led_ring_t), CLIB_CACHE_LINE_BYTES);
+    clib_memset(slm->cmd_ring, 0, sizeof(sfp_led_ring_t));
+    clib_memset(slm->state_ring, 0, sizeof(sfp_led_ring_t));
+    
+    slm->io_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    slm->state_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (slm->io_eventfd < 0 || slm->state_eventfd < 0) {
+        error = clib_error_return_unix(0, "eventfd");
+        if (slm->state_eventfd >= 0)
+            close(slm->state_eventfd);
+        slm->state_eventfd = -1;
+        goto free_rings;
+    }
+    
+    template.read_function = sfp_led_state_ready;
+    template.file_descriptor = slm->state_eventfd;
+    template.description = format(0, "sfp-led state");
+    slm->state_file_index = clib_file_add(&file_main, &template);
+    
+    /* Termination signals are for the main thread, the I/O thread inherits the mask */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+    rv = pthread_create(&slm->io_thread, NULL, sfp_led_io_thread_fn, slm);
+    pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+    if (rv) {
+        error = clib_error_return(0, "pthread_create: %s", strerror(rv));
+        /* Closes state_eventfd as well */
+        clib_file_del_by_index(&file_main, slm->state_file_index);
+        slm->state_eventfd = -1;
+        goto free_rings;
+    }
+    pthread_setname_np(slm->io_thread, "sfp_led_io");
+    
+    slm->io_running = 1;
+    return 0;
+    
+free_rings:
+    /* Called again on the next port add, start from scratch then */
+    if (slm->io_eventfd >= 0)
+        close(slm->io_eventfd);
+    slm->io_eventfd = -1;
+    clib_mem_free(slm->cmd_ring);
+    clib_mem_free(slm->state_ring);
+    slm->cmd_ring = 0;
+    slm->state_ring = 0;
+    return error;
+}
+
+/* Stop the I/O thread, which turns all LEDs off on its way out */
+static void
+sfp_led_cleanup(void)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    sfp_led_msg_t msg = { .op = SFP_LED_OP_SHUTDOWN };
+    u64 one = 1;
+    
+    if (!slm->io_running)
+        return;
+    slm->io_running = 0;
+    
+    /* The I/O thread never waits for us, it always gets to drain cmd_ring */
+    while (sfp_led_ring_push(slm->cmd_ring, &msg) < 0)
+        write(slm->io_eventfd, &one, sizeof(one));
+    write(slm->io_eventfd, &one, sizeof(one));
+    pthread_join(slm->io_thread, NULL);
+    
+    /* Closes state_eventfd as well */
+    clib_file_del_by_index(&file_main, slm->state_file_index);
+    close(slm->io_eventfd);
+    slm->io_eventfd = -1;
+}
+
+static clib_error_t *
+sfp_led_link_change(vnet_main_t *vnm, u32 hw_if_index, u32 flags)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    vnet_hw_interface_t *hi = vnet_get_hw_interface(vnm, hw_if_index);
+    u32 sw_if_index = hi->sw_if_index;
+    u64 start = clib_cpu_time_now();
+    
+    sfp_led_port_t *port = sfp_led_port_by_sw_if_index(slm, sw_if_index);
+    if (!port)
+        return 0;
+    
+    u8 link_up = (flags & VNET_HW_INTERFACE_FLAG_LINK_UP) != 0;
+    u8 module_present = port->last_module_present;
+    
+    vnet_sw_interface_t *si = vnet_get_sw_interface(vnm, sw_if_index);
+    u8 admin_up = (si->flags & VNET_SW_INTERFACE_FLAG_ADMIN_UP) != 0;
+    
+    slm->event_clock = start;
+    if (module_present && admin_up && link_up) {
+        sfp_led_set_link(port, 1);
+        clib_warning("%v: link up", port->vpp_interface_name);
+    } else {
+        sfp_led_set_link(port, 0);
+        if (module_present) {
+            clib_warning("%v: link down", port->vpp_interface_name);
+        }
+    }
+    slm->event_clock = 0;
+    
+    port->last_link_state = link_up;
+    sfp_led_port_changed(slm, port);
+    
+    sfp_led_kick(slm);
+    sfp_led_cost_add(&slm->callback_cost, start);
+    return 0;
+}
+
+VNET_HW_INTERFACE_LINK_UP_DOWN_FUNCTION(sfp_led_link_change);
+
+static clib_error_t *
+sfp_led_admin_change(vnet_main_t *vnm, u32 sw_if_index, u32 flags)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    u64 start = clib_cpu_time_now();
+    
+    sfp_led_port_t *port = sfp_led_port_by_sw_if_index(slm, sw_if_index);
+    if (!port)
+        return 0;
+    
+    u8 module_present = port->last_module_present;
+    u8 admin_up = (flags & VNET_SW_INTERFACE_FLAG_ADMIN_UP) != 0;
+    
+    vnet_hw_interface_t *hi = vnet_get_sup_hw_interface(vnm, sw_if_index);
+    u8 link_up = (hi->flags & VNET_HW_INTERFACE_FLAG_LINK_UP) != 0;
+    
+    slm->event_clock = start;
+    sfp_led_set_link(port, module_present && admin_up && link_up);
+    slm->event_clock = 0;
+    sfp_led_port_changed(slm, port);
+    
+    sfp_led_kick(slm);
+    sfp_led_cost_add(&slm->callback_cost, start);
+    return 0;
+}
+
+VNET_SW_INTERFACE_ADMIN_UP_DOWN_FUNCTION(sfp_led_admin_change);
+
+/*
+ * Activity LED without traffic to show: solid while the link is down with
+ * a module in, off without one. Up with a module, it is sampled.
+ */
+static void
+sfp_led_update_port(sfp_led_main_t *slm, sfp_led_port_t *port)
+{
+    u8 sampling = 0;
+    
+    if (port->deleted)
+        return;
+    
+    if (port->last_module_present && port->sw_if_index != ~0) {
+        vnet_sw_interface_t *si = 
+            vnet_get_sw_interface(slm->vnet_main, port->sw_if_index);
+        vnet_hw_interface_t *hi = 
+            vnet_get_sup_hw_interface(slm->vnet_main, port->sw_if_index);
+        
+        u8 admin_up = (si->flags & VNET_SW_INTERFACE_FLAG_ADMIN_UP) != 0;
+        u8 link_up = (hi->flags & VNET_HW_INTERFACE_FLAG_LINK_UP) != 0;
+        
+        if (admin_up && link_up)
+            sampling = 1;
+        else
+            sfp_led_set_activity(port, port->activity_mode == SFP_LED_ACTIVITY_BLINK);
+    } else {
+        sfp_led_set_activity(port, 0);
+    }
+    
+    if (sampling != port->sampling) {
+        u32 port_index = port - slm->ports;
+        
+        port->sampling = sampling;
+        if (sampling)
+            vec_add1(slm->sampled_ports, port_index);
+        else
+            vec_del1(slm->sampled_ports, vec_search(slm->sampled_ports, port_index));
+        port->last_rx_packets = 0;
+        port->last_tx_packets = 0;
+        port->last_sample_time = 0;
+        
+        if (!sampling) {
+            port->rx_pps = port->tx_pps = port->rx_bps = port->tx_bps = 0;
+            sfp_led_stat_set(port, SFP_LED_STAT_RX_PPS, 0);
+            sfp_led_stat_set(port, SFP_LED_STAT_TX_PPS, 0);
+            sfp_led_stat_set(port, SFP_LED_STAT_RX_BPS, 0);
+            sfp_led_stat_set(port, SFP_LED_STAT_TX_BPS, 0);
+        }
+    }
+}
+
+/*
+ * Commands only get dropped on a full cmd_ring. Nothing else would queue
+ * them again until the port changes, so while any are outstanding the
+ * process node comes back on its clock and retries from the current state.
+ */
+static void
+sfp_led_resend(sfp_led_main_t *slm)
+{
+    sfp_led_port_t *port;
+    u32 i, n_ports = vec_len(slm->resend_ports);
+    
+    for (i = 0; i < n_ports; i++) {
+        port = vec_elt_at_index(slm->ports, slm->resend_ports[i]);
+        port->resend = 0;
+        if (port->close_pending) {
+            if (sfp_led_send(port, SFP_LED_OP_CLOSE, 0) == 0)
+                port->close_pending = 0;
+            else
+                sfp_led_resend_later(port);
+        }
+        if (port->deleted)
+            continue;
+        sfp_led_update_link_led(slm->vnet_main, port);
+        sfp_led_update_port(slm, port);
+    }
+    
+    /* Ports dropped again above were appended after these */
+    vec_delete(slm->resend_ports, n_ports, 0);
+}
+
+static_always_inline f64
+sfp_led_ewma(f64 avg, u64 delta, f64 dt, f64 weight)
+{
+    return avg + weight * (delta / dt - avg);
+}
+
+/* Rates from the same deltas the activity LED looks at */
+static void
+sfp_led_update_rates(sfp_led_port_t *port, f64 now, vlib_counter_t *rx, vlib_counter_t *tx)
+{
+    f64 dt = now - port->last_sample_time;
+    f64 weight;
+    
+    if (port->last_sample_time != 0 && dt > 0) {
+        weight = dt >= RATE_EWMA_SEC ? 1.0 : dt / RATE_EWMA_SEC;
+        port->rx_pps = sfp_led_ewma(port->rx_pps, rx->packets - port->last_rx_packets, dt, weight);
+        port->tx_pps = sfp_led_ewma(port->tx_pps, tx->packets - port->last_tx_packets, dt, weight);
+        port->rx_bps = sfp_led_ewma(port->rx_bps, (rx->bytes - port->last_rx_bytes) * 8, dt, weight);
+        port->tx_bps = sfp_led_ewma(port->tx_bps, (tx->bytes - port->last_tx_bytes) * 8, dt, weight);
+        
+        sfp_led_stat_set(port, SFP_LED_STAT_RX_PPS, port->rx_pps);
+        sfp_led_stat_set(port, SFP_LED_STAT_TX_PPS, port->tx_pps);
+        sfp_led_stat_set(port, SFP_LED_STAT_RX_BPS, port->rx_bps);
+        sfp_led_stat_set(port, SFP_LED_STAT_TX_BPS, port->tx_bps);
+    }
+    
+    port->last_sample_time = now;
+    port->last_rx_bytes = rx->bytes;
+    port->last_tx_bytes = tx->bytes;
+}
+
+static void
+sfp_led_sample_activity(sfp_led_port_t *port, f64 now, vlib_counter_t *rx, vlib_counter_t *tx)
+{
+    u64 rx_packets = rx->packets;
+    u64 tx_packets = tx->packets;
+    
+    sfp_led_update_rates(port, now, rx, tx);
+    
+    if (port->activity_mode != SFP_LED_ACTIVITY_BLINK) {
+        sfp_led_set_activity(port, port->activity_mode == SFP_LED_ACTIVITY_SOLID);
+    } else if (rx_packets != port->last_rx_packets || tx_packets != port->last_tx_packets) {
+        sfp_led_set_activity(port, !port->activity_led_state);
+    } else {
+        sfp_led_set_activity(port, 0);
+    }
+    
+    port->last_rx_packets = rx_packets;
+    port->last_tx_packets = tx_packets;
+}
+
+/*
+ * Sum the counters of all sampled ports thread by thread, walking each
+ * thread's counter vector once instead of every thread per port.
+ */
+static void
+sfp_led_sample_ports(sfp_led_main_t *slm, f64 now)
+{
+    vlib_combined_counter_main_t *rxc = 
+        &slm->vnet_main->interface_main.combined_sw_if_counters[VNET_INTERFACE_COUNTER_RX];
+    vlib_combined_counter_main_t *txc = 
+        &slm->vnet_main->interface_main.combined_sw_if_counters[VNET_INTERFACE_COUNTER_TX];
+    u32 n_ports = vec_len(slm->sampled_ports);
+    u32 i, thread;
+    
+    vec_validate(slm->rx_sums, n_ports - 1);
+    vec_validate(slm->tx_sums, n_ports - 1);
+    clib_memset(slm->rx_sums, 0, n_ports * sizeof(vlib_counter_t));
+    clib_memset(slm->tx_sums, 0, n_ports * sizeof(vlib_counter_t));
+    
+    for (thread = 0; thread < vec_len(rxc->counters); thread++) {
+        vlib_counter_t *rx = rxc->counters[thread];
+        vlib_counter_t *tx = txc->counters[thread];
+        
+        for (i = 0; i < n_ports; i++) {
+            u32 sw_if_index = slm->ports[slm->sampled_ports[i]].sw_if_index;
+            
+            slm->rx_sums[i].packets += rx[sw_if_index].packets;
+            slm->rx_sums[i].bytes += rx[sw_if_index].bytes;
+            slm->tx_sums[i].packets += tx[sw_if_index].packets;
+            slm->tx_sums[i].bytes += tx[sw_if_index].bytes;
+        }
+    }
+    
+    for (i = 0; i < n_ports; i++)
+        sfp_led_sample_activity(vec_elt_at_index(slm->ports, slm->sampled_ports[i]),
+                                now, &slm->rx_sums[i], &slm->tx_sums[i]);
+}
+
+static uword
+sfp_led_process(vlib_main_t *vm, vlib_node_runtime_t *rt, vlib_frame_t *f)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    uword event_type, *event_data = 0, *port_index;
+    u64 start;
+    
+    while (1) {
+        /* With nothing to sample or resend this sleeps until a port changes */
+        if (vec_len(slm->sampled_ports) || vec_len(slm->resend_ports))
+            vlib_process_wait_for_event_or_clock(vm, POLL_INTERVAL_SEC);
+        else
+            vlib_process_wait_for_event(vm);
+        
+        start = clib_cpu_time_now();
+        event_type = vlib_process_get_events(vm, &event_data);
+        
+        if (event_type == SFP_LED_EVENT_PORT_CHANGED) {
+            vec_foreach(port_index, event_data)
+                sfp_led_update_port(slm, vec_elt_at_index(slm->ports, *port_index));
+        } else if (vec_len(slm->sampled_ports)) {
+            sfp_led_sample_ports(slm, vlib_time_now(vm));
+        }
+        
+        vec_reset_length(event_data);
+        sfp_led_resend(slm);
+        sfp_led_kick(slm);
+        sfp_led_cost_add(&slm->process_cost, start);
+        sfp_led_runtime_publish(slm);
+    }
+    
+    return 0;
+}
+
+VLIB_REGISTER_NODE(sfp_led_process_node) = {
+    .function = sfp_led_process,
+    .type = VLIB_NODE_TYPE_PROCESS,
+    .name = "sfp-led-process",
+};
+
+static u8 *
+format_sfp_led_cost(u8 *s, va_list *args)
+{
+    char *name = va_arg(*args, char *);
+    sfp_led_cost_t *cost = va_arg(*args, sfp_led_cost_t *);
+    f64 us_per_clock = va_arg(*args, f64);
+    f64 avg = cost->calls ? (f64)cost->clocks / cost->calls : 0;
+    
+    return format(s, "%-10s %12llu %12.3f %12.3f", name, cost->calls,
+                  avg * us_per_clock, cost->max_clocks * us_per_clock);
+}
+
+static clib_error_t *
+sfp_led_show_runtime_command_fn(vlib_main_t *vm, unformat_input_t *input,
+                                vlib_cli_command_t *cmd)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    sfp_led_io_stats_t *io = &slm->io_stats;
+    f64 us_per_clock = 1e6 / vm->clocks_per_second;
+    u64 process_calls = clib_max(slm->process_cost.calls, 1);
+    u64 wakeups = clib_max(io->wakeups, 1);
+    u64 io_count = clib_max(io->reads + io->writes, 1);
+    u64 link_events = clib_max(io->link_events, 1);
+    
+    vlib_cli_output(vm, "Main thread:");
+    vlib_cli_output(vm, "  %-10s %12s %12s %12s", "", "calls", "avg us", "max us");
+    vlib_cli_output(vm, "  %U", format_sfp_led_cost, "process", &slm->process_cost, us_per_clock);
+    vlib_cli_output(vm, "  %U", format_sfp_led_cost, "callbacks", &slm->callback_cost, us_per_clock);
+    vlib_cli_output(vm, "  syscalls %llu (%.2f per process call), ring drops %llu",
+                     slm->main_syscalls, (f64)slm->main_syscalls / process_calls,
+                     slm->cmd_drops);
+    
+    vlib_cli_output(vm, "I/O thread:");
+    vlib_cli_output(vm, "  wakeups %llu, syscalls %llu (%.2f per wakeup)",
+                     io->wakeups, io->syscalls, (f64)io->syscalls / wakeups);
+    vlib_cli_output(vm, "  debugfs reads %llu (%llu failed), sysfs writes %llu (%llu failed)",
+                     io->reads, io->read_errors, io->writes, io->write_errors);
+    vlib_cli_output(vm, "  I/O avg %.3f us, slowest %.3f us",
+                     (f64)io->io_clocks / io_count * us_per_clock,
+                     io->max_io_clocks * us_per_clock);
+    vlib_cli_output(vm, "  link event to LED avg %.3f us, slowest %.3f us (%llu events)",
+                     (f64)io->link_latency_clocks / link_events * us_per_clock,
+                     io->link_max_latency_clocks * us_per_clock, io->link_events);
+    
+    return 0;
+}
+
+VLIB_CLI_COMMAND(sfp_led_show_runtime_command, static) = {
+    .path = "show sfp-led runtime",
+    .short_help = "show sfp-led runtime",
+    .function = sfp_led_show_runtime_command_fn,
+};
+
+static u8 *
+format_sfp_led_dbm(u8 *s, va_list *args)
+{
+    f64 mw = va_arg(*args, f64);
+    
+    return format(s, "%.2f", mw > 0 ? 10 * log10(mw) : DOM_POWER_FLOOR_DBM);
+}
+
+static clib_error_t *
+sfp_led_show_dom_command_fn(vlib_main_t *vm, unformat_input_t *input,
+                            vlib_cli_command_t *cmd)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    sfp_led_port_t *port;
+    f64 now = vlib_time_now(vm);
+    
+    if (!slm->get_module_eeprom)
+        return clib_error_return(0, "DPDK module EEPROM API not available");
+    
+    vlib_cli_output(vm, "%-24s %8s %7s %8s %9s %9s %6s", "Interface", "Temp C",
+                     "Vcc V", "Bias mA", "TX dBm", "RX dBm", "Age s");
+    
+    vec_foreach(port, slm->ports) {
+        sfp_led_dom_t *dom = &port->dom;
+        
+        if (port->deleted)
+            continue;
+        
+        if (port->dpdk_port_id == (u16)~0) {
+            vlib_cli_output(vm, "%-24v not a DPDK port", port->vpp_interface_name);
+        } else if (!port->last_module_present) {
+            vlib_cli_output(vm, "%-24v no module", port->vpp_interface_name);
+        } else if (!dom->valid) {
+            vlib_cli_output(vm, "%-24v no diagnostics", port->vpp_interface_name);
+        } else {
+            vlib_cli_output(vm, "%-24v %8.1f %7.3f %8.3f %9U %9U %6.0f",
+                             port->vpp_interface_name, dom->temp_c, dom->vcc_v,
+                             dom->tx_bias_ma, format_sfp_led_dbm, dom->tx_power_mw,
+                             format_sfp_led_dbm, dom->rx_power_mw, now - port->dom_time);
         }
     }
     
-    port->last_module_present = read_module_present(port->sfp_debug_fd);
-    port->last_link_state = 0;
-    port->last_rx_packets = 0;
-    port->last_tx_packets = 0;
-    port->activity_led_state = 0;
-    port->activity_blink_countdown = 0;
-    port->skip_activity_monitoring = 0;
+    return 0;
+}
+
+VLIB_CLI_COMMAND(sfp_led_show_dom_command, static) = {
+    .path = "show sfp-led dom",
+    .short_help = "show sfp-led dom",
+    .function = sfp_led_show_dom_command_fn,
+};
+
+static uword
+unformat_sfp_led_activity_mode(unformat_input_t *input, va_list *args)
+{
+    u8 *mode = va_arg(*args, u8 *);
+    int i;
+    
+    for (i = 0; i < SFP_LED_N_ACTIVITY_MODES; i++) {
+        if (unformat(input, sfp_led_activity_mode_names[i])) {
+            *mode = i;
+            return 1;
+        }
+    }
     
-    set_led_brightness(port->link_led_fd, LED_OFF);
-    set_led_brightness(port->activity_led_fd, LED_OFF);
+    return 0;
+}
+
+/*
+ * The I/O thread only fields at the end are left alone, a reused slot may
+ * still be on the I/O thread's books and it resets them itself on open.
+ * Fresh slots have been zeroed, the I/O thread has never seen them.
+ */
+static void
+sfp_led_port_init(sfp_led_port_t *port, u8 *interface_name)
+{
+    memset(port, 0, STRUCT_OFFSET_OF(sfp_led_port_t, link_led_fd));
+    port->vpp_interface_name = interface_name;
+    port->sw_if_index = ~0;
+    port->dpdk_port_id = ~0;
+    clib_memset(port->stats, 0xff, sizeof(port->stats));
+}
+
+static clib_error_t *
+sfp_led_config(vlib_main_t *vm, unformat_input_t *input)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    sfp_led_port_t *port = NULL;
+    u8 *interface_name = NULL;
+    
+    while (unformat_check_input(input) != UNFORMAT_END_OF_INPUT) {
+        if (unformat(input, "root %v", &slm->root))
+            ;
+        else if (unformat(input, "interface %v", &interface_name)) {
+            if (vec_len(slm->ports) >= SFP_LED_MAX_PORTS)
+                return clib_error_return(0, "more than %d ports", SFP_LED_MAX_PORTS);
+            vec_add2(slm->ports, port, 1);
+            memset(port, 0, sizeof(*port));
+            sfp_led_port_init(port, interface_name);
+            interface_name = NULL;
+        }
+        else if (port && unformat(input, "linux-interface %v", &port->linux_interface_name))
+            ;
+        else if (port && unformat(input, "link-led %v", &port->link_led_path))
+            ;
+        else if (port && unformat(input, "activity-led %v", &port->activity_led_path))
+            ;
+        else if (port && unformat(input, "sfp-debug %v", &port->sfp_debug_path))
+            ;
+        else if (port && unformat(input, "activity-mode %U", unformat_sfp_led_activity_mode,
+                                  &port->activity_mode))
+            ;
+        else {
+            return clib_error_return(0, "unknown input `%U'",
+                                   format_unformat_error, input);
+        }
+    }
+    
+    return 0;
+}
+
+VLIB_CONFIG_FUNCTION(sfp_led_config, "sfp-led");
+
+static void
+sfp_led_dpdk_init(sfp_led_main_t *slm)
+{
+    slm->dpdk_main = vlib_get_plugin_symbol("dpdk_plugin.so", "dpdk_main");
+    slm->get_module_info = 
+        vlib_get_plugin_symbol("dpdk_plugin.so", "rte_eth_dev_get_module_info");
+    slm->get_module_eeprom = 
+        vlib_get_plugin_symbol("dpdk_plugin.so", "rte_eth_dev_get_module_eeprom");
+    
+    if (!slm->dpdk_main || !slm->get_module_info || !slm->get_module_eeprom) {
+        clib_warning("DPDK module EEPROM API not available, no module diagnostics");
+        slm->dpdk_main = 0;
+        slm->get_module_info = 0;
+        slm->get_module_eeprom = 0;
+    }
+}
+
+/* The ethdev port behind a VPP interface, if the dpdk plugin drives it */
+static u16
+sfp_led_dpdk_port_id(sfp_led_main_t *slm, vnet_main_t *vnm, u32 sw_if_index)
+{
+    vnet_hw_interface_t *hi = vnet_get_sup_hw_interface(vnm, sw_if_index);
+    vnet_device_class_t *dc = vnet_get_device_class(vnm, hi->dev_class_index);
+    
+    if (!slm->dpdk_main || strcmp(dc->name, "dpdk") != 0 ||
+        hi->dev_instance >= vec_len(slm->dpdk_main->devices))
+        return ~0;
+    
+    return slm->dpdk_main->devices[hi->dev_instance].port_id;
+}
+
+/* Map the port to its interface and have the I/O thread open its files */
+static int
+sfp_led_port_bind(sfp_led_main_t *slm, sfp_led_port_t *port, u32 sw_if_index)
+{
+    port->sw_if_index = sw_if_index;
+    port->dpdk_port_id = sfp_led_dpdk_port_id(slm, slm->vnet_main, sw_if_index);
+    sfp_led_stats_register(port);
+    
+    if (sfp_led_send(port, SFP_LED_OP_OPEN, 0) < 0) {
+        sfp_led_stats_unregister(port);
+        return -1;
+    }
+    
+    vec_validate_init_empty(slm->port_by_sw_if_index, sw_if_index, ~0);
+    slm->port_by_sw_if_index[sw_if_index] = port - slm->ports;
+    return 0;
+}
+
+/* Resolves the interface here, the files are opened by the I/O thread */
+static clib_error_t *
+setup_sfp_port(sfp_led_port_t *port, vnet_main_t *vnm)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    char *ifname_cstr = (char *)format(0, "%v%c", port->vpp_interface_name, 0);
+    
+    u32 sw_if_index = ~0;
+    
+    unformat_input_t input;
+    unformat_init_string(&input, ifname_cstr, strlen(ifname_cstr));
+    
+    if (!unformat_user(&input, unformat_vnet_sw_interface, vnm, &sw_if_index)) {
+        unformat_free(&input);
+        vec_free(ifname_cstr);
+        return clib_error_return(0, "Interface %v not found",
+                                port->vpp_interface_name);
+    }
+    unformat_free(&input);
+    vec_free(ifname_cstr);
+    
+    if (sfp_led_port_by_sw_if_index(slm, sw_if_index))
+        return clib_error_return(0, "%v: configured twice", port->vpp_interface_name);
+    
+    if (sfp_led_port_bind(slm, port, sw_if_index) < 0)
+        return clib_error_return(0, "%v: I/O thread not running", port->vpp_interface_name);
+    
+    return 0;
+}
+
+/*
+ * Unmap the port right away, the slot is freed once the I/O thread closed
+ * it. A CLOSE that doesn't fit in cmd_ring is queued by the process node.
+ */
+static void
+sfp_led_port_release(sfp_led_main_t *slm, sfp_led_port_t *port)
+{
+    u32 port_index = port - slm->ports;
+    
+    /* The interface may be on its way out, nothing may refer to it after this */
+    port->deleted = 1;
+    slm->port_by_sw_if_index[port->sw_if_index] = ~0;
+    if (port->sampling) {
+        vec_del1(slm->sampled_ports, vec_search(slm->sampled_ports, port_index));
+        port->sampling = 0;
+    }
+    sfp_led_stats_unregister(port);
+    
+    if (sfp_led_send(port, SFP_LED_OP_CLOSE, 0) < 0) {
+        port->close_pending = 1;
+        sfp_led_resend_later(port);
+        sfp_led_port_changed(slm, port);
+    }
+}
+
+/*
+ * Add, rebind or remove the port on an interface, all in one go on the main
+ * thread. The I/O thread closes the old files before opening the new ones.
+ * The vectors in the args are consumed either way.
+ */
+static int
+sfp_led_port_add_del(sfp_led_main_t *slm, u32 sw_if_index, sfp_led_port_args_t *a, u8 is_add)
+{
+    vnet_main_t *vnm = slm->vnet_main;
+    sfp_led_port_t *port = sfp_led_port_by_sw_if_index(slm, sw_if_index);
+    clib_error_t *error;
+    u8 rebind = port != 0;
+    int rv = 0;
+    
+    if (!vnet_sw_interface_is_valid(vnm, sw_if_index)) {
+        rv = VNET_API_ERROR_INVALID_SW_IF_INDEX;
+        goto done;
+    }
+    
+    if (!is_add) {
+        if (!port)
+            rv = VNET_API_ERROR_NO_SUCH_ENTRY;
+        else
+            sfp_led_port_release(slm, port);
+        goto done;
+    }
+    
+    if (!slm->io_running && (error = sfp_led_io_start(slm))) {
+        clib_error_report(error);
+        rv = VNET_API_ERROR_SYSCALL_ERROR_1;
+        goto done;
+    }
+    
+    /* A rebound port only gives its slot back later */
+    if (vec_len(slm->free_ports) == 0 && vec_len(slm->ports) >= SFP_LED_MAX_PORTS) {
+        rv = VNET_API_ERROR_TABLE_TOO_BIG;
+        goto done;
+    }
+    
+    if (port)
+        sfp_led_port_release(slm, port);
+    
+    if (vec_len(slm->free_ports))
+        port = vec_elt_at_index(slm->ports, vec_pop(slm->free_ports));
+    else {
+        vec_add2(slm->ports, port, 1);
+        memset(port, 0, sizeof(*port));
+    }
+    
+    sfp_led_port_init(port, format(0, "%U", format_vnet_sw_if_index_name, vnm, sw_if_index));
+    port->link_led_path = a->link_led_path;
+    port->activity_led_path = a->activity_led_path;
+    port->sfp_debug_path = a->sfp_debug_path;
+    port->linux_interface_name = a->linux_interface_name;
+    port->activity_mode = a->activity_mode;
+    clib_memset(a, 0, sizeof(*a));
+    
+    if (sfp_led_port_bind(slm, port, sw_if_index) < 0) {
+        port->deleted = 1;
+        sfp_led_port_free(slm, port);
+        rv = VNET_API_ERROR_UNSPECIFIED;
+    } else {
+        clib_warning("%v: SFP LED port %s", port->vpp_interface_name,
+                     rebind ? "rebound" : "added");
+    }
+    
+done:
+    vec_free(a->link_led_path);
+    vec_free(a->activity_led_path);
+    vec_free(a->sfp_debug_path);
+    vec_free(a->linux_interface_name);
+    sfp_led_kick(slm);
+    return rv;
+}
+
+static int
+sfp_led_port_set_activity_mode(sfp_led_main_t *slm, u32 sw_if_index, u8 mode)
+{
+    sfp_led_port_t *port = sfp_led_port_by_sw_if_index(slm, sw_if_index);
+    
+    if (!port)
+        return VNET_API_ERROR_NO_SUCH_ENTRY;
+    if (mode >= SFP_LED_N_ACTIVITY_MODES)
+        return VNET_API_ERROR_INVALID_VALUE;
+    
+    port->activity_mode = mode;
+    sfp_led_port_changed(slm, port);
+    return 0;
+}
+
+/* A port goes away with its interface */
+static clib_error_t *
+sfp_led_interface_add_del(vnet_main_t *vnm, u32 sw_if_index, u32 is_add)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    sfp_led_port_t *port = sfp_led_port_by_sw_if_index(slm, sw_if_index);
     
-    clib_warning("Initialized SFP LED control for %v (sw_if_index=%d, module_present=%d)",
-                port->vpp_interface_name, port->sw_if_index, port->last_module_present);
+    if (!is_add && port) {
+        sfp_led_port_release(slm, port);
+        sfp_led_kick(slm);
+    }
     
     return 0;
 }
 
+VNET_SW_INTERFACE_ADD_DEL_FUNCTION(sfp_led_interface_add_del);
+
+static clib_error_t *
+sfp_led_set_command_fn(vlib_main_t *vm, unformat_input_t *input,
+                       vlib_cli_command_t *cmd)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    unformat_input_t _line_input, *line_input = &_line_input;
+    sfp_led_port_args_t a = { 0 };
+    sfp_led_port_t *port;
+    clib_error_t *error = 0;
+    u32 sw_if_index = ~0;
+    u8 mode = ~0, is_del = 0;
+    int rv;
+    
+    if (!unformat_user(input, unformat_line_input, line_input))
+        return clib_error_return(0, "interface required");
+    
+    while (unformat_check_input(line_input) != UNFORMAT_END_OF_INPUT) {
+        if (unformat(line_input, "%U", unformat_vnet_sw_interface, slm->vnet_main, &sw_if_index))
+            ;
+        else if (unformat(line_input, "link-led %v", &a.link_led_path))
+            ;
+        else if (unformat(line_input, "activity-led %v", &a.activity_led_path))
+            ;
+        else if (unformat(line_input, "sfp-debug %v", &a.sfp_debug_path))
+            ;
+        else if (unformat(line_input, "linux-interface %v", &a.linux_interface_name))
+            ;
+        else if (unformat(line_input, "activity-mode %U", unformat_sfp_led_activity_mode, &mode))
+            ;
+        else if (unformat(line_input, "del"))
+            is_del = 1;
+        else {
+            error = clib_error_return(0, "unknown input `%U'",
+                                      format_unformat_error, line_input);
+            goto done;
+        }
+    }
+    
+    if (sw_if_index == ~0) {
+        error = clib_error_return(0, "interface required");
+        goto done;
+    }
+    
+    port = sfp_led_port_by_sw_if_index(slm, sw_if_index);
+    
+    if (is_del) {
+        rv = sfp_led_port_add_del(slm, sw_if_index, &a, 0);
+    } else if (port && !a.link_led_path && !a.activity_led_path &&
+               !a.sfp_debug_path && !a.linux_interface_name) {
+        /* Only the blink policy changes, the files stay open */
+        rv = mode == (u8)~0 ? 0 : sfp_led_port_set_activity_mode(slm, sw_if_index, mode);
+    } else {
+        /* Rebinding keeps whatever isn't given */
+        if (port) {
+            if (!a.link_led_path)
+                a.link_led_path = vec_dup(port->link_led_path);
+            if (!a.activity_led_path)
+                a.activity_led_path = vec_dup(port->activity_led_path);
+            if (!a.sfp_debug_path)
+                a.sfp_debug_path = vec_dup(port->sfp_debug_path);
+            if (!a.linux_interface_name)
+                a.linux_interface_name = vec_dup(port->linux_interface_name);
+            if (mode == (u8)~0)
+                mode = port->activity_mode;
+        }
+        a.activity_mode = mode == (u8)~0 ? SFP_LED_ACTIVITY_BLINK : mode;
+        rv = sfp_led_port_add_del(slm, sw_if_index, &a, 1);
+    }
+    
+    if (rv)
+        error = clib_error_return(0, "%U", format_vnet_api_errno, rv);
+    
+done:
+    vec_free(a.link_led_path);
+    vec_free(a.activity_led_path);
+    vec_free(a.sfp_debug_path);
+    vec_free(a.linux_interface_name);
+    unformat_free(line_input);
+    return error;
+}
+
+VLIB_CLI_COMMAND(sfp_led_set_command, static) = {
+    .path = "set sfp-led",
+    .short_help = "set sfp-led <interface> [link-led <path>] [activity-led <path>] "
+                  "[sfp-debug <path>] [linux-interface <name>] "
+                  "[activity-mode blink|solid|off] [del]",
+    .function = sfp_led_set_command_fn,
+};
+
+/*
+ * Binary API
+ */
+
+#define REPLY_MSG_ID_BASE slm->msg_id_base
+#include <vlibapi/api_helper_macros.h>
+
+/* Fixed size API strings are only NUL terminated when shorter */
+static u8 *
+sfp_led_api_string(u8 *s, u32 max_len)
+{
+    u32 len = strnlen((char *)s, max_len);
+    u8 *v = 0;
+    
+    if (len)
+        vec_add(v, s, len);
+    return v;
+}
+
+/* The API enum matches sfp_led_activity_mode_t value for value */
+static void
+vl_api_sfp_led_port_add_del_t_handler(vl_api_sfp_led_port_add_del_t *mp)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    vl_api_sfp_led_port_add_del_reply_t *rmp;
+    sfp_led_port_args_t a = { 0 };
+    int rv = 0;
+    
+    VALIDATE_SW_IF_INDEX(mp);
+    
+    if (mp->activity_mode < SFP_LED_N_ACTIVITY_MODES) {
+        a.link_led_path = sfp_led_api_string(mp->link_led, sizeof(mp->link_led));
+        a.activity_led_path = sfp_led_api_string(mp->activity_led, sizeof(mp->activity_led));
+        a.sfp_debug_path = sfp_led_api_string(mp->sfp_debug, sizeof(mp->sfp_debug));
+        a.linux_interface_name = 
+            sfp_led_api_string(mp->linux_interface, sizeof(mp->linux_interface));
+        a.activity_mode = mp->activity_mode;
+        rv = sfp_led_port_add_del(slm, ntohl(mp->sw_if_index), &a, mp->is_add);
+    } else {
+        rv = VNET_API_ERROR_INVALID_VALUE;
+    }
+    
+    BAD_SW_IF_INDEX_LABEL;
+    REPLY_MACRO(VL_API_SFP_LED_PORT_ADD_DEL_REPLY);
+}
+
+static void
+vl_api_sfp_led_port_set_activity_mode_t_handler(vl_api_sfp_led_port_set_activity_mode_t *mp)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    vl_api_sfp_led_port_set_activity_mode_reply_t *rmp;
+    int rv = 0;
+    
+    VALIDATE_SW_IF_INDEX(mp);
+    
+    rv = sfp_led_port_set_activity_mode(slm, ntohl(mp->sw_if_index), mp->activity_mode);
+    
+    BAD_SW_IF_INDEX_LABEL;
+    REPLY_MACRO(VL_API_SFP_LED_PORT_SET_ACTIVITY_MODE_REPLY);
+}
+
+#include <sfp_led/sfp_led.api.c>
+
 static clib_error_t *
 sfp_led_init(vlib_main_t *vm)
 {
     sfp_led_main_t *slm = &sfp_led_main;
     vnet_main_t *vnm = vnet_get_main();
+    int i;
     
     slm->vnet_main = vnm;
     slm->process_node_index = sfp_led_process_node.index;
+    slm->io_eventfd = -1;
+    slm->state_eventfd = -1;
+    for (i = 0; i < SFP_LED_N_RT_STATS; i++)
+        slm->rt_stats[i] = vlib_stats_add_gauge("/sfp-led/%s", sfp_led_rt_stat_names[i]);
+    slm->msg_id_base = setup_message_id_table();
+    sfp_led_dpdk_init(slm);
     
+    /* VPP's own termination handling exits through here or the main loop exit */
     atexit(sfp_led_cleanup);
-    signal(SIGTERM, sfp_led_signal_handler);
-    signal(SIGINT, sfp_led_signal_handler);
     
     return 0;
 }
@@ -525,6 +2251,39 @@ VLIB_INIT_FUNCTION(sfp_led_init) = {
     .runs_after = VLIB_INITS("dpdk_init"),
 };
 
+/*
+ * Ports from startup.conf are bound once the interfaces exist and the I/O
+ * thread runs. Without any, the I/O thread waits for the first runtime add.
+ */
+static clib_error_t *
+sfp_led_main_loop_enter(vlib_main_t *vm)
+{
+    sfp_led_main_t *slm = &sfp_led_main;
+    sfp_led_port_t *port;
+    clib_error_t *error;
+    
+    if (vec_len(slm->ports) == 0)
+        return 0;
+    
+    if ((error = sfp_led_io_start(slm)))
+        return error;
+    
+    vec_foreach(port, slm->ports) {
+        error = setup_sfp_port(port, slm->vnet_main);
+        if (error) {
+            clib_warning("Failed to setup SFP LED port: %s", error->what);
+            clib_error_free(error);
+            port->deleted = 1;
+            sfp_led_port_free(slm, port);
+        }
+    }
+    
+    sfp_led_kick(slm);
+    return 0;
+}
+
+VLIB_MAIN_LOOP_ENTER_FUNCTION(sfp_led_main_loop_enter);
+
 static clib_error_t *
 sfp_led_exit(vlib_main_t *vm)
 {